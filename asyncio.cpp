@@ -0,0 +1,711 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "asyncio.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined( __linux__ ) && ! defined( ASYNCIO_NO_IO_URING )
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define ASYNCIO_HAS_IO_URING
+#endif
+
+
+
+// one block read or write, identified by its slot number
+typedef struct {
+        uint8_t *buffer;
+        uint64_t numBytes;
+        uint64_t offset;
+        char isWrite;
+
+        // bytes transferred, or -1 on error, once done
+        int64_t result;
+        char done;
+
+#ifdef ASYNCIO_HAS_IO_URING
+        struct iovec iov;
+#endif
+    } Request;
+
+
+
+// submits slot requests and waits for them, through io_uring or a pool
+// of threads
+// I/O引擎: io_uring或线程池
+typedef struct {
+        int fd;
+
+        std::vector<Request> slots;
+
+#ifdef ASYNCIO_HAS_IO_URING
+        char useRing;
+
+        int ringFD;
+
+        void *sqRing;
+        void *cqRing;
+        uint64_t sqRingSize;
+        uint64_t cqRingSize;
+
+        struct io_uring_sqe *sqes;
+        uint64_t sqesSize;
+
+        unsigned int *sqTail;
+        unsigned int *sqMask;
+        unsigned int *sqArray;
+
+        unsigned int *cqHead;
+        unsigned int *cqTail;
+        unsigned int *cqMask;
+        struct io_uring_cqe *cqes;
+#endif
+
+        // thread pool, when not using ring
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable doneSignal;
+        std::deque<unsigned int> queue;
+        char stop;
+    } Engine;
+
+
+
+// transfers whole request with positioned reads or writes, picking up
+// where a short transfer left off
+// returns bytes transferred (fewer only at end of file), or -1 on error
+static int64_t transferRest( int inFD, Request *inR, uint64_t inDone ) {
+    while( inDone < inR->numBytes ) {
+#ifdef _MSC_VER
+        // no positioned I/O, callers serialize through engine lock
+        if( _lseeki64( inFD, inR->offset + inDone, SEEK_SET ) < 0 ) {
+            return -1;
+            }
+        int64_t n = inR->isWrite ?
+            _write( inFD, inR->buffer + inDone,
+                    (unsigned int)( inR->numBytes - inDone ) ) :
+            _read( inFD, inR->buffer + inDone,
+                   (unsigned int)( inR->numBytes - inDone ) );
+#else
+        int64_t n = inR->isWrite ?
+            pwrite( inFD, inR->buffer + inDone, inR->numBytes - inDone,
+                    inR->offset + inDone ) :
+            pread( inFD, inR->buffer + inDone, inR->numBytes - inDone,
+                   inR->offset + inDone );
+#endif
+        if( n < 0 ) {
+            return -1;
+            }
+        if( n == 0 ) {
+            // end of file
+            break;
+            }
+        inDone += n;
+        }
+    return inDone;
+    }
+
+
+
+static void workerLoop( Engine *inEngine ) {
+    std::unique_lock<std::mutex> lock( inEngine->lock );
+
+    while( true ) {
+        while( inEngine->queue.empty() && ! inEngine->stop ) {
+            inEngine->wake.wait( lock );
+            }
+        if( inEngine->queue.empty() ) {
+            break;
+            }
+
+        Request *r = &( inEngine->slots[ inEngine->queue.front() ] );
+        inEngine->queue.pop_front();
+
+#ifndef _MSC_VER
+        lock.unlock();
+#endif
+        int64_t result = transferRest( inEngine->fd, r, 0 );
+#ifndef _MSC_VER
+        lock.lock();
+#endif
+        r->result = result;
+        r->done = true;
+        inEngine->doneSignal.notify_all();
+        }
+    }
+
+
+
+#ifdef ASYNCIO_HAS_IO_URING
+
+static int setupRing( Engine *inEngine, unsigned int inEntries ) {
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+
+    int ringFD = syscall( __NR_io_uring_setup, inEntries, &p );
+
+    if( ringFD < 0 ) {
+        return -1;
+        }
+
+    inEngine->ringFD = ringFD;
+
+    inEngine->sqRingSize = p.sq_off.array + p.sq_entries * sizeof( unsigned int );
+    inEngine->cqRingSize =
+        p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+
+    char singleMap = ( p.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+
+    if( singleMap ) {
+        if( inEngine->cqRingSize > inEngine->sqRingSize ) {
+            inEngine->sqRingSize = inEngine->cqRingSize;
+            }
+        inEngine->cqRingSize = inEngine->sqRingSize;
+        }
+
+    inEngine->sqRing = mmap( NULL, inEngine->sqRingSize,
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ringFD, IORING_OFF_SQ_RING );
+    if( inEngine->sqRing == MAP_FAILED ) {
+        close( ringFD );
+        return -1;
+        }
+
+    if( singleMap ) {
+        inEngine->cqRing = inEngine->sqRing;
+        }
+    else {
+        inEngine->cqRing = mmap( NULL, inEngine->cqRingSize,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE,
+                                 ringFD, IORING_OFF_CQ_RING );
+        if( inEngine->cqRing == MAP_FAILED ) {
+            munmap( inEngine->sqRing, inEngine->sqRingSize );
+            close( ringFD );
+            return -1;
+            }
+        }
+
+    inEngine->sqesSize = p.sq_entries * sizeof( struct io_uring_sqe );
+    inEngine->sqes = (struct io_uring_sqe *)
+        mmap( NULL, inEngine->sqesSize, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQES );
+
+    if( inEngine->sqes == MAP_FAILED ) {
+        if( ! singleMap ) {
+            munmap( inEngine->cqRing, inEngine->cqRingSize );
+            }
+        munmap( inEngine->sqRing, inEngine->sqRingSize );
+        close( ringFD );
+        return -1;
+        }
+
+    uint8_t *sq = (uint8_t *)inEngine->sqRing;
+    uint8_t *cq = (uint8_t *)inEngine->cqRing;
+
+    inEngine->sqTail = (unsigned int *)( sq + p.sq_off.tail );
+    inEngine->sqMask = (unsigned int *)( sq + p.sq_off.ring_mask );
+    inEngine->sqArray = (unsigned int *)( sq + p.sq_off.array );
+
+    inEngine->cqHead = (unsigned int *)( cq + p.cq_off.head );
+    inEngine->cqTail = (unsigned int *)( cq + p.cq_off.tail );
+    inEngine->cqMask = (unsigned int *)( cq + p.cq_off.ring_mask );
+    inEngine->cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+
+    return 0;
+    }
+
+
+
+static void freeRing( Engine *inEngine ) {
+    munmap( inEngine->sqes, inEngine->sqesSize );
+    if( inEngine->cqRing != inEngine->sqRing ) {
+        munmap( inEngine->cqRing, inEngine->cqRingSize );
+        }
+    munmap( inEngine->sqRing, inEngine->sqRingSize );
+    close( inEngine->ringFD );
+    }
+
+
+
+// takes every completion waiting in ring
+static void reapRing( Engine *inEngine ) {
+    unsigned int head = *( inEngine->cqHead );
+    unsigned int tail = __atomic_load_n( inEngine->cqTail, __ATOMIC_ACQUIRE );
+
+    while( head != tail ) {
+        struct io_uring_cqe *cqe = &( inEngine->cqes[ head & *( inEngine->cqMask ) ] );
+
+        Request *r = &( inEngine->slots[ cqe->user_data ] );
+        r->result = cqe->res < 0 ? -1 : cqe->res;
+        r->done = true;
+
+        head++;
+        }
+
+    __atomic_store_n( inEngine->cqHead, head, __ATOMIC_RELEASE );
+    }
+
+#endif
+
+
+
+static void initEngine( Engine *inEngine, int inFD, unsigned int inNumSlots ) {
+    inEngine->fd = inFD;
+    inEngine->slots.resize( inNumSlots );
+    inEngine->stop = false;
+
+#ifdef ASYNCIO_HAS_IO_URING
+    inEngine->useRing = ( setupRing( inEngine, inNumSlots ) == 0 );
+
+    if( inEngine->useRing ) {
+        return;
+        }
+#endif
+
+    // no ring, use a few threads
+    unsigned int numThreads = inNumSlots;
+    if( numThreads > 4 ) {
+        numThreads = 4;
+        }
+
+    for( unsigned int t=0; t<numThreads; t++ ) {
+        inEngine->workers.push_back( std::thread( workerLoop, inEngine ) );
+        }
+    }
+
+
+
+static void submit( Engine *inEngine, unsigned int inSlot,
+                    uint8_t *inBuffer, uint64_t inNumBytes,
+                    uint64_t inOffset, char inIsWrite ) {
+
+    Request *r = &( inEngine->slots[ inSlot ] );
+
+    r->buffer = inBuffer;
+    r->numBytes = inNumBytes;
+    r->offset = inOffset;
+    r->isWrite = inIsWrite;
+    r->result = 0;
+    r->done = false;
+
+#ifdef ASYNCIO_HAS_IO_URING
+    if( inEngine->useRing ) {
+        r->iov.iov_base = inBuffer;
+        r->iov.iov_len = inNumBytes;
+
+        // only producer, no need for atomic read of our own tail
+        unsigned int tail = *( inEngine->sqTail );
+        unsigned int index = tail & *( inEngine->sqMask );
+
+        struct io_uring_sqe *sqe = &( inEngine->sqes[ index ] );
+        memset( sqe, 0, sizeof( *sqe ) );
+
+        sqe->opcode = inIsWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = inEngine->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&( r->iov );
+        sqe->len = 1;
+        sqe->off = inOffset;
+        sqe->user_data = inSlot;
+
+        inEngine->sqArray[ index ] = index;
+
+        __atomic_store_n( inEngine->sqTail, tail + 1, __ATOMIC_RELEASE );
+
+        if( syscall( __NR_io_uring_enter, inEngine->ringFD, 1, 0, 0,
+                     NULL, 0 ) != 1 ) {
+            // couldn't submit, do it right here instead
+            __atomic_store_n( inEngine->sqTail, tail, __ATOMIC_RELEASE );
+            r->result = transferRest( inEngine->fd, r, 0 );
+            r->done = true;
+            }
+        return;
+        }
+#endif
+
+    {
+        std::lock_guard<std::mutex> guard( inEngine->lock );
+        inEngine->queue.push_back( inSlot );
+    }
+    inEngine->wake.notify_one();
+    }
+
+
+
+// waits for request in inSlot to finish
+// returns bytes transferred (fewer than requested only at end of file),
+// or -1 on error
+static int64_t waitFor( Engine *inEngine, unsigned int inSlot ) {
+    Request *r = &( inEngine->slots[ inSlot ] );
+
+#ifdef ASYNCIO_HAS_IO_URING
+    if( inEngine->useRing ) {
+        while( ! r->done ) {
+            reapRing( inEngine );
+
+            if( ! r->done ) {
+                syscall( __NR_io_uring_enter, inEngine->ringFD, 0, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0 );
+                }
+            }
+
+        if( r->result >= 0 && (uint64_t)r->result < r->numBytes ) {
+            // short transfer, finish it ourselves
+            r->result = transferRest( inEngine->fd, r, r->result );
+            }
+        return r->result;
+        }
+#endif
+
+    std::unique_lock<std::mutex> lock( inEngine->lock );
+
+    while( ! r->done ) {
+        inEngine->doneSignal.wait( lock );
+        }
+    return r->result;
+    }
+
+
+
+// caller must have waited for every submitted request
+static void freeEngine( Engine *inEngine ) {
+#ifdef ASYNCIO_HAS_IO_URING
+    if( inEngine->useRing ) {
+        freeRing( inEngine );
+        return;
+        }
+#endif
+
+    {
+        std::lock_guard<std::mutex> guard( inEngine->lock );
+        inEngine->stop = true;
+    }
+    inEngine->wake.notify_all();
+
+    for( size_t t=0; t<inEngine->workers.size(); t++ ) {
+        inEngine->workers[t].join();
+        }
+    }
+
+
+
+struct ASYNCIO_Reader {
+        Engine engine;
+
+        uint8_t *buffers;
+        uint64_t blockBytes;
+        unsigned int numSlots;
+        unsigned int recordSize;
+
+        uint64_t nextOffset;
+        uint64_t end;
+
+        // block n always uses slot n % numSlots
+        uint64_t numSubmitted;
+        uint64_t numConsumed;
+
+        // file came up short, or read failed
+        char ended;
+    };
+
+
+
+ASYNCIO_Reader *ASYNCIO_openReader( int inFD, uint64_t inStart, uint64_t inEnd,
+                                    unsigned int inRecordSize,
+                                    uint64_t inBlockBytes,
+                                    unsigned int inNumInFlight ) {
+
+    if( inNumInFlight < 1 ) {
+        inNumInFlight = 1;
+        }
+
+    // whole records only
+    uint64_t blockBytes = ( inBlockBytes / inRecordSize ) * inRecordSize;
+
+    if( blockBytes == 0 ) {
+        blockBytes = inRecordSize;
+        }
+
+    uint8_t *buffers = (uint8_t *)malloc( blockBytes * inNumInFlight );
+
+    if( buffers == NULL ) {
+        return NULL;
+        }
+
+    ASYNCIO_Reader *r = new ASYNCIO_Reader;
+
+    r->buffers = buffers;
+    r->blockBytes = blockBytes;
+    r->numSlots = inNumInFlight;
+    r->recordSize = inRecordSize;
+    r->nextOffset = inStart;
+    r->end = inEnd;
+    r->numSubmitted = 0;
+    r->numConsumed = 0;
+    r->ended = false;
+
+    initEngine( &( r->engine ), inFD, inNumInFlight );
+
+    // reads start now, while caller does other setup
+    while( r->numSubmitted < r->numSlots && r->nextOffset < r->end ) {
+        uint64_t numBytes = r->end - r->nextOffset;
+
+        if( numBytes > r->blockBytes ) {
+            numBytes = r->blockBytes;
+            }
+
+        unsigned int slot = r->numSubmitted % r->numSlots;
+
+        submit( &( r->engine ), slot, &( r->buffers[ slot * r->blockBytes ] ),
+                numBytes, r->nextOffset, false );
+
+        r->nextOffset += numBytes;
+        r->numSubmitted++;
+        }
+
+    return r;
+    }
+
+
+
+int64_t ASYNCIO_nextBlock( ASYNCIO_Reader *inReader, 
+                           const uint8_t **outBlock ) {
+    ASYNCIO_Reader *r = inReader;
+
+    if( r->ended ) {
+        return 0;
+        }
+
+    // caller is done with last block, its slot can read ahead again
+    while( r->numSubmitted - r->numConsumed < r->numSlots &&
+           r->nextOffset < r->end ) {
+
+        uint64_t numBytes = r->end - r->nextOffset;
+
+        if( numBytes > r->blockBytes ) {
+            numBytes = r->blockBytes;
+            }
+
+        unsigned int slot = r->numSubmitted % r->numSlots;
+
+        submit( &( r->engine ), slot, &( r->buffers[ slot * r->blockBytes ] ),
+                numBytes, r->nextOffset, false );
+
+        r->nextOffset += numBytes;
+        r->numSubmitted++;
+        }
+
+    if( r->numConsumed == r->numSubmitted ) {
+        r->ended = true;
+        return 0;
+        }
+
+    unsigned int slot = r->numConsumed % r->numSlots;
+
+    int64_t result = waitFor( &( r->engine ), slot );
+    r->numConsumed++;
+
+    if( result < 0 ) {
+        r->ended = true;
+        return -1;
+        }
+
+    if( (uint64_t)result < r->engine.slots[ slot ].numBytes ) {
+        // file ends before inEnd, rest of blocks will come back empty
+        r->ended = true;
+        }
+
+    *outBlock = &( r->buffers[ slot * r->blockBytes ] );
+
+    return result / r->recordSize;
+    }
+
+
+
+void ASYNCIO_closeReader( ASYNCIO_Reader *inReader ) {
+    ASYNCIO_Reader *r = inReader;
+
+    // buffers can't go away under reads still in flight
+    while( r->numConsumed < r->numSubmitted ) {
+        waitFor( &( r->engine ), r->numConsumed % r->numSlots );
+        r->numConsumed++;
+        }
+
+    freeEngine( &( r->engine ) );
+    free( r->buffers );
+    delete r;
+    }
+
+
+
+struct ASYNCIO_Writer {
+        Engine engine;
+
+        uint8_t *buffers;
+        uint64_t blockBytes;
+        unsigned int numSlots;
+
+        // bytes waiting in block being filled, slot numSubmitted % numSlots
+        uint64_t fill;
+
+        uint64_t nextOffset;
+
+        uint64_t numSubmitted;
+        uint64_t numCompleted;
+
+        char failed;
+    };
+
+
+
+ASYNCIO_Writer *ASYNCIO_openWriter( int inFD, uint64_t inStart,
+                                    uint64_t inBlockBytes,
+                                    unsigned int inNumInFlight ) {
+    if( inNumInFlight < 1 ) {
+        inNumInFlight = 1;
+        }
+    if( inBlockBytes < 1 ) {
+        inBlockBytes = 1;
+        }
+
+    // one more block than in flight, for the one being filled
+    uint8_t *buffers =
+        (uint8_t *)malloc( inBlockBytes * ( inNumInFlight + 1 ) );
+
+    if( buffers == NULL ) {
+        return NULL;
+        }
+
+    ASYNCIO_Writer *w = new ASYNCIO_Writer;
+
+    w->buffers = buffers;
+    w->blockBytes = inBlockBytes;
+    w->numSlots = inNumInFlight + 1;
+    w->fill = 0;
+    w->nextOffset = inStart;
+    w->numSubmitted = 0;
+    w->numCompleted = 0;
+    w->failed = false;
+
+    initEngine( &( w->engine ), inFD, w->numSlots );
+
+    return w;
+    }
+
+
+
+// waits for oldest write in flight
+static void completeOldestWrite( ASYNCIO_Writer *inWriter ) {
+    ASYNCIO_Writer *w = inWriter;
+
+    unsigned int slot = w->numCompleted % w->numSlots;
+
+    int64_t result = waitFor( &( w->engine ), slot );
+
+    if( result < 0 || (uint64_t)result != w->engine.slots[ slot ].numBytes ) {
+        w->failed = true;
+        }
+    w->numCompleted++;
+    }
+
+
+
+// sends block being filled off to be written
+static void submitFill( ASYNCIO_Writer *inWriter ) {
+    ASYNCIO_Writer *w = inWriter;
+
+    unsigned int slot = w->numSubmitted % w->numSlots;
+
+    submit( &( w->engine ), slot, &( w->buffers[ slot * w->blockBytes ] ),
+            w->fill, w->nextOffset, true );
+
+    w->nextOffset += w->fill;
+    w->numSubmitted++;
+    w->fill = 0;
+
+    // next slot to fill must be free
+    if( w->numSubmitted - w->numCompleted == w->numSlots ) {
+        completeOldestWrite( w );
+        }
+    }
+
+
+
+int ASYNCIO_write( ASYNCIO_Writer *inWriter, const void *inData,
+                   uint64_t inNumBytes ) {
+    ASYNCIO_Writer *w = inWriter;
+
+    const uint8_t *data = (const uint8_t *)inData;
+
+    while( inNumBytes > 0 ) {
+        uint64_t numToCopy = w->blockBytes - w->fill;
+
+        if( numToCopy > inNumBytes ) {
+            numToCopy = inNumBytes;
+            }
+
+        unsigned int slot = w->numSubmitted % w->numSlots;
+
+        memcpy( &( w->buffers[ slot * w->blockBytes + w->fill ] ),
+                data, numToCopy );
+
+        w->fill += numToCopy;
+        data += numToCopy;
+        inNumBytes -= numToCopy;
+
+        if( w->fill == w->blockBytes ) {
+            submitFill( w );
+            }
+        }
+
+    return w->failed ? -1 : 0;
+    }
+
+
+
+int ASYNCIO_flushWriter( ASYNCIO_Writer *inWriter ) {
+    ASYNCIO_Writer *w = inWriter;
+
+    // partial block goes out as a short write, next block starts after it
+    if( w->fill > 0 ) {
+        submitFill( w );
+        }
+
+    while( w->numCompleted < w->numSubmitted ) {
+        completeOldestWrite( w );
+        }
+
+    return w->failed ? -1 : 0;
+    }
+
+
+
+int ASYNCIO_closeWriter( ASYNCIO_Writer *inWriter ) {
+    ASYNCIO_Writer *w = inWriter;
+
+    ASYNCIO_flushWriter( w );
+
+    int result = w->failed ? -1 : 0;
+
+    freeEngine( &( w->engine ) );
+    free( w->buffers );
+    delete w;
+
+    return result;
+    }
@@ -0,0 +1,106 @@
+#ifndef ASYNCIO_H_INCLUDED
+#define ASYNCIO_H_INCLUDED
+
+#include <stdint.h>
+
+
+// Streaming block reader and writer for big sequential scans of record
+// files, with several large reads or writes in flight at once, so the
+// caller works on one block while storage fills (or drains) the next.
+// 异步块读写: 多个大块读写同时在途, 计算与I/O重叠
+//
+// Uses io_uring where the kernel supports it (Linux, define
+// ASYNCIO_NO_IO_URING to leave it out), otherwise a small pool of
+// threads doing positioned reads and writes.
+//
+// Reads and writes go straight to the file descriptor at explicit offsets,
+// so they don't move a FILE's position.  fflush any FILE writing the same
+// file before starting a reader over it.
+
+
+#define ASYNCIO_DEFAULT_BLOCK_BYTES ( 4 * 1024 * 1024 )
+#define ASYNCIO_DEFAULT_IN_FLIGHT 4
+
+
+
+typedef struct ASYNCIO_Reader ASYNCIO_Reader;
+
+typedef struct ASYNCIO_Writer ASYNCIO_Writer;
+
+
+
+/**
+ * Start reading whole inRecordSize-byte records from inFD, from byte
+ * inStart up to byte inEnd.  Reads ahead right away.
+ *
+ * @param inBlockBytes bytes per read, rounded down to whole records
+ * @param inNumInFlight reads kept in flight ahead of the caller
+ * @return reader, or NULL if out of memory
+ */
+ASYNCIO_Reader *ASYNCIO_openReader( int inFD, uint64_t inStart, uint64_t inEnd,
+                                    unsigned int inRecordSize,
+                                    uint64_t inBlockBytes,
+                                    unsigned int inNumInFlight );
+
+
+/**
+ * Get next block of records.  The block stays valid until the next call.
+ *
+ * If the file ends before inEnd, the last block holds only the whole
+ * records that were there.
+ *
+ * @param outBlock set to first record of block
+ * @return number of records in block, 0 at end, -1 on read error
+ */
+int64_t ASYNCIO_nextBlock( ASYNCIO_Reader *inReader, const uint8_t **outBlock );
+
+
+/**
+ * Wait for reads still in flight and free reader.
+ */
+void ASYNCIO_closeReader( ASYNCIO_Reader *inReader );
+
+
+
+/**
+ * Start writing to inFD at byte inStart, bytes land in the file in the
+ * order they were passed to ASYNCIO_write.
+ *
+ * @param inBlockBytes bytes per write
+ * @param inNumInFlight writes kept in flight while caller fills next block
+ * @return writer, or NULL if out of memory
+ */
+ASYNCIO_Writer *ASYNCIO_openWriter( int inFD, uint64_t inStart,
+                                    uint64_t inBlockBytes,
+                                    unsigned int inNumInFlight );
+
+
+/**
+ * Queue inNumBytes for writing.
+ *
+ * @return 0 on success, -1 if an earlier write failed
+ */
+int ASYNCIO_write( ASYNCIO_Writer *inWriter, const void *inData,
+                   uint64_t inNumBytes );
+
+
+/**
+ * Write out partial block and wait for all writes so far to land, so
+ * everything passed to ASYNCIO_write is in the file.  Writing goes on
+ * after the flushed bytes.
+ *
+ * @return 0 if everything was written, -1 on error
+ */
+int ASYNCIO_flushWriter( ASYNCIO_Writer *inWriter );
+
+
+/**
+ * Write out last partial block, wait for all writes, and free writer.
+ *
+ * @return 0 if everything was written, -1 on error
+ */
+int ASYNCIO_closeWriter( ASYNCIO_Writer *inWriter );
+
+
+
+#endif
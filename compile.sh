@@ -1,2 +1,2 @@
-g++ -D_WIN32 -std=c++11 main.cpp lineardb3.cpp murmurhash2_64.cpp timer.cpp -o shrinkTool
+g++ -D_WIN32 -std=c++11 -pthread main.cpp lineardb3.cpp tiledb.cpp asyncio.cpp mortonsort.cpp murmurhash2_64.cpp timer.cpp -o shrinkTool
 chmod +x shrinkTool
\ No newline at end of file
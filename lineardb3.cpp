@@ -1,16 +1,39 @@
 #define _FILE_OFFSET_BITS 64
 
 #include "lineardb3.h"
+#include "asyncio.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <math.h>
 
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
 #ifdef _WIN32
 #define fseeko fseeko64
 #define ftello ftello64
 #endif
 
+#if defined( _MSC_VER ) || defined( __MINGW32__ )
+#include <io.h>
+#endif
+
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#include <sys/mman.h>
+#define LINEARDB3_HAS_MMAP
+#endif
+
 // #define uint8_t unsigned char
 // #define uint32_t unsigned int
 // #define uint64_t unsigned long long
@@ -21,11 +44,26 @@
 #define FingerprintBucket LINEARDB3_FingerprintBucket
 #define BucketPage LINEARDB3_BucketPage
 #define PageManager LINEARDB3_PageManager
+#define IndexSpill LINEARDB3_IndexSpill
 
 #define BUCKETS_PER_PAGE LINEARDB3_BUCKETS_PER_PAGE
 #define RECORDS_PER_BUCKET LINEARDB3_RECORDS_PER_BUCKET
 
 
+// bump one LINEARDB3_Stats counter, nothing at all unless LINEARDB3_STATS
+// relaxed, concurrent read-only lookups only need their counts added up
+#ifdef LINEARDB3_STATS
+#define STAT( inDB, inCounter ) \
+    do { \
+        (inDB)->stats[ offsetof( LINEARDB3_Stats, inCounter ) / \
+                       sizeof( uint64_t ) ] \
+            .fetch_add( 1, std::memory_order_relaxed ); \
+    } while( 0 )
+#else
+#define STAT( inDB, inCounter ) do { } while( 0 )
+#endif
+
+
 // 默认负载因子0.5
 static double maxLoadForOpenCalls = 0.5;
 
@@ -36,6 +74,37 @@ void LINEARDB3_setMaxLoad( double inMaxLoad ) {
 
 
 
+static LINEARDB3_Durability durabilityForOpenCalls = durabilityNone;
+
+
+void LINEARDB3_setDurability( LINEARDB3_Durability inDurability ) {
+    durabilityForOpenCalls = inDurability;
+    }
+
+
+
+static unsigned int walBatchSizeForOpenCalls = 1024;
+
+
+void LINEARDB3_setWALBatchSize( unsigned int inNumPuts ) {
+    if( inNumPuts < 1 ) {
+        inNumPuts = 1;
+        }
+    walBatchSizeForOpenCalls = inNumPuts;
+    }
+
+
+
+// 截断时是否备份被丢弃的尾部字节
+static char backupTruncatedTail = false;
+
+
+void LINEARDB3_setBackupTruncatedTail( char inBackup ) {
+    backupTruncatedTail = inBackup;
+    }
+
+
+
 
 #include "murmurhash2_64.cpp"
 
@@ -138,6 +207,241 @@ static void markBucketEmpty( PageManager *inPM, uint32_t inBucketIndex );
 
 
 
+// Pages past a database's LINEARDB3_setIndexRAMBudget live in chunks
+// of an unlinked scratch file mapped into memory, one slot per page.
+// 超出内存预算的页放在映射的临时文件里
+struct LINEARDB3_IndexSpill {
+        uint64_t heapBudget;
+        uint64_t heapBytes;
+        
+        // spill file, and bytes of it mapped so far
+        int fd;
+        uint64_t fileSize;
+        
+        // mapped chunks, by address, so a page can be told apart from
+        // a heap page 按地址排序
+        std::vector<uint8_t *> chunks;
+        
+        // newest chunk, and slots handed out from it
+        uint8_t *currentChunk;
+        uint32_t numUsedInChunk;
+        
+        // slots given back, reused first
+        std::vector<BucketPage *> freeSlots;
+        
+        uint64_t numSpilledPages;
+    };
+
+
+// page slot rounded up to whole OS pages, so each one can be dropped 
+// on its own, and chunks mapped at page-aligned offsets
+#define SPILL_SLOT_BYTES \
+    ( ( sizeof( BucketPage ) + 4095 ) / 4096 * 4096 )
+
+// slots per mapping, keeps number of mappings well under OS limits
+#define SPILL_SLOTS_PER_CHUNK 64
+
+
+// budget ignored if 0 默认不限制
+static uint64_t indexRAMBudgetForOpenCalls = 0;
+
+
+void LINEARDB3_setIndexRAMBudget( uint64_t inBytes ) {
+    indexRAMBudgetForOpenCalls = inBytes;
+    }
+
+
+
+// makes spill file for database at inPath
+// returns NULL if there's no budget, or on failure (message printed),
+// and then every page goes on the heap
+static IndexSpill *openIndexSpill( const char *inPath ) {
+    if( indexRAMBudgetForOpenCalls == 0 ) {
+        return NULL;
+        }
+
+#ifdef LINEARDB3_HAS_MMAP
+    // next to data file, not in /tmp, which may itself be RAM
+    char *spillPath = new char[ strlen( inPath ) + 14 ];
+    sprintf( spillPath, "%s.spill.XXXXXX", inPath );
+    
+    int fd = mkstemp( spillPath );
+    
+    if( fd == -1 ) {
+        printf( "Failed to create lineardb3 index spill file %s, keeping "
+                "whole index in RAM\n", spillPath );
+        delete [] spillPath;
+        return NULL;
+        }
+    
+    // gone as soon as we close it, or crash
+    unlink( spillPath );
+    delete [] spillPath;
+
+    IndexSpill *spill = new IndexSpill;
+    
+    spill->heapBudget = indexRAMBudgetForOpenCalls;
+    spill->heapBytes = 0;
+    spill->fd = fd;
+    spill->fileSize = 0;
+    spill->currentChunk = NULL;
+    spill->numUsedInChunk = SPILL_SLOTS_PER_CHUNK;
+    spill->numSpilledPages = 0;
+    
+    return spill;
+#else
+    return NULL;
+#endif
+    }
+
+
+
+// after every page is freed
+static void closeIndexSpill( IndexSpill *inSpill ) {
+    if( inSpill == NULL ) {
+        return;
+        }
+
+#ifdef LINEARDB3_HAS_MMAP
+    for( size_t c=0; c<inSpill->chunks.size(); c++ ) {
+        munmap( inSpill->chunks[c], 
+                SPILL_SLOT_BYTES * SPILL_SLOTS_PER_CHUNK );
+        }
+    close( inSpill->fd );
+#endif
+    
+    delete inSpill;
+    }
+
+
+
+// true if inPage is a slot of one of inSpill's chunks
+static char isSpilledPage( IndexSpill *inSpill, BucketPage *inPage ) {
+    uint8_t *address = (uint8_t *)inPage;
+    
+    // last chunk starting at or before address
+    std::vector<uint8_t *>::iterator it = 
+        std::upper_bound( inSpill->chunks.begin(), inSpill->chunks.end(),
+                          address );
+    
+    if( it == inSpill->chunks.begin() ) {
+        return false;
+        }
+    --it;
+    
+    return address < *it + SPILL_SLOT_BYTES * SPILL_SLOTS_PER_CHUNK;
+    }
+
+
+
+// zeroed page slot in spill file, NULL if file couldn't grow
+static BucketPage *newSpilledPage( IndexSpill *inSpill ) {
+    BucketPage *page = NULL;
+
+    if( inSpill->freeSlots.size() > 0 ) {
+        page = inSpill->freeSlots.back();
+        inSpill->freeSlots.pop_back();
+        
+        memset( page, 0, sizeof( BucketPage ) );
+        }
+#ifdef LINEARDB3_HAS_MMAP
+    else {
+        if( inSpill->numUsedInChunk == SPILL_SLOTS_PER_CHUNK ) {
+            uint64_t chunkBytes = SPILL_SLOT_BYTES * SPILL_SLOTS_PER_CHUNK;
+            
+            // new file space reads as zeros
+            if( ftruncate( inSpill->fd, 
+                           (off_t)( inSpill->fileSize + chunkBytes ) ) 
+                != 0 ) {
+                return NULL;
+                }
+            
+            void *chunk = mmap( NULL, chunkBytes, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, inSpill->fd, 
+                                (off_t)inSpill->fileSize );
+            
+            if( chunk == MAP_FAILED ) {
+                return NULL;
+                }
+            
+            inSpill->fileSize += chunkBytes;
+            
+            inSpill->chunks.insert( 
+                std::upper_bound( inSpill->chunks.begin(), 
+                                  inSpill->chunks.end(), (uint8_t *)chunk ),
+                (uint8_t *)chunk );
+            
+            inSpill->currentChunk = (uint8_t *)chunk;
+            inSpill->numUsedInChunk = 0;
+            }
+        
+        page = (BucketPage *)&( inSpill->currentChunk[ 
+            (uint64_t)inSpill->numUsedInChunk * SPILL_SLOT_BYTES ] );
+        
+        inSpill->numUsedInChunk++;
+        }
+#endif
+    
+    if( page != NULL ) {
+        inSpill->numSpilledPages++;
+        }
+    return page;
+    }
+
+
+
+// zeroed page for inPM, from heap while under budget, from spill 
+// file after that
+// 分配页: 预算内用堆, 超出用映射文件
+static BucketPage *newBucketPage( PageManager *inPM ) {
+    IndexSpill *spill = inPM->spill;
+    
+    if( spill != NULL && 
+        spill->heapBytes + sizeof( BucketPage ) > spill->heapBudget ) {
+        
+        BucketPage *page = newSpilledPage( spill );
+        
+        if( page != NULL ) {
+            return page;
+            }
+        // out of file space, heap is all that's left
+        }
+    
+    BucketPage *page = new BucketPage;
+    
+    memset( page, 0, sizeof( BucketPage ) );
+    
+    if( spill != NULL ) {
+        spill->heapBytes += sizeof( BucketPage );
+        }
+    return page;
+    }
+
+
+
+// 释放页
+static void deleteBucketPage( PageManager *inPM, BucketPage *inPage ) {
+    IndexSpill *spill = inPM->spill;
+    
+    if( spill != NULL && isSpilledPage( spill, inPage ) ) {
+#if defined( LINEARDB3_HAS_MMAP ) && defined( MADV_REMOVE )
+        // give back disk space too, where file system can
+        madvise( inPage, SPILL_SLOT_BYTES, MADV_REMOVE );
+#endif
+        spill->freeSlots.push_back( inPage );
+        spill->numSpilledPages--;
+        return;
+        }
+    
+    delete inPage;
+    
+    if( spill != NULL ) {
+        spill->heapBytes -= sizeof( BucketPage );
+        }
+    }
+
+
+
 // 初始化页管理器
 static void initPageManager( PageManager *inPM, uint32_t inNumStartingBuckets ) {
     inPM->numPages = 1 + inNumStartingBuckets / BUCKETS_PER_PAGE; // malloc的页数量
@@ -152,9 +456,7 @@ static void initPageManager( PageManager *inPM, uint32_t inNumStartingBuckets )
     
     
     for( uint32_t i=0; i<inPM->numPages; i++ ) { // 给页数组malloc页
-        inPM->pages[i] = new BucketPage;
-        
-        memset( inPM->pages[i], 0, sizeof( BucketPage ) );
+        inPM->pages[i] = newBucketPage( inPM );
         }
     
     inPM->numBuckets = inNumStartingBuckets; // 初始桶数量
@@ -166,7 +468,7 @@ static void initPageManager( PageManager *inPM, uint32_t inNumStartingBuckets )
 // 析构页管理器
 static void freePageManager( PageManager *inPM ) {
     for( uint32_t i=0; i<inPM->numPages; i++ ) {
-        delete inPM->pages[i];
+        deleteBucketPage( inPM, inPM->pages[i] );
         }
     delete [] inPM->pages;
 
@@ -207,9 +509,7 @@ static FingerprintBucket *addBucket( PageManager *inPM ) {
             }
         
         // stick new page at end 页数组没满, 找到下一个槽位, malloc一个新页
-        inPM->pages[ inPM->numPages ] = new BucketPage;
-        
-        memset( inPM->pages[ inPM->numPages ], 0, sizeof( BucketPage ) );
+        inPM->pages[ inPM->numPages ] = newBucketPage( inPM );
         
         inPM->numPages++;
         }
@@ -234,6 +534,29 @@ static FingerprintBucket *getBucket( PageManager *inPM, uint32_t inBucketIndex )
     }
 
 
+// record number stored in slot inRecIndex of a bucket
+// 桶中第n个槽的记录编号
+static inline LINEARDB3_RecordIndex getFileIndex( FingerprintBucket *inBucket,
+                                                  int inRecIndex ) {
+#ifdef LINEARDB3_WIDE_INDEX
+    return (uint64_t)inBucket->fileIndex[ inRecIndex ] |
+        ( (uint64_t)inBucket->fileIndexHigh[ inRecIndex ] << 32 );
+#else
+    return inBucket->fileIndex[ inRecIndex ];
+#endif
+    }
+
+
+static inline void setFileIndex( FingerprintBucket *inBucket, int inRecIndex,
+                                 LINEARDB3_RecordIndex inFileIndex ) {
+    inBucket->fileIndex[ inRecIndex ] = (uint32_t)inFileIndex;
+#ifdef LINEARDB3_WIDE_INDEX
+    inBucket->fileIndexHigh[ inRecIndex ] = (uint8_t)( inFileIndex >> 32 );
+#endif
+    }
+
+
+
 // 获取页数组中第一个空桶的索引
 static uint32_t getFirstEmptyBucketIndex( PageManager *inPM ) {
 
@@ -364,409 +687,2608 @@ static int writeHeader( LINEARDB3 *inDB ) {
     }
 
 
-// 获取记录大小 (key+val)
-static int getRecordSizeBytes( int inKeySize, int inValueSize ) {
-    return inKeySize + inValueSize;
-    }
+// sets file length, discarding anything past inLength
+// returns 0 on success, -1 on error
+// 截断文件 (不复制)
+static int truncateFile( FILE *inFile, uint64_t inLength ) {
+    // push any buffered writes out before cutting the file underneath stdio
+    if( fflush( inFile ) != 0 ) {
+        return -1;
+        }
 
-// 重新计算指纹模数
-static void recomputeFingerprintMod( LINEARDB3 *inDB ) {
-    inDB->fingerprintMod = inDB->hashTableSizeA;
-    
-    while( true ) {
-        
-        uint32_t newMod = inDB->fingerprintMod * 2;
-        
-        if( newMod <= inDB->fingerprintMod ) { // 当newMod再翻倍变小了, 说明溢出
-            // reached 32-bit limit
-            return;
-            }
-        else {
-            inDB->fingerprintMod = newMod;
-            }
+#ifdef _MSC_VER
+    if( _chsize_s( _fileno( inFile ), (__int64)inLength ) != 0 ) {
+        return -1;
+        }
+#else
+    if( ftruncate( fileno( inFile ), (off_t)inLength ) != 0 ) {
+        return -1;
+        }
+#endif
+
+    // stream position may now be past the end, reset it
+    if( fseeko( inFile, 0, SEEK_SET ) ) {
+        return -1;
         }
-    }
 
+    return 0;
+    }
 
 
-// 获取理想的表大小
-uint32_t LINEARDB3_getPerfectTableSize( double inMaxLoad, uint32_t inNumRecords ) {
-    // 最小槽位数
-    uint32_t minTableRecords = (uint32_t)ceil( inNumRecords / inMaxLoad );
-    // 最小桶数
-    uint32_t minTableBuckets =(uint32_t)ceil( (double)minTableRecords / 
-                                              (double)RECORDS_PER_BUCKET );
 
-    // even if file contains no inserted records, use 2 buckets minimum
-    // 如果没有插入的记录, 使用2个桶
-    if( minTableBuckets < 2 ) {
-        minTableBuckets = 2;
-        }
-    return minTableBuckets;
-    }
+// truncates data file to inGoodSize in place, optionally saving the
+// dropped bytes to inPath.tail first
+// returns 0 on success, 1 on error (message already printed)
+// 原地截断文件尾部的残缺记录, 可选备份被丢弃的字节
+static int truncateTail( LINEARDB3 *inDB, const char *inPath,
+                         uint64_t inGoodSize ) {
 
+    if( backupTruncatedTail ) {
+        char tailPath[200];
+        sprintf( tailPath, "%.190s%s", inPath, ".tail" );
 
+        if( fseeko( inDB->file, 0, SEEK_END ) ) {
+            return 1;
+            }
+        uint64_t fileSize = ftello( inDB->file );
 
-// if inIgnoreDataFile (which only applies if inPut is true), we completely
-// ignore the data file and don't touch it, updating the RAM hash table only,
-// and assuming all unique values on collision
-// 获取或插入一个键值对
-int LINEARDB3_getOrPut( 
-    LINEARDB3 *inDB, 
-    const void *inKey, 
-    void *inOutValue,
-    // 为真时表示允许插入新键
-    char inPut, 
-    // 为真时（仅在 inPut 为真时生效），表示忽略数据文件，
-    // 仅更新内存哈希表，并在冲突时假设所有值都唯一。
-    char inIgnoreDataFile = false 
-);
+        FILE *tailFile = fopen( tailPath, "wb" );
 
+        if( tailFile == NULL ) {
+            printf( "Failed to open tail backup file %s\n", tailPath );
+            return 1;
+            }
 
+        if( fseeko( inDB->file, inGoodSize, SEEK_SET ) ) {
+            fclose( tailFile );
+            return 1;
+            }
 
-// 打开数据库文件
-int LINEARDB3_open(
-    LINEARDB3 *inDB,
-    const char *inPath, // 数据库文件路径
-    int inMode, // 兼容性参数, 无效
-    unsigned int inHashTableStartSize, // 初始桶数量
-    unsigned int inKeySize,
-    unsigned int inValueSize ) {
-    
-    inDB->recordBuffer = NULL; // 记录缓冲区
-    inDB->maxOverflowDepth = 0; // 最大溢出深度 (溢出桶链表长度?)
+        // less than one record's worth of bytes, just copy them one by one
+        for( uint64_t i=inGoodSize; i<fileSize; i++ ) {
+            int c = fgetc( inDB->file );
 
-    inDB->numRecords = 0; // 记录数
-    
-    inDB->maxLoad = maxLoadForOpenCalls; // 负载因子
-    
+            if( c == EOF || fputc( c, tailFile ) == EOF ) {
+                printf( "Failed to back up dropped tail of lineardb3 "
+                        "file %s to %s\n", inPath, tailPath );
+                fclose( tailFile );
+                return 1;
+                }
+            }
 
-    inDB->file = fopen( inPath, "r+b" ); // 打开已存在的文件
-    
-    if( inDB->file == NULL ) {
-        // doesn't exist yet
-        inDB->file = fopen( inPath, "w+b" ); // 创建一个新文件
+        fclose( tailFile );
         }
-    
-    if( inDB->file == NULL ) {
+
+    if( truncateFile( inDB->file, inGoodSize ) != 0 ) {
+        printf( "Failed to truncate lineardb3 file %s to %llu bytes\n",
+                inPath, (unsigned long long)inGoodSize );
         return 1;
         }
-    
-    if( inHashTableStartSize < 2 ) {
-        inHashTableStartSize = 2;
-        }
-    
-    inDB->hashTableSizeA = inHashTableStartSize;
-    inDB->hashTableSizeB = inHashTableStartSize;
-    
-    inDB->keySize = inKeySize;
-    inDB->valueSize = inValueSize;
-    
-    inDB->recordSizeBytes = getRecordSizeBytes( inKeySize, inValueSize );
-    
-    inDB->recordBuffer = new uint8_t[ inDB->recordSizeBytes ];
 
+    return 0;
+    }
 
-    recomputeFingerprintMod( inDB );
 
-    inDB->hashTable = new PageManager;
-    inDB->overflowBuckets = new PageManager;
-    
 
-    // does the file already contain a header? seek to the end to find out file size
+// flushes stdio buffers and forces file data to disk
+// returns 0 on success, -1 on error
+// 刷盘
+static int syncFile( FILE *inFile ) {
+    if( fflush( inFile ) != 0 ) {
+        return -1;
+        }
 
-    if( fseeko( inDB->file, 0, SEEK_END ) ) { // fseek异常
-        return 1;
+#if defined( _MSC_VER ) || defined( __MINGW32__ )
+    if( _commit( _fileno( inFile ) ) != 0 ) {
+        return -1;
         }
-    
-    
-    
-    if( ftello( inDB->file ) < LINEARDB3_HEADER_SIZE ) {
-        // file that doesn't even contain the header
-        // write fresh header and hash table, rewrite header
-        // 没有文件头
-    
-        if( writeHeader( inDB ) != 0 ) {
-            return 1;
-            }
-        
-        inDB->lastOp = opWrite;
-        
-        initPageManager( inDB->hashTable, inDB->hashTableSizeA );
-        initPageManager( inDB->overflowBuckets, 2 );
-    } else {
-        // read header 读取文件头
-        if( fseeko( inDB->file, 0, SEEK_SET ) ) {
-            return 1;
-            }
-        
-        
-        int numRead;
-        
-        char magicBuffer[ 4 ];
-        
-        numRead = fread( magicBuffer, 3, 1, inDB->file );
+#elif defined( __APPLE__ )
+    if( fsync( fileno( inFile ) ) != 0 ) {
+        return -1;
+        }
+#else
+    if( fdatasync( fileno( inFile ) ) != 0 ) {
+        return -1;
+        }
+#endif
 
-        if( numRead != 1 ) {
-            return 1;
-            }
+    return 0;
+    }
 
-        magicBuffer[3] = '\0';
-        
-        if( strcmp( magicBuffer, magicString ) != 0 ) { // 魔数不匹配
-            printf( "lineardb3 magic string '%s' not found at start of  "
-                    "file header in %s\n", magicString, inPath );
-            return 1;
-            }
-        
 
-        uint32_t val32;
-        
-        numRead = fread( &val32, sizeof(uint32_t), 1, inDB->file );
-        
-        if( numRead != 1 ) {
-            return 1;
-            }
-        
-        if( val32 != inKeySize ) { // key大小不匹配
-            printf( "Requested lineardb3 key size of %u does not match "
-                    "size of %u in file header in %s\n", inKeySize, val32,
-                    inPath );
-            return 1;
-            }
-        
 
 
-        numRead = fread( &val32, sizeof(uint32_t), 1, inDB->file );
-        
-        if( numRead != 1 ) {
-            return 1;
-            }
-        
-        if( val32 != inValueSize ) { // val大小不匹配
-            printf( "Requested lineardb3 value size of %u does not match "
-                    "size of %u in file header in %s\n", inValueSize, val32,
-                    inPath );
-            return 1;
-            }
-        
+// write-ahead log
+// 预写日志
+//
+// Same 11-byte header as the data file, with its own magic, 
+// followed by entries of:
+//     64-bit record number in data file
+//     full record (key, value)
+//     32-bit checksum of the above
+//
+// Entries are only ever appended.  Once the data file is synced, 
+// the log is cut back to just its header (checkpoint).
 
-        // got here, header matches 到此为止, 文件头匹配
+static const char *walMagicString = "Lw3";
 
 
-        // make sure hash table exists in file
-        if( fseeko( inDB->file, 0, SEEK_END ) ) {
-            return 1;
-            }
- 
-        uint64_t fileSize = ftello( inDB->file );
+// once this much log has built up, make data file durable and empty the log
+#define LINEARDB3_WAL_CHECKPOINT_BYTES ( 64 * 1024 * 1024 )
 
 
-        uint64_t numRecordsInFile = 
-            ( fileSize - LINEARDB3_HEADER_SIZE ) / inDB->recordSizeBytes; // 其实只要除不尽就行
-        
-        uint64_t expectedSize =
-            inDB->recordSizeBytes * numRecordsInFile + LINEARDB3_HEADER_SIZE;
-        
-        // 根据记录大小反推文件大小
-        if( expectedSize != fileSize ) {
-            
-            printf( "Requested lineardb3 file %s does not contain a "
-                    "whole number of %d-byte records.  "
-                    "Assuming final record is garbage and truncating it.\n", 
-                    inPath, inDB->recordSizeBytes );
-        
-            char tempPath[200];
-            sprintf( tempPath, "%.190s%s", inPath, ".trunc" );
 
-            FILE *tempFile = fopen( tempPath, "wb" );
-            
-            if( tempFile == NULL ) {
-                printf( "Failed to open temp file %s for truncation\n",
-                        tempPath );
-                return 1;
-                }
-            
-            if( fseeko( inDB->file, 0, SEEK_SET ) ) {
-                return 1;
-                }
-            
-            unsigned char headerBuffer[ LINEARDB3_HEADER_SIZE ];
-            
-            int numRead = fread( headerBuffer, LINEARDB3_HEADER_SIZE, 1, inDB->file );
-            
-            if( numRead != 1 ) {
-                printf( "Failed to read header from lineardb3 file %s\n",
-                        inPath );
-                return 1;
-                }
-            int numWritten = fwrite( headerBuffer, LINEARDB3_HEADER_SIZE, 1, tempFile );
-            
-            if( numWritten != 1 ) {
-                printf( "Failed to write header to temp lineardb3 "
-                        "truncation file %s\n", tempPath );
-                return 1;
-                }
-                
+static unsigned int getWALEntrySize( LINEARDB3 *inDB ) {
+    return sizeof( uint64_t ) + inDB->recordSizeBytes + sizeof( uint32_t );
+    }
 
-            for( uint64_t i=0; i<numRecordsInFile; i++ ) {
-                numRead = fread( inDB->recordBuffer, inDB->recordSizeBytes, 1, inDB->file );
-            
-                if( numRead != 1 ) {
-                    printf( "Failed to read record from lineardb3 file %s\n", inPath );
-                    return 1;
-                    }
-                
-                numWritten = fwrite( inDB->recordBuffer, inDB->recordSizeBytes, 1, tempFile );
-            
-                if( numWritten != 1 ) {
-                    printf( "Failed to record to temp lineardb3 "
-                            "truncation file %s\n", tempPath );
-                    return 1;
-                    }
-                }
 
-            fclose( inDB->file );
-            fclose( tempFile );
-            
-            if( rename( tempPath, inPath ) != 0 ) {
-                printf( "Failed overwrite lineardb3 file %s with "
-                        "truncation file %s\n", inPath, tempPath );
-                return 1;
-                }
 
-            inDB->file = fopen( inPath, "r+b" );
+static uint32_t getWALChecksum( LINEARDB3 *inDB, const uint8_t *inEntry ) {
+    return (uint32_t)MurmurHash64( inEntry, 
+                                   sizeof( uint64_t ) + inDB->recordSizeBytes,
+                                   0x3c6ef372 );
+    }
 
-            if( inDB->file == NULL ) {
-                printf( "Failed to re-open lineardb3 file %s after "
-                        "trunctation\n", inPath );
-                return 1;
-                }
-            }
-        
-        
-        // now populate hash table 更新哈希表
 
-        uint32_t minTableBuckets = 
-            LINEARDB3_getPerfectTableSize( inDB->maxLoad,
-                                           numRecordsInFile );
 
-        
-        inDB->hashTableSizeA = minTableBuckets;
-        inDB->hashTableSizeB = minTableBuckets;
-        
-        
-        recomputeFingerprintMod( inDB );
+static void buildWALEntry( LINEARDB3 *inDB, uint8_t *outEntry,
+                           uint64_t inFileIndex,
+                           const void *inKey, const void *inValue ) {
+    uint8_t *pos = outEntry;
 
-        initPageManager( inDB->hashTable, inDB->hashTableSizeA );
-        initPageManager( inDB->overflowBuckets, 2 );
+    memcpy( pos, &inFileIndex, sizeof( uint64_t ) );
+    pos += sizeof( uint64_t );
 
+    memcpy( pos, inKey, inDB->keySize );
+    pos += inDB->keySize;
 
-        if( fseeko( inDB->file, LINEARDB3_HEADER_SIZE, SEEK_SET ) ) {
-            return 1;
-            }
+    memcpy( pos, inValue, inDB->valueSize );
+    pos += inDB->valueSize;
 
-        // 遍历所有记录, 构建哈希表
-        for( uint64_t i=0; i<numRecordsInFile; i++ ) {
-            int numRead = fread( inDB->recordBuffer, 
-                                 inDB->recordSizeBytes, 1, inDB->file );
-            
-            if( numRead != 1 ) {
-                printf( "Failed to read record from lineardb3 file\n" );
-                return 1;
-                }
+    uint32_t checksum = getWALChecksum( inDB, outEntry );
+    memcpy( pos, &checksum, sizeof( uint32_t ) );
+    }
 
-            // put only in RAM part of table
-            // note that this assumes that each key in the file is unique
-            // (it should be, because we generated the file on a previous run)
-            int result = 
-                LINEARDB3_getOrPut( inDB,
-                                    &( inDB->recordBuffer[0] ),
-                                    &( inDB->recordBuffer[inDB->keySize] ),
-                                    // 插入
-                                    true, 
-                                    // ignore data file, update ram only
-                                    // don't even verify keys in data file
-                                    // this preserves our fread position 保留了文件指针位置
-                                    // 仅插入RAM
-                                    true );
-            if( result != 0 ) {
-                printf( "Putting lineardb3 record in RAM hash table failed\n" );
-                return 1;
-                }
-            }
-        
-        inDB->lastOp = opRead;
+
+
+// returns 0 on success, -1 on error 
+static int writeWALHeader( LINEARDB3 *inDB ) {
+    if( fseeko( inDB->walFile, 0, SEEK_SET ) ) {
+        return -1;
         }
-    
 
+    int numWritten = fwrite( walMagicString, strlen( walMagicString ), 1, 
+                             inDB->walFile );
     
+    uint32_t val32 = inDB->keySize;
+    numWritten += fwrite( &val32, sizeof(uint32_t), 1, inDB->walFile );
 
+    val32 = inDB->valueSize;
+    numWritten += fwrite( &val32, sizeof(uint32_t), 1, inDB->walFile );
 
+    if( numWritten != 3 ) {
+        return -1;
+        }
+    
     return 0;
     }
 
 
 
-// 关闭数据库
-void LINEARDB3_close( LINEARDB3 *inDB ) {
-    if( inDB->recordBuffer != NULL ) {
-        delete [] inDB->recordBuffer;
-        inDB->recordBuffer = NULL;
-        }    
-
+// Moves data file to byte inPos for an inNextOp, unless it's there already.
+// 非必要不做fseek
+// 
+// returns 0 on success, -1 on error 
+static int seekDataFile( LINEARDB3 *inDB, uint64_t inPos, 
+                         LastFileOp inNextOp ) {
+    // even seeking to current location has a performance hit, but
+    // still need to seek when switching between reads and writes,
+    // according to fopen docs
+    if( inDB->lastOp == inNextOp ) {
+        STAT( inDB, numTells );
+        
+        if( ftello( inDB->file ) == (off_t)inPos ) {
+            STAT( inDB, numSeeksAvoided );
+            return 0;
+            }
+        }
 
-    freePageManager( inDB->hashTable );
-    freePageManager( inDB->overflowBuckets );
-    
-    delete inDB->hashTable;
-    delete inDB->overflowBuckets;
+    STAT( inDB, numSeeks );
     
-
-    if( inDB->file != NULL ) {
-        fclose( inDB->file );
-        inDB->file = NULL;
+    if( fseeko( inDB->file, inPos, SEEK_SET ) ) {
+        return -1;
         }
+    return 0;
     }
 
 
 
+// Writes record number inFileIndex directly to the data file.
+// If inValueOnly, key is left alone and only the value is written.
+// 直接写入数据文件
+//
+// returns 0 on success, -1 on error 
+static int writeRecordToFile( LINEARDB3 *inDB, uint64_t inFileIndex,
+                              const void *inKey, const void *inValue,
+                              char inValueOnly ) {
 
+    uint64_t filePosRec = 
+        LINEARDB3_HEADER_SIZE + inFileIndex * (uint64_t)inDB->recordSizeBytes;
 
+    if( inValueOnly ) {
+        uint64_t filePosValue = filePosRec + inDB->keySize;
+        
+        if( seekDataFile( inDB, filePosValue, opWrite ) != 0 ) {
+            return -1;
+            }
 
-
-// key比较
-inline char keyComp( int inKeySize, const void *inKeyA, const void *inKeyB ) {
-    uint8_t *a = (uint8_t*)inKeyA;
-    uint8_t *b = (uint8_t*)inKeyB;
+        // 写入value
+        int numWritten = fwrite( inValue, inDB->valueSize, 1, inDB->file );
+        STAT( inDB, numWrites );
+        inDB->lastOp = opWrite;
     
-    for( int i=0; i<inKeySize; i++ ) {
-        if( a[i] != b[i] ) {
-            return false;
+        if( numWritten != 1 ) {
+            return -1;
             }
+        return 0;
         }
-    return true;
-    }
 
 
+    // don't seek unless we have to. if we're doing a series of fresh inserts,
+    // the file pos is already waiting at the end of the file for us
+    // 如果当前是连续的插入, 那么指针位置是正好的
+    char mustSeek = ( inDB->lastOp == opRead );
+    
+    if( ! mustSeek ) {
+        STAT( inDB, numTells );
+        mustSeek = ( ftello( inDB->file ) != (off_t)filePosRec );
+        }
+    
+    if( mustSeek ) {
+        STAT( inDB, numSeeks );
+        STAT( inDB, numTells );
+        
+        if( fseeko( inDB->file, 0, SEEK_END ) ) {
+            return -1;
+            }
+
+        uint64_t fileSize = ftello( inDB->file );
 
+        // make sure it matches where we've documented that the record 
+        // should go (end of file for a fresh insert)
+        if( fileSize < filePosRec ) {
+            return -1;
+            }
 
-static uint64_t getBinNumber( LINEARDB3 *inDB, uint32_t inFingerprint );
+        if( fileSize > filePosRec ) {
+            // replacing whole existing record
+            STAT( inDB, numSeeks );
+            
+            if( fseeko( inDB->file, filePosRec, SEEK_SET ) ) {
+                return -1;
+                }
+            }
+        }
+    else {
+        STAT( inDB, numSeeksAvoided );
+        }
 
+    // key and value in one write, so a record is never split across calls
+    // 一次写入key和value
+    memcpy( inDB->recordBuffer, inKey, inDB->keySize );
+    memcpy( &( inDB->recordBuffer[ inDB->keySize ] ), inValue, 
+            inDB->valueSize );
 
+    int numWritten = fwrite( inDB->recordBuffer, inDB->recordSizeBytes, 1, 
+                             inDB->file );
+    STAT( inDB, numWrites );
+    inDB->lastOp = opWrite;
+
+    if( numWritten != 1 ) {
+        return -1;
+        }
+    return 0;
+    }
 
-typedef struct {
-        FingerprintBucket *nextBucket;
-        int nextRecord;
-    } BucketIterator;
 
+
+// everything in the log is in the data file, make that durable, then
+// cut log back to its header
+// returns 0 on success, -1 on error 
+// 检查点: 数据文件刷盘后清空日志
+static int checkpointWAL( LINEARDB3 *inDB ) {
+    if( syncFile( inDB->file ) != 0 ) {
+        return -1;
+        }
     
+    if( truncateFile( inDB->walFile, LINEARDB3_HEADER_SIZE ) != 0 ) {
+        return -1;
+        }
+    
+    if( fseeko( inDB->walFile, 0, SEEK_END ) ) {
+        return -1;
+        }
 
+    inDB->walBytes = 0;
+    
+    return 0;
+    }
 
-// Repeated calls to this function will insert a series of records
-// into an empty bucket and any necessary overflow chain buckets
-// 重复调用此函数将插入一系列记录到一个空桶和任何必要的溢出链桶中
-// Assumes bucket/record pointed to by iterator is empty and at end of
+
+
+// group commit: one log write and one sync for the whole batch, then
+// apply batch to data file
+// returns 0 on success, -1 on error 
+// 组提交
+static int commitWALBatch( LINEARDB3 *inDB ) {
+    if( inDB->walBatchCount == 0 ) {
+        return 0;
+        }
+    
+    unsigned int entrySize = getWALEntrySize( inDB );
+    
+    unsigned int numWritten = fwrite( inDB->walBatch, entrySize,
+                                      inDB->walBatchCount, inDB->walFile );
+    
+    if( numWritten != inDB->walBatchCount ) {
+        return -1;
+        }
+    
+    if( syncFile( inDB->walFile ) != 0 ) {
+        return -1;
+        }
+
+    // batch is safe in log, now it can go into data file
+    
+    for( unsigned int e=0; e<inDB->walBatchCount; e++ ) {
+        uint8_t *entry = &( inDB->walBatch[ e * entrySize ] );
+        
+        uint64_t fileIndex;
+        memcpy( &fileIndex, entry, sizeof( uint64_t ) );
+        
+        uint8_t *key = &( entry[ sizeof( uint64_t ) ] );
+        
+        if( writeRecordToFile( inDB, fileIndex, 
+                               key, &( key[ inDB->keySize ] ), 
+                               false ) != 0 ) {
+            return -1;
+            }
+        }
+
+    inDB->walBytes += (uint64_t)entrySize * inDB->walBatchCount;
+    inDB->walBatchCount = 0;
+
+    if( inDB->walBytes >= LINEARDB3_WAL_CHECKPOINT_BYTES ) {
+        return checkpointWAL( inDB );
+        }
+    
+    return 0;
+    }
+
+
+
+// Writes record number inFileIndex, going through write-ahead log
+// according to inDB's durability.
+// If inValueOnly, the key of this record is already in the data file 
+// and only the value changes.
+// 写入一条记录 (按持久化级别经过预写日志)
+//
+// returns 0 on success, -1 on error 
+static int writeRecord( LINEARDB3 *inDB, uint64_t inFileIndex,
+                        const void *inKey, const void *inValue,
+                        char inValueOnly ) {
+
+    if( inDB->durability == durabilityNone ) {
+        return writeRecordToFile( inDB, inFileIndex, 
+                                  inKey, inValue, inValueOnly );
+        }
+    
+    unsigned int entrySize = getWALEntrySize( inDB );
+
+    if( inDB->durability == durabilityBatch ) {
+        // hold in RAM until whole group is committed
+        buildWALEntry( inDB, 
+                       &( inDB->walBatch[ inDB->walBatchCount * entrySize ] ),
+                       inFileIndex, inKey, inValue );
+        inDB->walBatchCount++;
+
+        if( inDB->walBatchCount == inDB->walBatchMaxCount ) {
+            return commitWALBatch( inDB );
+            }
+        return 0;
+        }
+
+
+    // durabilityOp, log must be on disk before data file changes
+    
+    buildWALEntry( inDB, inDB->walBatch, inFileIndex, inKey, inValue );
+
+    int numWritten = fwrite( inDB->walBatch, entrySize, 1, inDB->walFile );
+    
+    if( numWritten != 1 ) {
+        return -1;
+        }
+    
+    if( syncFile( inDB->walFile ) != 0 ) {
+        return -1;
+        }
+    
+    if( writeRecordToFile( inDB, inFileIndex, 
+                           inKey, inValue, inValueOnly ) != 0 ) {
+        return -1;
+        }
+
+    inDB->walBytes += entrySize;
+    
+    if( inDB->walBytes >= LINEARDB3_WAL_CHECKPOINT_BYTES ) {
+        return checkpointWAL( inDB );
+        }
+
+    return 0;
+    }
+
+
+
+// Re-applies complete entries of a log left behind by a crash to the
+// data file, which must have whole records only.
+// Stops at first torn or out-of-place entry (the put that was in 
+// flight when we crashed).
+// 崩溃恢复: 重放日志
+//
+// returns 0 on success, 1 on error (message already printed)
+static int replayWAL( LINEARDB3 *inDB, const char *inPath, 
+                      uint64_t *inOutNumRecordsInFile ) {
+    
+    FILE *walFile = fopen( inDB->walPath, "rb" );
+    
+    if( walFile == NULL ) {
+        // no log, clean shutdown last time
+        return 0;
+        }
+
+    char magicBuffer[ 4 ];
+    uint32_t walKeySize, walValueSize;
+
+    int numRead = fread( magicBuffer, 3, 1, walFile );
+    numRead += fread( &walKeySize, sizeof(uint32_t), 1, walFile );
+    numRead += fread( &walValueSize, sizeof(uint32_t), 1, walFile );
+
+    if( numRead != 3 ) {
+        // crashed before log header was even written, nothing to replay
+        fclose( walFile );
+        return 0;
+        }
+    
+    magicBuffer[3] = '\0';
+
+    if( strcmp( magicBuffer, walMagicString ) != 0 ||
+        walKeySize != inDB->keySize ||
+        walValueSize != inDB->valueSize ) {
+        
+        printf( "Lineardb3 write-ahead log %s does not match data file %s\n",
+                inDB->walPath, inPath );
+        fclose( walFile );
+        return 1;
+        }
+
+    
+    unsigned int entrySize = getWALEntrySize( inDB );
+    uint8_t *entry = new uint8_t[ entrySize ];
+    
+    uint64_t numReplayed = 0;
+    
+    // force seek before first write
+    inDB->lastOp = opRead;
+
+    while( fread( entry, entrySize, 1, walFile ) == 1 ) {
+        
+        uint32_t checksum;
+        memcpy( &checksum, &( entry[ entrySize - sizeof( uint32_t ) ] ),
+                sizeof( uint32_t ) );
+
+        if( checksum != getWALChecksum( inDB, entry ) ) {
+            // torn entry
+            break;
+            }
+        
+        uint64_t fileIndex;
+        memcpy( &fileIndex, entry, sizeof( uint64_t ) );
+
+        if( fileIndex > *inOutNumRecordsInFile ) {
+            // would leave a hole in data file
+            break;
+            }
+        
+        uint8_t *key = &( entry[ sizeof( uint64_t ) ] );
+
+        if( writeRecordToFile( inDB, fileIndex, 
+                               key, &( key[ inDB->keySize ] ),
+                               false ) != 0 ) {
+            printf( "Failed to replay write-ahead log %s into lineardb3 "
+                    "file %s\n", inDB->walPath, inPath );
+            delete [] entry;
+            fclose( walFile );
+            return 1;
+            }
+        
+        if( fileIndex == *inOutNumRecordsInFile ) {
+            // replayed an append
+            (*inOutNumRecordsInFile)++;
+            }
+        numReplayed++;
+        }
+    
+    delete [] entry;
+    fclose( walFile );
+
+
+    if( numReplayed > 0 ) {
+        printf( "Replayed %llu puts from lineardb3 write-ahead log %s\n",
+                (unsigned long long)numReplayed, inDB->walPath );
+        
+        if( syncFile( inDB->file ) != 0 ) {
+            return 1;
+            }
+        }
+
+    return 0;
+    }
+
+
+
+// maps first inSize bytes of data file into memory for read-only mode
+// where mmap isn't available, reads them into RAM instead
+// returns 0 on success, -1 on error
+// 映射数据文件
+static int mapDataFile( LINEARDB3 *inDB, uint64_t inSize ) {
+#ifdef LINEARDB3_HAS_MMAP
+    void *mapped = mmap( NULL, inSize, PROT_READ, MAP_SHARED, 
+                         fileno( inDB->file ), 0 );
+
+    if( mapped == MAP_FAILED ) {
+        return -1;
+        }
+#else
+    uint8_t *mapped = new uint8_t[ inSize ];
+
+    if( fseeko( inDB->file, 0, SEEK_SET ) ||
+        fread( mapped, inSize, 1, inDB->file ) != 1 ) {
+        delete [] mapped;
+        return -1;
+        }
+#endif
+    
+    inDB->mappedFile = (uint8_t *)mapped;
+    inDB->mappedFileSize = inSize;
+    inDB->mappedRecords = &( inDB->mappedFile[ LINEARDB3_HEADER_SIZE ] );
+
+    return 0;
+    }
+
+
+
+static void unmapDataFile( LINEARDB3 *inDB ) {
+    if( inDB->mappedFile == NULL ) {
+        return;
+        }
+    
+#ifdef LINEARDB3_HAS_MMAP
+    munmap( inDB->mappedFile, inDB->mappedFileSize );
+#else
+    delete [] inDB->mappedFile;
+#endif
+
+    inDB->mappedFile = NULL;
+    inDB->mappedFileSize = 0;
+    inDB->mappedRecords = NULL;
+    }
+
+
+
+
+// record number inFileIndex, when whole data file is held in RAM
+// (mapped read-only, or loaded for LINEARDB3_OPEN_IN_MEMORY), 
+// NULL when it has to be read from disk
+static inline const uint8_t *getRecordInRAM( 
+    LINEARDB3 *inDB, LINEARDB3_RecordIndex inFileIndex ) {
+    
+    if( inDB->mappedRecords != NULL ) {
+        return &( inDB->mappedRecords[ (uint64_t)inFileIndex *
+                                       inDB->recordSizeBytes ] );
+        }
+    if( inDB->memRecords != NULL ) {
+        return &( inDB->memRecords[ (uint64_t)inFileIndex *
+                                    inDB->recordSizeBytes ] );
+        }
+    return NULL;
+    }
+
+
+
+// LINEARDB3_OPEN_IN_MEMORY: the caller's thread owns the table and
+// memRecords, the writer thread owns the data file and log
+// 全内存模式: 调用线程持有哈希表和内存记录, 写线程持有数据文件和日志
+struct LINEARDB3_MemWriter {
+        std::thread thread;
+
+        // guards everything below, and memRecords against realloc
+        // while writer copies out of it
+        std::mutex lock;
+
+        // signaled when puts are queued, or when stopping
+        std::condition_variable wake;
+
+        // signaled when writer finishes a round
+        std::condition_variable idle;
+
+        // record numbers put since writer's last round
+        std::vector<LINEARDB3_RecordIndex> pending;
+
+        char busy;
+        char stop;
+
+        // set if any write to data file or log failed
+        char failed;
+    };
+
+
+
+// allocates memRecords with room for inCapacity records
+// returns 0 on success, -1 if out of memory
+static int allocMemRecords( LINEARDB3 *inDB, uint64_t inCapacity ) {
+    if( inCapacity < 2 ) {
+        inCapacity = 2;
+        }
+    
+    inDB->memRecords = 
+        (uint8_t *)malloc( inCapacity * inDB->recordSizeBytes );
+
+    if( inDB->memRecords == NULL ) {
+        return -1;
+        }
+    inDB->memRecordsCapacity = inCapacity;
+    return 0;
+    }
+
+
+
+// reads all records in the data file (positioned at first record) into
+// memRecords, sets *inOutNumRecords to the number of whole records read
+// if the file came up short
+// returns 0 on success, -1 on error
+// 把全部记录读入内存
+static int loadMemRecords( LINEARDB3 *inDB, uint64_t inCapacity,
+                           uint64_t *inOutNumRecords ) {
+    
+    if( inCapacity < *inOutNumRecords ) {
+        inCapacity = *inOutNumRecords;
+        }
+    
+    if( allocMemRecords( inDB, inCapacity ) != 0 ) {
+        return -1;
+        }
+    
+    // in chunks, fread count is only a size_t
+    uint64_t chunk = ( 64 * 1024 * 1024 ) / inDB->recordSizeBytes + 1;
+    uint64_t numRead = 0;
+
+    while( numRead < *inOutNumRecords ) {
+        uint64_t numToRead = *inOutNumRecords - numRead;
+        
+        if( numToRead > chunk ) {
+            numToRead = chunk;
+            }
+        
+        size_t got = fread( &( inDB->memRecords[ numRead * 
+                                                 inDB->recordSizeBytes ] ),
+                            inDB->recordSizeBytes, (size_t)numToRead, 
+                            inDB->file );
+        numRead += got;
+
+        if( got != numToRead ) {
+            if( ! feof( inDB->file ) ) {
+                return -1;
+                }
+            // file is shorter than it was when we measured it,
+            // caller truncates torn tail
+            *inOutNumRecords = numRead;
+            break;
+            }
+        }
+    
+    inDB->lastOp = opRead;
+    return 0;
+    }
+
+
+
+// LINEARDB3_OPEN_IN_MEMORY writer thread
+// each round takes every record put since the last round, copies it out
+// of memRecords, and writes it to the data file in record order, so
+// fresh records are appended in the order they were numbered
+// 后台写线程: 按记录编号顺序写盘
+static void memWriterLoop( LINEARDB3 *inDB ) {
+    LINEARDB3_MemWriter *w = inDB->memWriter;
+
+    std::vector<LINEARDB3_RecordIndex> batch;
+    std::vector<uint8_t> records;
+
+    std::unique_lock<std::mutex> lock( w->lock );
+    
+    while( true ) {
+        while( w->pending.empty() && ! w->stop ) {
+            w->wake.wait( lock );
+            }
+        
+        if( w->pending.empty() ) {
+            // stopping, and nothing left to write
+            break;
+            }
+        
+        batch.swap( w->pending );
+        w->busy = true;
+
+        // a record put many times is only written once
+        std::sort( batch.begin(), batch.end() );
+        batch.erase( std::unique( batch.begin(), batch.end() ), 
+                     batch.end() );
+
+        records.resize( batch.size() * inDB->recordSizeBytes );
+        
+        for( size_t j=0; j<batch.size(); j++ ) {
+            memcpy( &( records[ j * inDB->recordSizeBytes ] ),
+                    &( inDB->memRecords[ (uint64_t)batch[j] * 
+                                         inDB->recordSizeBytes ] ),
+                    inDB->recordSizeBytes );
+            }
+
+        lock.unlock();
+
+        int result = 0;
+        
+        for( size_t j=0; j<batch.size() && result == 0; j++ ) {
+            const uint8_t *record = &( records[ j * inDB->recordSizeBytes ] );
+            
+            result = writeRecord( inDB, batch[j], 
+                                  record, &( record[ inDB->keySize ] ), 
+                                  false );
+            }
+        
+        if( result == 0 ) {
+            result = commitWALBatch( inDB );
+            }
+        
+        if( result == 0 && fflush( inDB->file ) != 0 ) {
+            result = -1;
+            }
+
+        lock.lock();
+
+        if( result != 0 ) {
+            w->failed = true;
+            }
+        
+        batch.clear();
+        w->busy = false;
+        
+        w->idle.notify_all();
+        }
+    }
+
+
+
+static void startMemWriter( LINEARDB3 *inDB ) {
+    inDB->memWriter = new LINEARDB3_MemWriter;
+    inDB->memWriter->busy = false;
+    inDB->memWriter->stop = false;
+    inDB->memWriter->failed = false;
+    
+    inDB->memWriter->thread = std::thread( memWriterLoop, inDB );
+    }
+
+
+
+// writes every queued put, then stops writer thread
+// returns 0 if all writes succeeded, -1 otherwise
+static int stopMemWriter( LINEARDB3 *inDB ) {
+    LINEARDB3_MemWriter *w = inDB->memWriter;
+    
+    {
+        std::lock_guard<std::mutex> guard( w->lock );
+        w->stop = true;
+    }
+    w->wake.notify_one();
+    
+    w->thread.join();
+
+    int result = w->failed ? -1 : 0;
+    
+    delete w;
+    inDB->memWriter = NULL;
+
+    return result;
+    }
+
+
+
+// waits until writer has written every put queued so far
+// returns 0 if all writes succeeded, -1 otherwise
+static int waitForMemWriter( LINEARDB3 *inDB ) {
+    LINEARDB3_MemWriter *w = inDB->memWriter;
+
+    std::unique_lock<std::mutex> lock( w->lock );
+    
+    while( ! w->pending.empty() || w->busy ) {
+        w->idle.wait( lock );
+        }
+    
+    return w->failed ? -1 : 0;
+    }
+
+
+
+// puts record number inFileIndex into memRecords (growing it for a 
+// fresh record at the end) and queues it for the writer
+// returns 0 on success, -1 if out of memory
+// 写入内存记录, 排队等待后台写盘
+static int putInMemory( LINEARDB3 *inDB, LINEARDB3_RecordIndex inFileIndex,
+                        const void *inKey, const void *inValue,
+                        char inValueOnly ) {
+    LINEARDB3_MemWriter *w = inDB->memWriter;
+    
+    {
+        std::lock_guard<std::mutex> guard( w->lock );
+        
+        if( inFileIndex >= inDB->memRecordsCapacity ) {
+            // double it
+            uint64_t newCapacity = 2 * inDB->memRecordsCapacity;
+            
+            if( newCapacity <= inFileIndex ) {
+                newCapacity = (uint64_t)inFileIndex + 1;
+                }
+            
+            uint8_t *newRecords = 
+                (uint8_t *)realloc( inDB->memRecords, 
+                                    newCapacity * inDB->recordSizeBytes );
+            if( newRecords == NULL ) {
+                return -1;
+                }
+            inDB->memRecords = newRecords;
+            inDB->memRecordsCapacity = newCapacity;
+            }
+        
+        uint8_t *record = 
+            &( inDB->memRecords[ (uint64_t)inFileIndex * 
+                                 inDB->recordSizeBytes ] );
+        
+        if( ! inValueOnly ) {
+            memcpy( record, inKey, inDB->keySize );
+            }
+        memcpy( &( record[ inDB->keySize ] ), inValue, inDB->valueSize );
+
+        w->pending.push_back( inFileIndex );
+    }
+    
+    w->wake.notify_one();
+    
+    return 0;
+    }
+
+
+
+// put goes to RAM in in-memory mode, straight to data file otherwise
+static int putRecord( LINEARDB3 *inDB, LINEARDB3_RecordIndex inFileIndex,
+                      const void *inKey, const void *inValue,
+                      char inValueOnly ) {
+    if( inDB->memWriter != NULL ) {
+        return putInMemory( inDB, inFileIndex, inKey, inValue, inValueOnly );
+        }
+    return writeRecord( inDB, inFileIndex, inKey, inValue, inValueOnly );
+    }
+
+
+
+// starts a fresh, empty log for this session, or removes any old log 
+// if we're not logging
+// returns 0 on success, 1 on error
+static int openWAL( LINEARDB3 *inDB ) {
+    if( inDB->durability == durabilityNone ) {
+        // old log, if any, already replayed
+        remove( inDB->walPath );
+        return 0;
+        }
+    
+    inDB->walFile = fopen( inDB->walPath, "w+b" );
+
+    if( inDB->walFile == NULL ) {
+        printf( "Failed to open lineardb3 write-ahead log %s\n", 
+                inDB->walPath );
+        return 1;
+        }
+    
+    if( writeWALHeader( inDB ) != 0 || syncFile( inDB->walFile ) != 0 ) {
+        printf( "Failed to write header of lineardb3 write-ahead log %s\n",
+                inDB->walPath );
+        return 1;
+        }
+
+    inDB->walBatchMaxCount = 1;
+
+    if( inDB->durability == durabilityBatch ) {
+        inDB->walBatchMaxCount = walBatchSizeForOpenCalls;
+        }
+    
+    inDB->walBatch = 
+        new uint8_t[ inDB->walBatchMaxCount * getWALEntrySize( inDB ) ];
+
+    return 0;
+    }
+
+
+
+// 获取记录大小 (key+val)
+static int getRecordSizeBytes( int inKeySize, int inValueSize ) {
+    return inKeySize + inValueSize;
+    }
+
+// 重新计算指纹模数
+static void recomputeFingerprintMod( LINEARDB3 *inDB ) {
+    inDB->fingerprintMod = inDB->hashTableSizeA;
+    
+    while( true ) {
+        
+        uint32_t newMod = inDB->fingerprintMod * 2;
+        
+        if( newMod <= inDB->fingerprintMod ) { // 当newMod再翻倍变小了, 说明溢出
+            // reached 32-bit limit
+            return;
+            }
+        else {
+            inDB->fingerprintMod = newMod;
+            }
+        }
+    }
+
+
+
+// 获取理想的表大小
+uint32_t LINEARDB3_getPerfectTableSize( double inMaxLoad, 
+                                        LINEARDB3_RecordIndex inNumRecords ) {
+    // 最小槽位数
+    // (64-bit, slot count passes 2^32 well before bucket count does)
+    uint64_t minTableRecords = (uint64_t)ceil( inNumRecords / inMaxLoad );
+    // 最小桶数
+    double minBuckets = ceil( (double)minTableRecords / 
+                              (double)RECORDS_PER_BUCKET );
+
+    // more than that can't be built, open refuses files that need it
+    if( minBuckets > (double)LINEARDB3_MAX_BUCKETS ) {
+        minBuckets = (double)LINEARDB3_MAX_BUCKETS;
+        }
+    uint32_t minTableBuckets = (uint32_t)minBuckets;
+
+    // even if file contains no inserted records, use 2 buckets minimum
+    // 如果没有插入的记录, 使用2个桶
+    if( minTableBuckets < 2 ) {
+        minTableBuckets = 2;
+        }
+    return minTableBuckets;
+    }
+
+
+
+// if inIgnoreDataFile (which only applies if inPut is true), we completely
+// ignore the data file and don't touch it, updating the RAM hash table only,
+// and assuming all unique values on collision
+// 获取或插入一个键值对
+int LINEARDB3_getOrPut( 
+    LINEARDB3 *inDB, 
+    const void *inKey, 
+    void *inOutValue,
+    // 为真时表示允许插入新键
+    char inPut, 
+    // 为真时（仅在 inPut 为真时生效），表示忽略数据文件，
+    // 仅更新内存哈希表，并在冲突时假设所有值都唯一。
+    char inIgnoreDataFile = false 
+);
+
+
+
+// builds RAM hash table from inNumRecords records in the data file,
+// which must already be positioned just past the header
+// 一次性批量构建哈希表 (用于open时已知记录数的重建)
+//
+// returns 0 on success, -1 on read error,
+// 1 if working memory couldn't be allocated (table left untouched, caller
+// should fall back to inserting records one at a time)
+static int bulkBuildTable( LINEARDB3 *inDB, uint64_t inNumRecords );
+
+
+static void freeRecordCache( LINEARDB3 *inDB );
+
+static void freeSpatialIndex( LINEARDB3 *inDB );
+
+static int createSpatialIndex( LINEARDB3 *inDB );
+
+// maps inPath.idx for LINEARDB3_OPEN_ARCHIVE, in place of building the
+// hash table, returns 0 on success, 1 on failure like LINEARDB3_open
+static int openArchive( LINEARDB3 *inDB, const char *inPath,
+                        uint64_t inNumRecordsInFile );
+
+static void closeArchive( LINEARDB3 *inDB );
+
+static uint64_t getRecordCapacity( LINEARDB3 *inDB );
+
+// LINEARDB3_OPEN_VERIFY_UNIQUE pass, finds (and unless read-only, removes)
+// records whose keys are repeated later in the data file
+// returns 0 on success, 1 on failure like LINEARDB3_open
+static int verifyUniqueKeys( LINEARDB3 *inDB, const char *inPath, 
+                             uint64_t *inOutNumRecords );
+
+
+
+// 打开数据库文件
+int LINEARDB3_open(
+    LINEARDB3 *inDB,
+    const char *inPath, // 数据库文件路径
+    int inMode, // 兼容性参数, 无效
+    unsigned int inHashTableStartSize, // 初始桶数量
+    unsigned int inKeySize,
+    unsigned int inValueSize ) {
+    
+    return LINEARDB3_openWithMaxLoad( inDB, inPath, inMode, 
+                                      inHashTableStartSize,
+                                      inKeySize, inValueSize,
+                                      maxLoadForOpenCalls );
+    }
+
+
+
+int LINEARDB3_openWithMaxLoad(
+    LINEARDB3 *inDB,
+    const char *inPath,
+    int inMode,
+    unsigned int inHashTableStartSize,
+    unsigned int inKeySize,
+    unsigned int inValueSize,
+    double inMaxLoad ) {
+    
+    inDB->recordBuffer = NULL; // 记录缓冲区
+    inDB->maxOverflowDepth = 0; // 最大溢出深度 (溢出桶链表长度?)
+
+    inDB->numRecords = 0; // 记录数
+
+    inDB->numFalsePositives = 0;
+    inDB->numTagRejects = 0;
+    inDB->numPagesReleased = 0;
+
+#ifdef LINEARDB3_STATS
+    for( unsigned int i=0; i<LINEARDB3_NUM_STATS; i++ ) {
+        inDB->stats[i].store( 0, std::memory_order_relaxed );
+        }
+#endif
+
+    inDB->trace = NULL;
+    inDB->adaptiveLoad = NULL;
+    inDB->indexSpill = NULL;
+    
+    inDB->maxLoad = inMaxLoad; // 负载因子
+    
+    inDB->durability = durabilityForOpenCalls;
+    inDB->walFile = NULL;
+    inDB->walBytes = 0;
+    inDB->walBatch = NULL;
+    inDB->walBatchCount = 0;
+    inDB->walBatchMaxCount = 0;
+
+    inDB->walPath = new char[ strlen( inPath ) + 5 ];
+    sprintf( inDB->walPath, "%s%s", inPath, ".wal" );
+    
+    char isArchive = ( inMode & LINEARDB3_OPEN_ARCHIVE ) != 0;
+    
+    inDB->readOnly = 
+        isArchive || ( inMode & LINEARDB3_OPEN_READ_ONLY ) != 0;
+    inDB->mappedFile = NULL;
+    inDB->mappedFileSize = 0;
+    inDB->mappedRecords = NULL;
+
+    inDB->archiveIndexFile = NULL;
+    inDB->archiveIndexFileSize = 0;
+    inDB->archiveNumBuckets = 0;
+    inDB->archiveOffsetBytes = 0;
+    inDB->archiveOffsets = NULL;
+
+    inDB->memRecords = NULL;
+    inDB->memRecordsCapacity = 0;
+    inDB->memWriter = NULL;
+
+    char inMemory = 
+        ! inDB->readOnly && ( inMode & LINEARDB3_OPEN_IN_MEMORY ) != 0;
+    
+    if( inDB->readOnly ) {
+        // never create, never write, no log
+        inDB->durability = durabilityNone;
+        
+        inDB->file = fopen( inPath, "rb" );
+        }
+    else {
+        inDB->file = fopen( inPath, "r+b" ); // 打开已存在的文件
+    
+        if( inDB->file == NULL ) {
+            // doesn't exist yet
+            inDB->file = fopen( inPath, "w+b" ); // 创建一个新文件
+            }
+        }
+    
+    if( inDB->file == NULL ) {
+        return 1;
+        }
+    
+    if( inHashTableStartSize < 2 ) {
+        inHashTableStartSize = 2;
+        }
+    if( inHashTableStartSize > LINEARDB3_MAX_BUCKETS ) {
+        inHashTableStartSize = LINEARDB3_MAX_BUCKETS;
+        }
+    
+    inDB->hashTableSizeA = inHashTableStartSize;
+    inDB->hashTableSizeB = inHashTableStartSize;
+    
+    inDB->keySize = inKeySize;
+    inDB->valueSize = inValueSize;
+    
+    inDB->recordSizeBytes = getRecordSizeBytes( inKeySize, inValueSize );
+    
+    inDB->recordBuffer = new uint8_t[ inDB->recordSizeBytes ];
+
+    inDB->ramKeys = NULL;
+    inDB->ramKeySize = 0;
+    inDB->ramKeysCapacity = 0;
+    inDB->ramKeysAreDigests = false;
+
+    inDB->recordCache = NULL;
+
+    // read-only and in-memory lookups already compare keys in RAM
+    if( ! inDB->readOnly && ! inMemory &&
+        ( inMode & ( LINEARDB3_OPEN_KEYS_IN_RAM | 
+                     LINEARDB3_OPEN_KEY_DIGESTS_IN_RAM ) ) ) {
+        
+        inDB->ramKeySize = inKeySize;
+        
+        if( ( inMode & LINEARDB3_OPEN_KEY_DIGESTS_IN_RAM ) &&
+            inKeySize > sizeof( uint64_t ) ) {
+            // digest only saves RAM for keys longer than it
+            inDB->ramKeySize = sizeof( uint64_t );
+            inDB->ramKeysAreDigests = true;
+            }
+        
+        inDB->ramKeysCapacity = inHashTableStartSize;
+        inDB->ramKeys = 
+            (uint8_t *)malloc( inDB->ramKeysCapacity * inDB->ramKeySize );
+
+        if( inDB->ramKeys == NULL ) {
+            return 1;
+            }
+        }
+
+    inDB->spatialIndex = NULL;
+
+    if( ( inMode & LINEARDB3_OPEN_SPATIAL_INDEX ) && 
+        inKeySize >= sizeof( uint64_t ) &&
+        createSpatialIndex( inDB ) != 0 ) {
+        return 1;
+        }
+
+
+    recomputeFingerprintMod( inDB );
+
+    inDB->hashTable = new PageManager;
+    inDB->overflowBuckets = new PageManager;
+
+    inDB->indexSpill = openIndexSpill( inPath );
+    inDB->hashTable->spill = inDB->indexSpill;
+    inDB->overflowBuckets->spill = inDB->indexSpill;
+    
+
+    // does the file already contain a header? seek to the end to find out file size
+
+    if( fseeko( inDB->file, 0, SEEK_END ) ) { // fseek异常
+        return 1;
+        }
+    
+    
+    
+    if( ftello( inDB->file ) < LINEARDB3_HEADER_SIZE ) {
+        // file that doesn't even contain the header
+        // write fresh header and hash table, rewrite header
+        // 没有文件头
+
+        if( inDB->readOnly ) {
+            printf( "Lineardb3 file %s has no header, can't open it "
+                    "read-only\n", inPath );
+            return 1;
+            }
+    
+        if( writeHeader( inDB ) != 0 ) {
+            return 1;
+            }
+        
+        inDB->lastOp = opWrite;
+        
+        initPageManager( inDB->hashTable, inDB->hashTableSizeA );
+        initPageManager( inDB->overflowBuckets, 2 );
+
+        if( inMemory && allocMemRecords( inDB, inHashTableStartSize ) != 0 ) {
+            return 1;
+            }
+    } else {
+        // read header 读取文件头
+        if( fseeko( inDB->file, 0, SEEK_SET ) ) {
+            return 1;
+            }
+        
+        
+        int numRead;
+        
+        char magicBuffer[ 4 ];
+        
+        numRead = fread( magicBuffer, 3, 1, inDB->file );
+
+        if( numRead != 1 ) {
+            return 1;
+            }
+
+        magicBuffer[3] = '\0';
+        
+        if( strcmp( magicBuffer, magicString ) != 0 ) { // 魔数不匹配
+            printf( "lineardb3 magic string '%s' not found at start of  "
+                    "file header in %s\n", magicString, inPath );
+            return 1;
+            }
+        
+
+        uint32_t val32;
+        
+        numRead = fread( &val32, sizeof(uint32_t), 1, inDB->file );
+        
+        if( numRead != 1 ) {
+            return 1;
+            }
+        
+        if( val32 != inKeySize ) { // key大小不匹配
+            printf( "Requested lineardb3 key size of %u does not match "
+                    "size of %u in file header in %s\n", inKeySize, val32,
+                    inPath );
+            return 1;
+            }
+        
+
+
+        numRead = fread( &val32, sizeof(uint32_t), 1, inDB->file );
+        
+        if( numRead != 1 ) {
+            return 1;
+            }
+        
+        if( val32 != inValueSize ) { // val大小不匹配
+            printf( "Requested lineardb3 value size of %u does not match "
+                    "size of %u in file header in %s\n", inValueSize, val32,
+                    inPath );
+            return 1;
+            }
+        
+
+        // got here, header matches 到此为止, 文件头匹配
+
+
+        // make sure hash table exists in file
+        if( fseeko( inDB->file, 0, SEEK_END ) ) {
+            return 1;
+            }
+ 
+        uint64_t fileSize = ftello( inDB->file );
+
+
+        uint64_t numRecordsInFile = 
+            ( fileSize - LINEARDB3_HEADER_SIZE ) / inDB->recordSizeBytes; // 其实只要除不尽就行
+        
+        uint64_t expectedSize =
+            inDB->recordSizeBytes * numRecordsInFile + LINEARDB3_HEADER_SIZE;
+        
+        // 根据记录大小反推文件大小
+        if( expectedSize != fileSize && inDB->readOnly ) {
+            // can't repair it, just leave partial record out of the table
+            printf( "Requested lineardb3 file %s does not contain a "
+                    "whole number of %d-byte records.  "
+                    "Ignoring final partial record (read-only).\n", 
+                    inPath, inDB->recordSizeBytes );
+            }
+        else if( expectedSize != fileSize ) {
+            
+            printf( "Requested lineardb3 file %s does not contain a "
+                    "whole number of %d-byte records.  "
+                    "Assuming final record is garbage and truncating it.\n", 
+                    inPath, inDB->recordSizeBytes );
+
+            // cut the partial record off in place, no need to copy
+            // every whole record into a temp file first
+            // 原地截断到最后一条完整记录
+            if( truncateTail( inDB, inPath, expectedSize ) != 0 ) {
+                return 1;
+                }
+            }
+        
+        
+        if( inDB->readOnly ) {
+            FILE *walFile = fopen( inDB->walPath, "rb" );
+            
+            if( walFile != NULL ) {
+                printf( "Warning:  lineardb3 file %s has a write-ahead log "
+                        "that can't be replayed read-only.  Open it "
+                        "read-write once to recover it.\n", inPath );
+                fclose( walFile );
+                }
+            
+            // all lookups go straight to the mapped file, which
+            // other processes opening the same file share through 
+            // the page cache
+            // 只读模式: 映射整个数据文件
+            if( mapDataFile( inDB, expectedSize ) != 0 ) {
+                printf( "Failed to map lineardb3 file %s\n", inPath );
+                return 1;
+                }
+            }
+        // redo any puts that a crash left only in write-ahead log
+        // 重放预写日志
+        else if( replayWAL( inDB, inPath, &numRecordsInFile ) != 0 ) {
+            return 1;
+            }
+
+        
+        if( numRecordsInFile >= LINEARDB3_MAX_RECORDS ) {
+            printf( "Lineardb3 file %s has %llu records, more than this "
+                    "build can address (rebuild with LINEARDB3_WIDE_INDEX)\n",
+                    inPath, (unsigned long long)numRecordsInFile );
+            return 1;
+            }
+
+        if( isArchive ) {
+            // static index stands in for hash table, nothing to build
+            return openArchive( inDB, inPath, numRecordsInFile );
+            }
+
+        if( numRecordsInFile >= getRecordCapacity( inDB ) ) {
+            printf( "Lineardb3 file %s has %llu records, more than %llu "
+                    "buckets hold at maxLoad %f\n",
+                    inPath, (unsigned long long)numRecordsInFile,
+                    (unsigned long long)LINEARDB3_MAX_BUCKETS, inDB->maxLoad );
+            return 1;
+            }
+
+        // table build assumes unique keys, check that they are
+        // 检查key唯一性
+        if( ( inMode & LINEARDB3_OPEN_VERIFY_UNIQUE ) &&
+            verifyUniqueKeys( inDB, inPath, &numRecordsInFile ) != 0 ) {
+            return 1;
+            }
+
+        // now populate hash table 更新哈希表
+
+        uint32_t minTableBuckets = 
+            LINEARDB3_getPerfectTableSize( inDB->maxLoad,
+                                           numRecordsInFile );
+
+        
+        inDB->hashTableSizeA = minTableBuckets;
+        inDB->hashTableSizeB = minTableBuckets;
+        
+        
+        recomputeFingerprintMod( inDB );
+
+        initPageManager( inDB->hashTable, inDB->hashTableSizeA );
+        initPageManager( inDB->overflowBuckets, 2 );
+
+
+        if( fseeko( inDB->file, LINEARDB3_HEADER_SIZE, SEEK_SET ) ) {
+            return 1;
+            }
+
+        uint64_t numRecordsToBuild = numRecordsInFile;
+
+        if( inMemory && 
+            loadMemRecords( inDB, inHashTableStartSize, 
+                            &numRecordsToBuild ) != 0 ) {
+            printf( "Failed to load lineardb3 file %s into RAM\n", inPath );
+            return 1;
+            }
+
+        // table is already perfectly sized, so sort records into their
+        // buckets in one pass instead of inserting them one by one
+        int bulkResult = bulkBuildTable( inDB, numRecordsToBuild );
+
+        if( bulkResult == -1 ) {
+            printf( "Failed to read record from lineardb3 file\n" );
+            return 1;
+            }
+
+        if( bulkResult == 1 ) {
+            // not enough working memory for bulk build, fall back to
+            // slower record-by-record insert below
+            if( fseeko( inDB->file, LINEARDB3_HEADER_SIZE, SEEK_SET ) ) {
+                return 1;
+                }
+            }
+
+        // 遍历所有记录, 构建哈希表
+        if( bulkResult == 1 )
+        for( uint64_t i=0; i<numRecordsInFile; i++ ) {
+            int numRead = fread( inDB->recordBuffer, 
+                                 inDB->recordSizeBytes, 1, inDB->file );
+            
+            if( numRead != 1 ) {
+                if( feof( inDB->file ) ) {
+                    // file ended early, torn tail handled below
+                    break;
+                    }
+                printf( "Failed to read record from lineardb3 file\n" );
+                return 1;
+                }
+
+            // put only in RAM part of table
+            // note that this assumes that each key in the file is unique
+            // (it should be, because we generated the file on a previous run)
+            int result = 
+                LINEARDB3_getOrPut( inDB,
+                                    &( inDB->recordBuffer[0] ),
+                                    &( inDB->recordBuffer[inDB->keySize] ),
+                                    // 插入
+                                    true, 
+                                    // ignore data file, update ram only
+                                    // don't even verify keys in data file
+                                    // this preserves our fread position 保留了文件指针位置
+                                    // 仅插入RAM
+                                    true );
+            if( result != 0 ) {
+                printf( "Putting lineardb3 record in RAM hash table failed\n" );
+                return 1;
+                }
+            }
+
+
+        // scan verifies the tail: if the file came up short of the records
+        // we sized for (it changed under us since we measured it),
+        // drop whatever is past the last whole record we actually read
+        // 扫描校验尾部: 读到的完整记录数少于预期时截断
+        if( inDB->numRecords < numRecordsInFile ) {
+            printf( "Lineardb3 file %s ended after %llu of %llu records.  "
+                    "Truncating torn tail.\n", inPath, 
+                    (unsigned long long)inDB->numRecords,
+                    (unsigned long long)numRecordsInFile );
+
+            clearerr( inDB->file );
+
+            uint64_t goodSize = LINEARDB3_HEADER_SIZE +
+                (uint64_t)inDB->numRecords * (uint64_t)inDB->recordSizeBytes;
+
+            if( truncateTail( inDB, inPath, goodSize ) != 0 ) {
+                return 1;
+                }
+            }
+        
+        inDB->lastOp = opRead;
+        }
+    
+
+    if( ! inDB->readOnly && openWAL( inDB ) != 0 ) {
+        return 1;
+        }
+
+    if( inMemory ) {
+        // from here on, only writer thread touches data file and log
+        startMemWriter( inDB );
+        }
+
+
+    return 0;
+    }
+
+
+
+// 关闭数据库
+void LINEARDB3_close( LINEARDB3 *inDB ) {
+    if( inDB->memWriter != NULL ) {
+        if( stopMemWriter( inDB ) != 0 ) {
+            printf( "Failed to write in-memory lineardb3 records "
+                    "to data file\n" );
+            }
+        }
+
+    if( inDB->walFile != NULL ) {
+        // clean shutdown, data file gets everything and log goes away
+        if( commitWALBatch( inDB ) == 0 && checkpointWAL( inDB ) == 0 ) {
+            fclose( inDB->walFile );
+            remove( inDB->walPath );
+            }
+        else {
+            // leave log for replay on next open
+            printf( "Failed to checkpoint lineardb3 write-ahead log %s\n",
+                    inDB->walPath );
+            fclose( inDB->walFile );
+            }
+        inDB->walFile = NULL;
+        }
+
+    if( inDB->walBatch != NULL ) {
+        delete [] inDB->walBatch;
+        inDB->walBatch = NULL;
+        }
+
+    if( inDB->walPath != NULL ) {
+        delete [] inDB->walPath;
+        inDB->walPath = NULL;
+        }
+
+    if( inDB->recordBuffer != NULL ) {
+        delete [] inDB->recordBuffer;
+        inDB->recordBuffer = NULL;
+        }    
+
+
+    freePageManager( inDB->hashTable );
+    freePageManager( inDB->overflowBuckets );
+    
+    delete inDB->hashTable;
+    delete inDB->overflowBuckets;
+
+    closeIndexSpill( inDB->indexSpill );
+    inDB->indexSpill = NULL;
+    
+
+    unmapDataFile( inDB );
+
+    closeArchive( inDB );
+
+    if( inDB->memRecords != NULL ) {
+        free( inDB->memRecords );
+        inDB->memRecords = NULL;
+        }
+
+    freeRecordCache( inDB );
+
+    freeSpatialIndex( inDB );
+
+    if( inDB->trace != NULL && LINEARDB3_setTraceFile( inDB, NULL ) != 0 ) {
+        printf( "Failed to write lineardb3 trace file\n" );
+        }
+
+    LINEARDB3_setAdaptiveLoad( inDB, 0, 0 );
+
+    if( inDB->ramKeys != NULL ) {
+        free( inDB->ramKeys );
+        inDB->ramKeys = NULL;
+        }
+
+    if( inDB->file != NULL ) {
+        fclose( inDB->file );
+        inDB->file = NULL;
+        }
+    }
+
+
+
+
+
+
+
+// key比较
+inline char keyComp( int inKeySize, const void *inKeyA, const void *inKeyB ) {
+    uint8_t *a = (uint8_t*)inKeyA;
+    uint8_t *b = (uint8_t*)inKeyB;
+    
+    for( int i=0; i<inKeySize; i++ ) {
+        if( a[i] != b[i] ) {
+            return false;
+            }
+        }
+    return true;
+    }
+
+
+
+
+static uint64_t getBinNumber( LINEARDB3 *inDB, uint32_t inFingerprint );
+
+
+
+// CLOCK cache of whole records, keyed by record number 记录缓存
+struct LINEARDB3_RecordCache {
+        uint32_t numSlots;
+        uint32_t numSlotsUsed;
+
+        // next slot CLOCK considers for eviction
+        uint32_t clockHand;
+
+        // record number held in each slot
+        uint64_t *slotFileIndex;
+
+        // CLOCK reference bit, set when slot is hit, cleared as hand passes
+        uint8_t *slotReferenced;
+
+        // key and value held in each slot
+        uint8_t *slotRecords;
+
+        // open-addressed, linear-probed map from record number
+        // to slot + 1, 0 for empty, twice as many entries as slots
+        uint32_t *index;
+        uint32_t indexMask;
+
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+
+
+static void freeRecordCache( LINEARDB3 *inDB ) {
+    LINEARDB3_RecordCache *c = inDB->recordCache;
+    
+    if( c == NULL ) {
+        return;
+    }
+    
+    free( c->slotFileIndex );
+    free( c->slotReferenced );
+    free( c->slotRecords );
+    free( c->index );
+    delete c;
+    
+    inDB->recordCache = NULL;
+}
+
+
+
+static inline uint32_t getCacheIndexStart( LINEARDB3_RecordCache *inCache,
+                                           uint64_t inFileIndex ) {
+    // Fibonacci hashing, record numbers are sequential
+    return (uint32_t)( ( inFileIndex * 0x9E3779B97F4A7C15ULL ) >> 32 ) &
+        inCache->indexMask;
+}
+
+
+
+// position in index of inFileIndex, or position of empty entry
+// where it would go
+static uint32_t findInCacheIndex( LINEARDB3_RecordCache *inCache,
+                                  uint64_t inFileIndex ) {
+    uint32_t pos = getCacheIndexStart( inCache, inFileIndex );
+    
+    while( inCache->index[ pos ] != 0 &&
+           inCache->slotFileIndex[ inCache->index[ pos ] - 1 ] != 
+           inFileIndex ) {
+        pos = ( pos + 1 ) & inCache->indexMask;
+    }
+    return pos;
+}
+
+
+
+// removes entry at inPos from index, shifting later entries of
+// its probe run back so lookups never stop short at a hole
+static void removeFromCacheIndex( LINEARDB3_RecordCache *inCache,
+                                  uint32_t inPos ) {
+    uint32_t hole = inPos;
+    uint32_t pos = inPos;
+    
+    while( true ) {
+        pos = ( pos + 1 ) & inCache->indexMask;
+        
+        if( inCache->index[ pos ] == 0 ) {
+            break;
+        }
+        
+        uint32_t home = 
+            getCacheIndexStart( inCache, 
+                                inCache->slotFileIndex[ 
+                                    inCache->index[ pos ] - 1 ] );
+        
+        // can this entry move back into the hole? only if its home
+        // isn't cyclically between the hole and where it sits now
+        if( ( ( pos - home ) & inCache->indexMask ) >= 
+            ( ( pos - hole ) & inCache->indexMask ) ) {
+            inCache->index[ hole ] = inCache->index[ pos ];
+            hole = pos;
+        }
+    }
+    inCache->index[ hole ] = 0;
+}
+
+
+
+// cached key and value of record number inFileIndex, or NULL on miss
+// 查找缓存
+static const uint8_t *getCachedRecord( LINEARDB3 *inDB, 
+                                       uint64_t inFileIndex ) {
+    LINEARDB3_RecordCache *c = inDB->recordCache;
+    
+    uint32_t entry = c->index[ findInCacheIndex( c, inFileIndex ) ];
+    
+    if( entry == 0 ) {
+        c->misses++;
+        return NULL;
+    }
+    
+    c->hits++;
+    c->slotReferenced[ entry - 1 ] = true;
+    
+    return &( c->slotRecords[ (uint64_t)( entry - 1 ) * 
+                              inDB->recordSizeBytes ] );
+}
+
+
+
+// puts key and value of record number inFileIndex into cache, replacing
+// what's cached for it, or evicting the first unreferenced slot 
+// that the CLOCK hand reaches
+// 写入缓存, CLOCK淘汰
+static void cacheRecord( LINEARDB3 *inDB, uint64_t inFileIndex,
+                         const void *inKey, const void *inValue ) {
+    LINEARDB3_RecordCache *c = inDB->recordCache;
+
+    uint32_t pos = findInCacheIndex( c, inFileIndex );
+    uint32_t slot;
+    
+    if( c->index[ pos ] != 0 ) {
+        slot = c->index[ pos ] - 1;
+    }
+    else {
+        if( c->numSlotsUsed < c->numSlots ) {
+            slot = c->numSlotsUsed;
+            c->numSlotsUsed++;
+        }
+        else {
+            while( c->slotReferenced[ c->clockHand ] ) {
+                // second chance
+                c->slotReferenced[ c->clockHand ] = false;
+                c->clockHand = ( c->clockHand + 1 ) % c->numSlots;
+            }
+            slot = c->clockHand;
+            c->clockHand = ( c->clockHand + 1 ) % c->numSlots;
+            
+            removeFromCacheIndex( 
+                c, findInCacheIndex( c, c->slotFileIndex[ slot ] ) );
+            
+            // removal may have shifted our empty entry
+            pos = findInCacheIndex( c, inFileIndex );
+        }
+        
+        c->slotFileIndex[ slot ] = inFileIndex;
+        // not referenced until hit again, so a one-off scan
+        // doesn't push out hot records
+        c->slotReferenced[ slot ] = false;
+        c->index[ pos ] = slot + 1;
+    }
+    
+    uint8_t *record = 
+        &( c->slotRecords[ (uint64_t)slot * inDB->recordSizeBytes ] );
+    
+    memcpy( record, inKey, inDB->keySize );
+    memcpy( &( record[ inDB->keySize ] ), inValue, inDB->valueSize );
+}
+
+
+
+// digest used in place of keys longer than 8 bytes in 
+// LINEARDB3_OPEN_KEY_DIGESTS_IN_RAM mode
+static uint64_t getKeyDigest( LINEARDB3 *inDB, const void *inKey ) {
+    return MurmurHash64( inKey, inDB->keySize, 0x8f1bbcdc );
+}
+
+
+
+// remembers key (or digest) of record number inFileIndex in RAM, 
+// if this DB keeps them
+// returns 0 on success, -1 if out of memory
+// 在内存中保存记录的key (或摘要)
+static int storeRAMKey( LINEARDB3 *inDB, LINEARDB3_RecordIndex inFileIndex,
+                        const void *inKey ) {
+    if( inDB->ramKeys == NULL ) {
+        return 0;
+    }
+    
+    if( inFileIndex >= inDB->ramKeysCapacity ) {
+        // double it
+        uint64_t newCapacity = 2 * inDB->ramKeysCapacity;
+        
+        if( newCapacity <= inFileIndex ) {
+            newCapacity = inFileIndex + 1;
+        }
+        
+        uint8_t *newKeys = 
+            (uint8_t *)realloc( inDB->ramKeys, 
+                                newCapacity * inDB->ramKeySize );
+        if( newKeys == NULL ) {
+            return -1;
+        }
+        inDB->ramKeys = newKeys;
+        inDB->ramKeysCapacity = newCapacity;
+    }
+
+    uint8_t *dest = &( inDB->ramKeys[ inFileIndex * inDB->ramKeySize ] );
+    
+    if( inDB->ramKeysAreDigests ) {
+        uint64_t digest = getKeyDigest( inDB, inKey );
+        memcpy( dest, &digest, sizeof( uint64_t ) );
+    }
+    else {
+        memcpy( dest, inKey, inDB->keySize );
+    }
+    return 0;
+}
+
+
+
+// marks end of a spatial chain, and empty prefix table entries
+// (never a record number, puts stop one short of LINEARDB3_MAX_RECORDS)
+#define NO_RECORD ( (LINEARDB3_RecordIndex)-1 )
+
+
+// 8-byte key prefix (x, y) -> chain of every record number with it
+// 空间索引: 8字节key前缀 -> 同前缀记录链
+struct LINEARDB3_SpatialIndex {
+        // open-addressed, linear-probed table, kept at most half full
+        uint64_t *prefixes;
+        // newest record with each prefix, NO_RECORD for empty entry
+        LINEARDB3_RecordIndex *heads;
+        uint64_t tableSize;
+        uint64_t numPrefixes;
+
+        // next older record with same prefix, indexed by record number
+        LINEARDB3_RecordIndex *next;
+        uint64_t nextCapacity;
+    };
+
+
+
+static inline uint64_t getSpatialPrefix( const void *inKey ) {
+    uint64_t prefix;
+    memcpy( &prefix, inKey, sizeof( uint64_t ) );
+    return prefix;
+}
+
+
+
+static inline uint64_t getSpatialTableStart( LINEARDB3_SpatialIndex *inIndex,
+                                             uint64_t inPrefix ) {
+    // mix x and y bits together, neighboring tiles differ in few bits
+    uint64_t h = inPrefix;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & ( inIndex->tableSize - 1 );
+}
+
+
+
+// table position holding inPrefix, or empty position where it would go
+static uint64_t findSpatialPrefix( LINEARDB3_SpatialIndex *inIndex,
+                                   uint64_t inPrefix ) {
+    uint64_t pos = getSpatialTableStart( inIndex, inPrefix );
+    
+    while( inIndex->heads[ pos ] != NO_RECORD &&
+           inIndex->prefixes[ pos ] != inPrefix ) {
+        pos = ( pos + 1 ) & ( inIndex->tableSize - 1 );
+    }
+    return pos;
+}
+
+
+
+// returns 0 on success, -1 if out of memory
+static int allocSpatialTable( LINEARDB3_SpatialIndex *inIndex, 
+                              uint64_t inTableSize ) {
+    inIndex->prefixes = 
+        (uint64_t *)malloc( inTableSize * sizeof( uint64_t ) );
+    inIndex->heads = (LINEARDB3_RecordIndex *)
+        malloc( inTableSize * sizeof( LINEARDB3_RecordIndex ) );
+    
+    if( inIndex->prefixes == NULL || inIndex->heads == NULL ) {
+        free( inIndex->prefixes );
+        free( inIndex->heads );
+        return -1;
+    }
+    
+    inIndex->tableSize = inTableSize;
+    
+    for( uint64_t j=0; j<inTableSize; j++ ) {
+        inIndex->heads[ j ] = NO_RECORD;
+    }
+    return 0;
+}
+
+
+
+// returns 0 on success, -1 if out of memory
+static int createSpatialIndex( LINEARDB3 *inDB ) {
+    LINEARDB3_SpatialIndex *index = new LINEARDB3_SpatialIndex;
+    
+    index->numPrefixes = 0;
+    index->next = NULL;
+    index->nextCapacity = 0;
+    
+    if( allocSpatialTable( index, 1024 ) != 0 ) {
+        delete index;
+        return -1;
+    }
+    
+    inDB->spatialIndex = index;
+    return 0;
+}
+
+
+
+static void freeSpatialIndex( LINEARDB3 *inDB ) {
+    LINEARDB3_SpatialIndex *index = inDB->spatialIndex;
+    
+    if( index == NULL ) {
+        return;
+    }
+    
+    free( index->prefixes );
+    free( index->heads );
+    free( index->next );
+    delete index;
+    
+    inDB->spatialIndex = NULL;
+}
+
+
+
+// links fresh record number inFileIndex into chain for its key's prefix,
+// if this DB keeps a spatial index
+// returns 0 on success, -1 if out of memory
+// 新记录加入空间索引
+static int indexSpatialKey( LINEARDB3 *inDB, 
+                            LINEARDB3_RecordIndex inFileIndex,
+                            const void *inKey ) {
+    LINEARDB3_SpatialIndex *index = inDB->spatialIndex;
+    
+    if( index == NULL ) {
+        return 0;
+    }
+    
+    if( inFileIndex >= index->nextCapacity ) {
+        // double it
+        uint64_t newCapacity = 2 * index->nextCapacity;
+        
+        if( newCapacity <= inFileIndex ) {
+            newCapacity = (uint64_t)inFileIndex + 1;
+        }
+        
+        LINEARDB3_RecordIndex *newNext = (LINEARDB3_RecordIndex *)
+            realloc( index->next, 
+                     newCapacity * sizeof( LINEARDB3_RecordIndex ) );
+        if( newNext == NULL ) {
+            return -1;
+        }
+        index->next = newNext;
+        index->nextCapacity = newCapacity;
+    }
+    
+    if( 2 * ( index->numPrefixes + 1 ) > index->tableSize ) {
+        // rehash into table twice as big
+        uint64_t *oldPrefixes = index->prefixes;
+        LINEARDB3_RecordIndex *oldHeads = index->heads;
+        uint64_t oldSize = index->tableSize;
+        
+        if( allocSpatialTable( index, 2 * oldSize ) != 0 ) {
+            index->prefixes = oldPrefixes;
+            index->heads = oldHeads;
+            return -1;
+        }
+        
+        for( uint64_t j=0; j<oldSize; j++ ) {
+            if( oldHeads[ j ] != NO_RECORD ) {
+                uint64_t pos = findSpatialPrefix( index, oldPrefixes[ j ] );
+                index->prefixes[ pos ] = oldPrefixes[ j ];
+                index->heads[ pos ] = oldHeads[ j ];
+            }
+        }
+        free( oldPrefixes );
+        free( oldHeads );
+    }
+
+    uint64_t prefix = getSpatialPrefix( inKey );
+    uint64_t pos = findSpatialPrefix( index, prefix );
+    
+    if( index->heads[ pos ] == NO_RECORD ) {
+        index->prefixes[ pos ] = prefix;
+        index->numPrefixes++;
+    }
+    
+    // newest goes at head of chain
+    index->next[ inFileIndex ] = index->heads[ pos ];
+    index->heads[ pos ] = inFileIndex;
+    
+    return 0;
+}
+
+
+
+// true if RAM copy of key (or digest) of record inFileIndex matches inKey
+static char ramKeyMatches( LINEARDB3 *inDB, LINEARDB3_RecordIndex inFileIndex,
+                           const void *inKey ) {
+    const uint8_t *ramKey = 
+        &( inDB->ramKeys[ inFileIndex * inDB->ramKeySize ] );
+    
+    if( inDB->ramKeysAreDigests ) {
+        uint64_t digest = getKeyDigest( inDB, inKey );
+        return memcmp( ramKey, &digest, sizeof( uint64_t ) ) == 0;
+    }
+    return keyComp( inDB->keySize, ramKey, inKey );
+}
+
+
+static uint64_t getBinNumber( LINEARDB3 *inDB, const void *inKey, 
+                              uint32_t *outFingerprint, uint8_t *outTag );
+
+
+
+// archive static index bucket of a key 归档桶号
+static uint64_t getArchiveBucket( const void *inKey, unsigned int inKeySize,
+                                  uint64_t inNumBuckets ) {
+    return LINEARDB3_hash( inKey, inKeySize ) % inNumBuckets;
+}
+
+
+
+// keys sampled, evenly spaced, for the fingerprint that ties an archive's
+// index to its regrouped data file 归档指纹采样数
+#define ARCHIVE_FINGERPRINT_SAMPLES 4096
+
+
+// record number of fingerprint sample inSample
+static uint64_t getArchiveSampleRecord( uint64_t inNumRecords,
+                                        uint64_t inSample ) {
+    return inSample * inNumRecords / ARCHIVE_FINGERPRINT_SAMPLES;
+}
+
+
+static uint64_t addToArchiveFingerprint( uint64_t inFingerprint,
+                                         const uint8_t *inKey,
+                                         unsigned int inKeySize ) {
+    return ( inFingerprint * 0x100000001b3ULL ) ^ 
+        LINEARDB3_hash( inKey, inKeySize );
+}
+
+
+
+// one pass over every record of an archive's source data file
+//
+// with inBuffer NULL, counts records per bucket: inOutNext[b+1]++
+// otherwise, copies records in buckets inFirstBucket up to inEndBucket
+// into inBuffer, each to slot inOutNext[b]++ (less inBufferStart)
+//
+// returns 0 on success, -1 on read error
+static int archivePass( FILE *inFile, uint64_t inNumRecords,
+                        unsigned int inKeySize, unsigned int inRecordSize,
+                        uint64_t inNumBuckets, uint64_t *inOutNext,
+                        uint64_t inFirstBucket, uint64_t inEndBucket,
+                        uint8_t *inBuffer, uint64_t inBufferStart ) {
+    
+    ASYNCIO_Reader *reader = ASYNCIO_openReader( 
+        fileno( inFile ), LINEARDB3_HEADER_SIZE,
+        LINEARDB3_HEADER_SIZE + inNumRecords * inRecordSize,
+        inRecordSize, ASYNCIO_DEFAULT_BLOCK_BYTES, ASYNCIO_DEFAULT_IN_FLIGHT );
+    
+    if( reader == NULL ) {
+        return -1;
+    }
+    
+    uint64_t numSeen = 0;
+    const uint8_t *block;
+    int64_t numInBlock;
+    
+    while( ( numInBlock = ASYNCIO_nextBlock( reader, &block ) ) > 0 ) {
+        
+        for( int64_t i=0; i<numInBlock; i++ ) {
+            const uint8_t *record = &( block[ i * inRecordSize ] );
+            
+            uint64_t b = getArchiveBucket( record, inKeySize, inNumBuckets );
+            
+            if( inBuffer == NULL ) {
+                inOutNext[ b + 1 ]++;
+            }
+            else if( b >= inFirstBucket && b < inEndBucket ) {
+                memcpy( &( inBuffer[ ( inOutNext[b] - inBufferStart ) * 
+                                     inRecordSize ] ),
+                        record, inRecordSize );
+                inOutNext[b]++;
+            }
+        }
+        numSeen += numInBlock;
+    }
+    
+    ASYNCIO_closeReader( reader );
+    
+    if( numInBlock < 0 || numSeen != inNumRecords ) {
+        // read error, or file changed under us
+        return -1;
+    }
+    return 0;
+}
+
+
+
+// writes static index for archive, returns 0 on success, -1 on error
+static int writeArchiveIndex( const char *inIndexPath, 
+                              unsigned int inKeySize, unsigned int inValueSize,
+                              uint64_t inNumRecords, uint64_t inNumBuckets,
+                              uint64_t inFingerprint,
+                              const uint64_t *inOffsets ) {
+    FILE *file = fopen( inIndexPath, "wb" );
+    
+    if( file == NULL ) {
+        return -1;
+    }
+    
+    uint8_t header[ LINEARDB3_ARCHIVE_INDEX_HEADER_SIZE ];
+    memset( header, 0, sizeof( header ) );
+    
+    // offsets run up to inNumRecords
+    uint8_t offsetBytes = ( inNumRecords <= UINT32_MAX ) ? 4 : 8;
+    uint32_t sizes[2] = { inKeySize, inValueSize };
+    
+    memcpy( header, "La2", 3 );
+    header[3] = offsetBytes;
+    memcpy( &( header[4] ), sizes, sizeof( sizes ) );
+    memcpy( &( header[12] ), &inNumRecords, sizeof( uint64_t ) );
+    memcpy( &( header[20] ), &inNumBuckets, sizeof( uint64_t ) );
+    memcpy( &( header[28] ), &inFingerprint, sizeof( uint64_t ) );
+
+    int result = 0;
+    
+    if( fwrite( header, sizeof( header ), 1, file ) != 1 ) {
+        result = -1;
+    }
+    
+    for( uint64_t b=0; b<=inNumBuckets && result == 0; b++ ) {
+        uint32_t offset32 = (uint32_t)inOffsets[b];
+        
+        const void *offset = &( inOffsets[b] );
+        
+        if( offsetBytes == 4 ) {
+            offset = &offset32;
+        }
+        
+        if( fwrite( offset, offsetBytes, 1, file ) != 1 ) {
+            result = -1;
+        }
+    }
+    
+    if( fclose( file ) != 0 ) {
+        result = -1;
+    }
+    return result;
+}
+
+
+
+int LINEARDB3_writeArchive( const char *inPath, 
+                            unsigned int inKeySize, unsigned int inValueSize,
+                            uint64_t inMemoryBytes ) {
+    
+    FILE *file = fopen( inPath, "rb" );
+
+    if( file == NULL ) {
+        return -1;
+    }
+    
+    char magic[3];
+    uint32_t sizes[2];
+    
+    if( fread( magic, 3, 1, file ) != 1 ||
+        fread( sizes, sizeof( sizes ), 1, file ) != 1 ||
+        memcmp( magic, magicString, 3 ) != 0 ||
+        sizes[0] != inKeySize || sizes[1] != inValueSize ) {
+        
+        printf( "%s is not a lineardb3 file with %u-byte keys and "
+                "%u-byte values\n", inPath, inKeySize, inValueSize );
+        fclose( file );
+        return -1;
+    }
+    
+    unsigned int recordSize = getRecordSizeBytes( inKeySize, inValueSize );
+    
+    if( fseeko( file, 0, SEEK_END ) ) {
+        fclose( file );
+        return -1;
+    }
+    
+    uint64_t fileSize = ftello( file );
+    uint64_t numRecords = ( fileSize - LINEARDB3_HEADER_SIZE ) / recordSize;
+    
+    if( LINEARDB3_HEADER_SIZE + numRecords * recordSize != fileSize ) {
+        printf( "Lineardb3 file %s has a partial record at the end, "
+                "open it read-write once to repair it\n", inPath );
+        fclose( file );
+        return -1;
+    }
+    
+    uint64_t numBuckets = 
+        numRecords / LINEARDB3_ARCHIVE_RECORDS_PER_BUCKET + 1;
+    
+    // count per bucket, then start of each bucket, 
+    // then next free slot of each bucket while records are placed
+    uint64_t *next = 
+        (uint64_t *)calloc( numBuckets + 1, sizeof( uint64_t ) );
+    
+    if( next == NULL ) {
+        fclose( file );
+        return -1;
+    }
+
+    if( archivePass( file, numRecords, inKeySize, recordSize, numBuckets,
+                     next, 0, 0, NULL, 0 ) != 0 ) {
+        free( next );
+        fclose( file );
+        return -1;
+    }
+
+    uint64_t maxBucketRecords = 0;
+    
+    for( uint64_t b=0; b<numBuckets; b++ ) {
+        if( next[ b + 1 ] > maxBucketRecords ) {
+            maxBucketRecords = next[ b + 1 ];
+        }
+        next[ b + 1 ] += next[b];
+    }
+
+
+    char *indexPath = new char[ strlen( inPath ) + 10 ];
+    char *newIndexPath = new char[ strlen( inPath ) + 10 ];
+    char *newPath = new char[ strlen( inPath ) + 10 ];
+    sprintf( indexPath, "%s.idx", inPath );
+    sprintf( newIndexPath, "%s.idx.new", inPath );
+    sprintf( newPath, "%s.new", inPath );
+    
+    int result = 0;
+
+
+    // regroup records a RAM budget's worth of buckets at a time, 
+    // a whole bucket always fits
+    // 按内存预算分批重排, 每批扫描一次原文件
+    uint64_t capacity = inMemoryBytes / recordSize;
+    
+    if( capacity < maxBucketRecords ) {
+        capacity = maxBucketRecords;
+    }
+    if( capacity > numRecords ) {
+        capacity = numRecords;
+    }
+    
+    uint8_t *buffer = NULL;
+    FILE *newFile = NULL;
+    
+    if( result == 0 ) {
+        buffer = (uint8_t *)malloc( capacity * recordSize + 1 );
+        newFile = fopen( newPath, "wb" );
+        
+        if( buffer == NULL || newFile == NULL ) {
+            result = -1;
+        }
+    }
+    
+    if( result == 0 &&
+        ( fwrite( magic, 3, 1, newFile ) != 1 ||
+          fwrite( sizes, sizeof( sizes ), 1, newFile ) != 1 ) ) {
+        result = -1;
+    }
+    
+    // index is written after the regrouped records, with their
+    // fingerprint, from bucket starts saved here before placing advances
+    // them
+    uint64_t *offsets = NULL;
+    
+    if( result == 0 ) {
+        offsets = (uint64_t *)malloc( ( numBuckets + 1 ) * sizeof( uint64_t ) );
+        
+        if( offsets == NULL ) {
+            result = -1;
+        }
+        else {
+            memcpy( offsets, next, ( numBuckets + 1 ) * sizeof( uint64_t ) );
+        }
+    }
+    
+    uint64_t fingerprint = 0;
+    uint64_t nextSample = 0;
+    
+    uint64_t firstBucket = 0;
+    
+    while( result == 0 && firstBucket < numBuckets ) {
+        uint64_t bufferStart = next[ firstBucket ];
+        uint64_t endBucket = firstBucket;
+        
+        while( endBucket < numBuckets && 
+               next[ endBucket + 1 ] - bufferStart <= capacity ) {
+            endBucket++;
+        }
+        
+        uint64_t bufferEnd = next[ endBucket ];
+        
+        if( bufferEnd > bufferStart ) {
+            if( archivePass( file, numRecords, inKeySize, recordSize, 
+                             numBuckets, next, firstBucket, endBucket, 
+                             buffer, bufferStart ) != 0 ||
+                fwrite( buffer, recordSize, bufferEnd - bufferStart, 
+                        newFile ) != bufferEnd - bufferStart ) {
+                result = -1;
+            }
+            
+            uint64_t r;
+            while( nextSample < ARCHIVE_FINGERPRINT_SAMPLES &&
+                   ( r = getArchiveSampleRecord( numRecords, nextSample ) )
+                   < bufferEnd ) {
+                fingerprint = addToArchiveFingerprint( 
+                    fingerprint, 
+                    &( buffer[ ( r - bufferStart ) * recordSize ] ),
+                    inKeySize );
+                nextSample++;
+            }
+        }
+        
+        firstBucket = endBucket;
+    }
+
+    free( buffer );
+    free( next );
+    fclose( file );
+    
+    if( newFile != NULL && fclose( newFile ) != 0 ) {
+        result = -1;
+    }
+    
+    if( result == 0 ) {
+        result = writeArchiveIndex( newIndexPath, inKeySize, inValueSize,
+                                    numRecords, numBuckets, fingerprint,
+                                    offsets );
+    }
+    free( offsets );
+    
+    if( result == 0 ) {
+#if defined( _MSC_VER ) || defined( __MINGW32__ )
+        // rename won't replace an existing file there
+        remove( inPath );
+        remove( indexPath );
+#endif
+        if( rename( newPath, inPath ) != 0 ||
+            rename( newIndexPath, indexPath ) != 0 ) {
+            result = -1;
+        }
+    }
+    
+    if( result != 0 ) {
+        remove( newPath );
+        remove( newIndexPath );
+    }
+    
+    delete [] indexPath;
+    delete [] newIndexPath;
+    delete [] newPath;
+    
+    return result;
+}
+
+
+
+static int openArchive( LINEARDB3 *inDB, const char *inPath,
+                        uint64_t inNumRecordsInFile ) {
+    
+    char *indexPath = new char[ strlen( inPath ) + 5 ];
+    sprintf( indexPath, "%s.idx", inPath );
+    
+    FILE *file = fopen( indexPath, "rb" );
+    
+    if( file == NULL ) {
+        printf( "Lineardb3 archive index %s not found\n", indexPath );
+        delete [] indexPath;
+        return 1;
+    }
+    
+    uint64_t size = 0;
+    
+    if( fseeko( file, 0, SEEK_END ) == 0 ) {
+        size = ftello( file );
+    }
+    
+    uint8_t *mapped = NULL;
+    
+    if( size >= LINEARDB3_ARCHIVE_INDEX_HEADER_SIZE ) {
+#ifdef LINEARDB3_HAS_MMAP
+        void *m = mmap( NULL, size, PROT_READ, MAP_SHARED, fileno( file ), 0 );
+        
+        if( m != MAP_FAILED ) {
+            mapped = (uint8_t *)m;
+        }
+#else
+        mapped = new uint8_t[ size ];
+        
+        if( fseeko( file, 0, SEEK_SET ) ||
+            fread( mapped, size, 1, file ) != 1 ) {
+            delete [] mapped;
+            mapped = NULL;
+        }
+#endif
+    }
+    
+    // mapping outlives file handle
+    fclose( file );
+    
+    if( mapped == NULL ) {
+        printf( "Failed to map lineardb3 archive index %s\n", indexPath );
+        delete [] indexPath;
+        return 1;
+    }
+
+    inDB->archiveIndexFile = mapped;
+    inDB->archiveIndexFileSize = size;
+    
+    uint32_t sizes[2];
+    uint64_t numRecords, numBuckets;
+    
+    memcpy( sizes, &( mapped[4] ), sizeof( sizes ) );
+    memcpy( &numRecords, &( mapped[12] ), sizeof( uint64_t ) );
+    memcpy( &numBuckets, &( mapped[20] ), sizeof( uint64_t ) );
+    
+    unsigned int offsetBytes = mapped[3];
+    
+    if( memcmp( mapped, "La2", 3 ) != 0 ||
+        ( offsetBytes != 4 && offsetBytes != 8 ) ||
+        sizes[0] != inDB->keySize || sizes[1] != inDB->valueSize ||
+        numBuckets == 0 ||
+        size != LINEARDB3_ARCHIVE_INDEX_HEADER_SIZE + 
+                ( numBuckets + 1 ) * offsetBytes ) {
+        
+        printf( "Lineardb3 archive index %s is damaged or doesn't match "
+                "%s\n", indexPath, inPath );
+        delete [] indexPath;
+        return 1;
+    }
+    
+    if( numRecords != inNumRecordsInFile ) {
+        printf( "Lineardb3 archive index %s is for %llu records, but %s "
+                "has %llu (changed since it was archived?)\n", indexPath,
+                (unsigned long long)numRecords, inPath,
+                (unsigned long long)inNumRecordsInFile );
+        delete [] indexPath;
+        return 1;
+    }
+    
+    // same count isn't enough, data file may have been rewritten in 
+    // another order (or re-archived with a crash before the index landed)
+    uint64_t fingerprint = 0;
+    uint64_t indexFingerprint;
+    memcpy( &indexFingerprint, &( mapped[28] ), sizeof( uint64_t ) );
+    
+    for( uint64_t i=0; 
+         i < ARCHIVE_FINGERPRINT_SAMPLES && inNumRecordsInFile > 0; i++ ) {
+        uint64_t r = getArchiveSampleRecord( inNumRecordsInFile, i );
+        
+        fingerprint = addToArchiveFingerprint( 
+            fingerprint, &( inDB->mappedRecords[ r * inDB->recordSizeBytes ] ),
+            inDB->keySize );
+    }
+    
+    if( fingerprint != indexFingerprint ) {
+        printf( "Lineardb3 archive index %s doesn't match records in %s "
+                "(data file rewritten since it was archived?)\n", 
+                indexPath, inPath );
+        delete [] indexPath;
+        return 1;
+    }
+    
+    delete [] indexPath;
+    
+    inDB->archiveNumBuckets = numBuckets;
+    inDB->archiveOffsetBytes = offsetBytes;
+    inDB->archiveOffsets = &( mapped[ LINEARDB3_ARCHIVE_INDEX_HEADER_SIZE ] );
+    
+    inDB->numRecords = inNumRecordsInFile;
+    
+    // empty stand-in, so table size and RAM queries still work
+    inDB->hashTableSizeA = 2;
+    inDB->hashTableSizeB = 2;
+    recomputeFingerprintMod( inDB );
+    
+    initPageManager( inDB->hashTable, inDB->hashTableSizeA );
+    initPageManager( inDB->overflowBuckets, 2 );
+    
+    for( uint64_t i=0; i<inNumRecordsInFile && inDB->spatialIndex != NULL; 
+         i++ ) {
+        if( indexSpatialKey( inDB, i, getRecordInRAM( inDB, i ) ) != 0 ) {
+            return 1;
+        }
+    }
+
+    inDB->lastOp = opRead;
+    
+    return 0;
+}
+
+
+
+static void closeArchive( LINEARDB3 *inDB ) {
+    if( inDB->archiveIndexFile == NULL ) {
+        return;
+    }
+    
+#ifdef LINEARDB3_HAS_MMAP
+    munmap( inDB->archiveIndexFile, inDB->archiveIndexFileSize );
+#else
+    delete [] inDB->archiveIndexFile;
+#endif
+
+    inDB->archiveIndexFile = NULL;
+    inDB->archiveIndexFileSize = 0;
+    inDB->archiveOffsets = NULL;
+}
+
+
+
+// first record of archive bucket inBucket 
+static inline uint64_t getArchiveOffset( LINEARDB3 *inDB, uint64_t inBucket ) {
+    const uint8_t *offset = 
+        &( inDB->archiveOffsets[ inBucket * inDB->archiveOffsetBytes ] );
+    
+    if( inDB->archiveOffsetBytes == 4 ) {
+        uint32_t offset32;
+        memcpy( &offset32, offset, sizeof( uint32_t ) );
+        return offset32;
+    }
+    
+    uint64_t offset64;
+    memcpy( &offset64, offset, sizeof( uint64_t ) );
+    return offset64;
+}
+
+
+
+// one index probe, then a scan of the bucket's few records, which
+// sit next to each other in the mapped data file
+// 归档查找
+static int getFromArchive( LINEARDB3 *inDB, const void *inKey, 
+                           void *outValue ) {
+    uint64_t bucket = 
+        getArchiveBucket( inKey, inDB->keySize, inDB->archiveNumBuckets );
+    
+    uint64_t end = getArchiveOffset( inDB, bucket + 1 );
+    
+    for( uint64_t r = getArchiveOffset( inDB, bucket ); r < end; r++ ) {
+        const uint8_t *record = 
+            &( inDB->mappedRecords[ r * inDB->recordSizeBytes ] );
+        
+        if( keyComp( inDB->keySize, record, inKey ) ) {
+            memcpy( outValue, &( record[ inDB->keySize ] ), inDB->valueSize );
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+typedef struct {
+        FingerprintBucket *nextBucket;
+        int nextRecord;
+    } BucketIterator;
+
+    
+
+
+// Repeated calls to this function will insert a series of records
+// into an empty bucket and any necessary overflow chain buckets
+// 重复调用此函数将插入一系列记录到一个空桶和任何必要的溢出链桶中
+// Assumes bucket/record pointed to by iterator is empty and at end of
 // chain (assumes this is a fresh series of inserts using an iterator
 // that started with an empty bucket).
 // 假设迭代器指向的桶/记录为空，且位于链表的末尾
@@ -777,7 +3299,8 @@ typedef struct {
 static void insertIntoBucket( LINEARDB3 *inDB,
                               BucketIterator *inBucketIterator,
                               uint32_t inFingerprint,
-                              uint32_t inFileIndex ) {
+                              uint8_t inTag,
+                              LINEARDB3_RecordIndex inFileIndex ) {
     
     if( inBucketIterator->nextRecord == RECORDS_PER_BUCKET ) { // 要插入的记录超出桶大小
         // 分配溢出桶, 找到溢出页数组的第一个空桶的索引
@@ -788,12 +3311,633 @@ static void insertIntoBucket( LINEARDB3 *inDB,
             getBucket( inDB->overflowBuckets, inBucketIterator->nextBucket->overflowIndex );
     }
 
-    // 指纹
-    inBucketIterator->nextBucket-> fingerprints[ inBucketIterator->nextRecord ] = inFingerprint;
-    // 文件索引
-    inBucketIterator->nextBucket-> fileIndex[ inBucketIterator->nextRecord ] = inFileIndex;
-    // 迭代器指向下一条记录
-    inBucketIterator->nextRecord++;
+    // 指纹
+    inBucketIterator->nextBucket-> fingerprints[ inBucketIterator->nextRecord ] = inFingerprint;
+    inBucketIterator->nextBucket-> tags[ inBucketIterator->nextRecord ] = inTag;
+    // 文件索引
+    setFileIndex( inBucketIterator->nextBucket, 
+                  inBucketIterator->nextRecord, inFileIndex );
+    // 迭代器指向下一条记录
+    inBucketIterator->nextRecord++;
+}
+
+
+
+// key digest and record number, sorted to bring duplicate keys together
+typedef struct {
+    uint64_t digest;
+    uint64_t fileIndex;
+} DigestPair;
+
+
+static inline bool digestPairLess( const DigestPair &inA, 
+                                   const DigestPair &inB ) {
+    if( inA.digest != inB.digest ) {
+        return inA.digest < inB.digest;
+    }
+    return inA.fileIndex < inB.fileIndex;
+}
+
+
+// partitions are the top 8 bits of the digest 按摘要高8位分区
+#define VERIFY_PARTITION_BITS 8
+#define VERIFY_NUM_PARTITIONS ( 1 << VERIFY_PARTITION_BITS )
+
+static inline unsigned int getDigestPartition( uint64_t inDigest ) {
+    return (unsigned int)( inDigest >> ( 64 - VERIFY_PARTITION_BITS ) );
+}
+
+
+
+// verify pass 1, one thread: digest of every record in [inStart, inEnd)
+// into outPairs, and count of digests in each partition into outCounts
+// sets *outFailed on read error
+static void digestRecordRange( LINEARDB3 *inDB, 
+                               uint64_t inStart, uint64_t inEnd,
+                               DigestPair *outPairs, uint64_t *outCounts,
+                               char *outFailed ) {
+    
+    ASYNCIO_Reader *reader = NULL;
+    
+    if( getRecordInRAM( inDB, 0 ) == NULL ) {
+        // several of these run at once, keep fewer reads in flight each
+        reader = ASYNCIO_openReader( 
+            fileno( inDB->file ), 
+            LINEARDB3_HEADER_SIZE + inStart * inDB->recordSizeBytes,
+            LINEARDB3_HEADER_SIZE + inEnd * inDB->recordSizeBytes,
+            inDB->recordSizeBytes, ASYNCIO_DEFAULT_BLOCK_BYTES, 2 );
+        
+        if( reader == NULL ) {
+            *outFailed = true;
+            return;
+        }
+    }
+    
+    uint64_t i = inStart;
+
+    while( i < inEnd ) {
+        const uint8_t *block = getRecordInRAM( inDB, i );
+        int64_t numInBlock = inEnd - i;
+        
+        if( reader != NULL ) {
+            numInBlock = ASYNCIO_nextBlock( reader, &block );
+            
+            if( numInBlock <= 0 ) {
+                // read error, or file shorter than we measured
+                *outFailed = true;
+                break;
+            }
+        }
+        
+        for( int64_t j=0; j<numInBlock; j++ ) {
+            uint64_t digest = 
+                getKeyDigest( inDB, &( block[ j * inDB->recordSizeBytes ] ) );
+            
+            outPairs[i].digest = digest;
+            outPairs[i].fileIndex = i;
+            outCounts[ getDigestPartition( digest ) ]++;
+            i++;
+        }
+    }
+    
+    if( reader != NULL ) {
+        ASYNCIO_closeReader( reader );
+    }
+}
+
+
+
+// verify pass 2, one thread: takes whole partitions until none are left,
+// sorts each, and notes where each run of two or more equal digests starts
+static void sortDigestPartitions( DigestPair *inPairs, 
+                                  const uint64_t *inPartitionStart,
+                                  std::atomic<unsigned int> *inNextPartition,
+                                  std::vector<uint64_t> *outRunStarts ) {
+    unsigned int p;
+    
+    while( ( p = ( *inNextPartition )++ ) < VERIFY_NUM_PARTITIONS ) {
+        uint64_t start = inPartitionStart[p];
+        uint64_t end = inPartitionStart[ p + 1 ];
+        
+        std::sort( &( inPairs[ start ] ), &( inPairs[ end ] ), 
+                   digestPairLess );
+        
+        for( uint64_t i=start; i+1<end; i++ ) {
+            if( inPairs[i].digest == inPairs[ i + 1 ].digest &&
+                ( i == start || inPairs[ i - 1 ].digest != inPairs[i].digest ) ) {
+                outRunStarts[p].push_back( i );
+            }
+        }
+    }
+}
+
+
+
+// key of record inFileIndex into outKey, from RAM or data file
+// returns 0 on success, -1 on error
+static int readKeyOfRecord( LINEARDB3 *inDB, uint64_t inFileIndex,
+                            uint8_t *outKey ) {
+    const uint8_t *record = getRecordInRAM( inDB, inFileIndex );
+    
+    if( record != NULL ) {
+        memcpy( outKey, record, inDB->keySize );
+        return 0;
+    }
+    
+    if( seekDataFile( inDB, LINEARDB3_HEADER_SIZE + 
+                      inFileIndex * inDB->recordSizeBytes, opRead ) != 0 ) {
+        return -1;
+    }
+    inDB->lastOp = opRead;
+    
+    if( fread( outKey, inDB->keySize, 1, inDB->file ) != 1 ) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+// Slides every record that isn't dead down over the dead ones, starting
+// at first dead record, then cuts the file after the last one kept.
+// Writes always trail reads, so one pass in place is safe.
+// 原地压缩: 活记录前移, 截断文件尾
+//
+// returns number of records kept, or -1 on error
+static int64_t compactDataFile( LINEARDB3 *inDB, uint64_t inNumRecords,
+                                const std::vector<uint8_t> &inDead,
+                                uint64_t inFirstDead ) {
+    
+    unsigned int recordSize = inDB->recordSizeBytes;
+    
+    fflush( inDB->file );
+    
+    ASYNCIO_Reader *reader = ASYNCIO_openReader( 
+        fileno( inDB->file ), 
+        LINEARDB3_HEADER_SIZE + inFirstDead * recordSize,
+        LINEARDB3_HEADER_SIZE + inNumRecords * recordSize,
+        recordSize, ASYNCIO_DEFAULT_BLOCK_BYTES, ASYNCIO_DEFAULT_IN_FLIGHT );
+    
+    ASYNCIO_Writer *writer = ASYNCIO_openWriter( 
+        fileno( inDB->file ), 
+        LINEARDB3_HEADER_SIZE + inFirstDead * recordSize,
+        ASYNCIO_DEFAULT_BLOCK_BYTES, ASYNCIO_DEFAULT_IN_FLIGHT );
+    
+    if( reader == NULL || writer == NULL ) {
+        if( reader != NULL ) {
+            ASYNCIO_closeReader( reader );
+        }
+        if( writer != NULL ) {
+            ASYNCIO_closeWriter( writer );
+        }
+        return -1;
+    }
+    
+    uint64_t numKept = inFirstDead;
+    uint64_t i = inFirstDead;
+    char failed = false;
+    const uint8_t *block;
+    int64_t numInBlock;
+    
+    while( ! failed && i < inNumRecords &&
+           ( numInBlock = ASYNCIO_nextBlock( reader, &block ) ) > 0 ) {
+        
+        for( int64_t j=0; j<numInBlock; j++ ) {
+            if( ! ( inDead[ i / 8 ] & ( 1 << ( i % 8 ) ) ) ) {
+                if( ASYNCIO_write( writer, &( block[ j * recordSize ] ),
+                                   recordSize ) != 0 ) {
+                    failed = true;
+                    break;
+                }
+                numKept++;
+            }
+            i++;
+        }
+    }
+    
+    ASYNCIO_closeReader( reader );
+    
+    if( ASYNCIO_closeWriter( writer ) != 0 || failed || i != inNumRecords ) {
+        return -1;
+    }
+    
+    // survivors on disk before tail goes away, a crash in between
+    // leaves duplicates that the next verifying open removes again
+    if( syncFile( inDB->file ) != 0 ||
+        truncateFile( inDB->file, 
+                      LINEARDB3_HEADER_SIZE + numKept * recordSize ) != 0 ||
+        syncFile( inDB->file ) != 0 ) {
+        return -1;
+    }
+    
+    // drop anything stdio buffered from before, file changed under it
+    if( fseeko( inDB->file, 0, SEEK_SET ) ) {
+        return -1;
+    }
+    inDB->lastOp = opRead;
+    
+    return (int64_t)numKept;
+}
+
+
+
+// LINEARDB3_OPEN_VERIFY_UNIQUE pass at open, before the table is built
+//
+// Hashes every key once, spread over several threads, into (digest, 
+// record number) pairs, partitions them by digest, and sorts partitions
+// in parallel.  Only records whose digests collide have their keys 
+// compared.  Of each set of records with equal keys, the one with the
+// highest record number (last written) is kept.
+// 并行检测重复key, 保留最后写入的记录
+//
+// Read-only, duplicates are only reported.
+//
+// returns 0 on success, 1 on error (message already printed)
+static int verifyUniqueKeys( LINEARDB3 *inDB, const char *inPath, 
+                             uint64_t *inOutNumRecords ) {
+    
+    uint64_t numRecords = *inOutNumRecords;
+    
+    if( numRecords < 2 ) {
+        return 0;
+    }
+    
+    DigestPair *pairs = 
+        (DigestPair *)malloc( numRecords * sizeof( DigestPair ) );
+    
+    if( pairs == NULL ) {
+        printf( "Out of memory verifying keys of lineardb3 file %s\n",
+                inPath );
+        return 1;
+    }
+    
+    
+    unsigned int numThreads = std::thread::hardware_concurrency();
+    
+    if( numThreads < 1 ) {
+        numThreads = 1;
+    }
+    if( numThreads > 8 ) {
+        numThreads = 8;
+    }
+    if( numThreads > numRecords ) {
+        numThreads = (unsigned int)numRecords;
+    }
+    
+
+    // pass 1: digest every key, contiguous range per thread 计算摘要
+    
+    // readers go around FILE, which may still hold replayed puts
+    fflush( inDB->file );
+    
+    std::vector<uint64_t> counts( 
+        (uint64_t)numThreads * VERIFY_NUM_PARTITIONS, 0 );
+    std::vector<char> failed( numThreads, false );
+    std::vector<std::thread> threads;
+    
+    for( unsigned int t=0; t<numThreads; t++ ) {
+        threads.push_back( std::thread( 
+            digestRecordRange, inDB, 
+            numRecords * t / numThreads, numRecords * ( t + 1 ) / numThreads,
+            pairs, &( counts[ t * VERIFY_NUM_PARTITIONS ] ), 
+            &( failed[t] ) ) );
+    }
+    
+    char anyFailed = false;
+
+    for( unsigned int t=0; t<numThreads; t++ ) {
+        threads[t].join();
+        anyFailed = anyFailed || failed[t];
+    }
+    threads.clear();
+    
+    if( anyFailed ) {
+        printf( "Failed to read lineardb3 file %s while verifying keys\n",
+                inPath );
+        free( pairs );
+        return 1;
+    }
+    
+    
+    // partition in place by top digest bits, each pair is moved once
+    // 原地分区
+    uint64_t partitionStart[ VERIFY_NUM_PARTITIONS + 1 ];
+    uint64_t partitionNext[ VERIFY_NUM_PARTITIONS ];
+    
+    partitionStart[0] = 0;
+    
+    for( unsigned int p=0; p<VERIFY_NUM_PARTITIONS; p++ ) {
+        uint64_t count = 0;
+        
+        for( unsigned int t=0; t<numThreads; t++ ) {
+            count += counts[ t * VERIFY_NUM_PARTITIONS + p ];
+        }
+        partitionStart[ p + 1 ] = partitionStart[p] + count;
+        partitionNext[p] = partitionStart[p];
+    }
+    
+    for( unsigned int p=0; p<VERIFY_NUM_PARTITIONS; p++ ) {
+        while( partitionNext[p] < partitionStart[ p + 1 ] ) {
+            DigestPair pair = pairs[ partitionNext[p] ];
+            unsigned int q = getDigestPartition( pair.digest );
+            
+            // carry it to its partition, picking up what was there
+            while( q != p ) {
+                std::swap( pair, pairs[ partitionNext[q]++ ] );
+                q = getDigestPartition( pair.digest );
+            }
+            pairs[ partitionNext[p]++ ] = pair;
+        }
+    }
+    
+    
+    // pass 2: sort partitions in parallel, find digest collisions 排序
+    std::atomic<unsigned int> nextPartition( 0 );
+    std::vector< std::vector<uint64_t> > runStarts( VERIFY_NUM_PARTITIONS );
+    
+    for( unsigned int t=0; t<numThreads; t++ ) {
+        threads.push_back( std::thread( 
+            sortDigestPartitions, pairs, partitionStart, &nextPartition, 
+            &( runStarts[0] ) ) );
+    }
+    for( unsigned int t=0; t<numThreads; t++ ) {
+        threads[t].join();
+    }
+    
+    
+    // confirm collisions against actual keys
+    // a record is dead if a later record has the same key
+    // 比较完整key, 标记被覆盖的旧记录
+    std::vector<uint8_t> dead;
+    std::vector<uint8_t> runKeys;
+    uint64_t numDead = 0;
+    uint64_t firstDead = numRecords;
+    
+    for( unsigned int p=0; p<VERIFY_NUM_PARTITIONS && ! anyFailed; p++ ) {
+        for( size_t r=0; r<runStarts[p].size() && ! anyFailed; r++ ) {
+            uint64_t start = runStarts[p][r];
+            uint64_t end = start + 1;
+            
+            while( end < partitionStart[ p + 1 ] &&
+                   pairs[ end ].digest == pairs[ start ].digest ) {
+                end++;
+            }
+            
+            uint64_t runLength = end - start;
+            runKeys.resize( runLength * inDB->keySize );
+            
+            for( uint64_t j=0; j<runLength; j++ ) {
+                if( readKeyOfRecord( inDB, pairs[ start + j ].fileIndex,
+                                     &( runKeys[ j * inDB->keySize ] ) ) 
+                    != 0 ) {
+                    anyFailed = true;
+                    break;
+                }
+            }
+            
+            // sorted by record number within run, so only later ones
+            // need checking
+            for( uint64_t j=0; j<runLength && ! anyFailed; j++ ) {
+                for( uint64_t k=j+1; k<runLength; k++ ) {
+                    if( keyComp( inDB->keySize, 
+                                 &( runKeys[ j * inDB->keySize ] ),
+                                 &( runKeys[ k * inDB->keySize ] ) ) ) {
+                        
+                        uint64_t i = pairs[ start + j ].fileIndex;
+                        
+                        if( dead.size() == 0 ) {
+                            dead.resize( numRecords / 8 + 1, 0 );
+                        }
+                        dead[ i / 8 ] |= (uint8_t)( 1 << ( i % 8 ) );
+                        numDead++;
+                        
+                        if( i < firstDead ) {
+                            firstDead = i;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    
+    free( pairs );
+    
+    if( anyFailed ) {
+        printf( "Failed to read lineardb3 file %s while verifying keys\n",
+                inPath );
+        return 1;
+    }
+    
+    if( numDead == 0 ) {
+        return 0;
+    }
+    
+    if( inDB->readOnly ) {
+        printf( "Warning:  lineardb3 file %s has %llu records whose keys "
+                "are repeated later in the file.  Lookups may find either "
+                "copy.  Open it read-write with verification to repair "
+                "it.\n", inPath, (unsigned long long)numDead );
+        return 0;
+    }
+    
+    // old log is already replayed and synced, and its record numbers
+    // are about to go stale
+    remove( inDB->walPath );
+    
+    int64_t numKept = compactDataFile( inDB, numRecords, dead, firstDead );
+    
+    if( numKept < 0 ) {
+        printf( "Failed to remove duplicate keys from lineardb3 file %s\n",
+                inPath );
+        return 1;
+    }
+    
+    printf( "Removed %llu records with duplicate keys from lineardb3 "
+            "file %s, kept last-written copy of each\n", 
+            (unsigned long long)numDead, inPath );
+    
+    *inOutNumRecords = (uint64_t)numKept;
+    
+    return 0;
+}
+
+
+
+// Counting sort of record numbers by bin, then one sequential fill pass
+// over the table.  Every bucket's chain is written front to back with
+// insertIntoBucket, so there are no chain walks and no random bucket
+// accesses while building.
+// 按桶号计数排序文件索引, 然后顺序填充主桶和溢出桶
+//
+// Same layout as inserting records in file order with inIgnoreDataFile,
+// (records within a bucket stay in file order), and, like that path,
+// assumes every key in the file is unique.
+static int bulkBuildTable( LINEARDB3 *inDB, uint64_t inNumRecords ) {
+
+    uint32_t numBins = inDB->hashTableSizeB;
+
+    // fingerprint of each record, by file index
+    uint32_t *fingerprints =
+        (uint32_t *)malloc( inNumRecords * sizeof( uint32_t ) );
+
+    // tag of each record, by file index
+    uint8_t *tags = (uint8_t *)malloc( inNumRecords );
+
+    // file indices, grouped by bin
+    LINEARDB3_RecordIndex *sortedFileIndex =
+        (LINEARDB3_RecordIndex *)malloc( inNumRecords * 
+                                         sizeof( LINEARDB3_RecordIndex ) );
+
+    // binStart[b] is where bin b starts in sortedFileIndex
+    LINEARDB3_RecordIndex *binStart =
+        (LINEARDB3_RecordIndex *)calloc( (uint64_t)numBins + 1, 
+                                         sizeof( LINEARDB3_RecordIndex ) );
+
+    if( fingerprints == NULL || tags == NULL || 
+        sortedFileIndex == NULL || binStart == NULL ) {
+        free( fingerprints );
+        free( tags );
+        free( sortedFileIndex );
+        free( binStart );
+        return 1;
+    }
+
+
+    // records not already in RAM stream in from the file in big blocks,
+    // with reads kept in flight while we hash 异步预读
+    ASYNCIO_Reader *reader = NULL;
+    const uint8_t *block = NULL;
+    uint64_t numInBlock = 0;
+    uint64_t nextInBlock = 0;
+    
+    if( getRecordInRAM( inDB, 0 ) == NULL ) {
+        // reader goes around FILE, which may still hold replayed puts
+        fflush( inDB->file );
+        
+        reader = ASYNCIO_openReader( 
+            fileno( inDB->file ), LINEARDB3_HEADER_SIZE,
+            LINEARDB3_HEADER_SIZE + inNumRecords * inDB->recordSizeBytes,
+            inDB->recordSizeBytes, 
+            ASYNCIO_DEFAULT_BLOCK_BYTES, ASYNCIO_DEFAULT_IN_FLIGHT );
+        
+        if( reader == NULL ) {
+            free( fingerprints );
+            free( tags );
+            free( sortedFileIndex );
+            free( binStart );
+            return 1;
+        }
+    }
+    
+    // pass 1: hash every key once, count records per bin 计数
+    for( uint64_t i=0; i<inNumRecords; i++ ) {
+        const uint8_t *record = getRecordInRAM( inDB, i );
+        
+        if( record == NULL ) {
+            if( nextInBlock == numInBlock ) {
+                int64_t result = ASYNCIO_nextBlock( reader, &block );
+                nextInBlock = 0;
+                
+                if( result == 0 ) {
+                    // file is shorter than it was when we measured it
+                    // only build from the whole records we got, caller
+                    // will notice and truncate the torn tail
+                    inNumRecords = i;
+                    break;
+                }
+                
+                if( result < 0 ) {
+                    ASYNCIO_closeReader( reader );
+                    free( fingerprints );
+                    free( tags );
+                    free( sortedFileIndex );
+                    free( binStart );
+                    return -1;
+                }
+                
+                numInBlock = (uint64_t)result;
+            }
+            
+            record = &( block[ nextInBlock * inDB->recordSizeBytes ] );
+            nextInBlock++;
+        }
+
+        uint64_t binNumber = getBinNumber( inDB, record,
+                                           &( fingerprints[i] ),
+                                           &( tags[i] ) );
+
+        if( storeRAMKey( inDB, i, record ) != 0 ||
+            indexSpatialKey( inDB, i, record ) != 0 ) {
+            if( reader != NULL ) {
+                ASYNCIO_closeReader( reader );
+            }
+            free( fingerprints );
+            free( tags );
+            free( sortedFileIndex );
+            free( binStart );
+            return -1;
+        }
+        binStart[ binNumber + 1 ] ++;
+    }
+    
+    if( reader != NULL ) {
+        ASYNCIO_closeReader( reader );
+    }
+
+
+    // prefix sums turn counts into start offsets 前缀和
+    for( uint32_t b=0; b<numBins; b++ ) {
+        binStart[ b + 1 ] += binStart[ b ];
+    }
+
+
+    // pass 2: stable scatter of file indices into their bins
+    // afterwards, binStart[b] points to end of bin b (start of bin b+1)
+    for( uint64_t i=0; i<inNumRecords; i++ ) {
+        uint64_t binNumber = getBinNumber( inDB, fingerprints[i] );
+
+        sortedFileIndex[ binStart[ binNumber ] ++ ] = (LINEARDB3_RecordIndex)i;
+    }
+
+
+    // pass 3: fill buckets in table order 按桶顺序填充
+    LINEARDB3_RecordIndex binEnd = 0;
+
+    for( uint32_t b=0; b<numBins; b++ ) {
+        LINEARDB3_RecordIndex binBegin = binEnd;
+        binEnd = binStart[ b ];
+
+        if( binBegin == binEnd ) {
+            continue;
+        }
+
+        BucketIterator iter = { getBucket( inDB->hashTable, b ), 0 };
+
+        for( LINEARDB3_RecordIndex r=binBegin; r<binEnd; r++ ) {
+            LINEARDB3_RecordIndex fileIndex = sortedFileIndex[ r ];
+
+            insertIntoBucket( inDB, &iter,
+                              fingerprints[ fileIndex ], tags[ fileIndex ],
+                              fileIndex );
+        }
+
+        unsigned int overflowDepth =
+            ( binEnd - binBegin - 1 ) / RECORDS_PER_BUCKET;
+
+        if( overflowDepth > inDB->maxOverflowDepth ) {
+            inDB->maxOverflowDepth = overflowDepth;
+        }
+    }
+
+    inDB->numRecords = (LINEARDB3_RecordIndex)inNumRecords;
+
+    free( fingerprints );
+    free( tags );
+    free( sortedFileIndex );
+    free( binStart );
+
+    return 0;
 }
 
 
@@ -830,10 +3974,13 @@ static int expandTable( LINEARDB3 *inDB ) {
     
     // expand table one cell at a time until we are back at or below maxLoad
     // 每次扩容一桶, 直到满足负载因子
+    // (stops at LINEARDB3_MAX_BUCKETS, if maxLoad was lowered since
+    // puts were checked against it)
     while( 
-        (double)( inDB->numRecords ) / (double)( inDB->hashTableSizeB * RECORDS_PER_BUCKET ) // 负载因子公式
+        (double)( inDB->numRecords ) / ( (double)inDB->hashTableSizeB * RECORDS_PER_BUCKET ) // 负载因子公式
         >
-        inDB->maxLoad
+        inDB->maxLoad &&
+        inDB->hashTableSizeB < LINEARDB3_MAX_BUCKETS
     ) {
         uint32_t oldSplitPoint = inDB->hashTableSizeB - inDB->hashTableSizeA;
 
@@ -852,6 +3999,7 @@ static int expandTable( LINEARDB3 *inDB ) {
         uint32_t newBucketIndex = inDB->hashTableSizeB;
 
         inDB->hashTableSizeB ++;
+        STAT( inDB, numExpansions );
 
 
         BucketIterator oldIter = { oldBucket, 0 };
@@ -884,7 +4032,7 @@ static int expandTable( LINEARDB3 *inDB ) {
                     break;
                     }
                 // 文件索引
-                uint32_t fileIndex = tempBucket.fileIndex[ r ];
+                LINEARDB3_RecordIndex fileIndex = getFileIndex( &tempBucket, r );
                 // 新桶号
                 uint64_t newBinNum = getBinNumber( inDB, fingerprint );
                 
@@ -903,7 +4051,8 @@ static int expandTable( LINEARDB3 *inDB ) {
                     return -1;
                 }
                 // 将记录插入新桶
-                insertIntoBucket( inDB, insertIterator, fingerprint, fileIndex );
+                insertIntoBucket( inDB, insertIterator, fingerprint, 
+                                  tempBucket.tags[ r ], fileIndex );
             }
             
             if( tempBucket.overflowIndex != 0 ) { // 有溢出桶
@@ -939,6 +4088,199 @@ static int expandTable( LINEARDB3 *inDB ) {
 
 
 
+// Merges last bucket of table back into the bucket it was split from,
+// appending its records (and its overflow chain's) to the end of that 
+// bucket's chain.  Exact reverse of one expandTable step.
+// 合并最后一个桶 (扩容的逆操作)
+//
+// returns 0 on success, 1 if table can't get any smaller
+static int mergeLastBucket( LINEARDB3 *inDB ) {
+    
+    if( inDB->hashTableSizeB == inDB->hashTableSizeA ) {
+        // start of a round, step back to the one before
+        // fingerprintMod is a multiple of the halved size too
+        if( inDB->hashTableSizeA % 2 != 0 || inDB->hashTableSizeA < 4 ) {
+            return 1;
+        }
+        inDB->hashTableSizeA /= 2;
+    }
+    
+    uint32_t lastBucketIndex = inDB->hashTableSizeB - 1;
+    uint32_t intoBucketIndex = lastBucketIndex - inDB->hashTableSizeA;
+    
+    
+    // find end of chain we're appending to
+    FingerprintBucket *intoBucket = getBucket( inDB->hashTable, 
+                                               intoBucketIndex );
+    
+    while( intoBucket->overflowIndex != 0 ) {
+        intoBucket = getBucket( inDB->overflowBuckets, 
+                                intoBucket->overflowIndex );
+    }
+    
+    int numInto = 0;
+    
+    while( numInto < RECORDS_PER_BUCKET && 
+           intoBucket->fingerprints[ numInto ] != 0 ) {
+        numInto++;
+    }
+    
+    BucketIterator intoIter = { intoBucket, numInto };
+    
+    
+    FingerprintBucket *nextOldBucket = 
+        getBucket( inDB->hashTable, lastBucketIndex );
+    
+    while( nextOldBucket != NULL ) {
+        // make a working copy, then clear the real one
+        FingerprintBucket tempBucket;
+        memcpy( &tempBucket, nextOldBucket, sizeof( FingerprintBucket ) );
+        
+        memset( nextOldBucket, 0, sizeof( FingerprintBucket ) );
+        
+        for( int r=0; r<RECORDS_PER_BUCKET; r++ ) {
+            if( tempBucket.fingerprints[ r ] == 0 ) {
+                break;
+            }
+            insertIntoBucket( inDB, &intoIter, tempBucket.fingerprints[ r ],
+                              tempBucket.tags[ r ], 
+                              getFileIndex( &tempBucket, r ) );
+        }
+        
+        nextOldBucket = NULL;
+        
+        if( tempBucket.overflowIndex != 0 ) {
+            nextOldBucket = getBucket( inDB->overflowBuckets, 
+                                       tempBucket.overflowIndex );
+            // cleared next time through loop
+            markBucketEmpty( inDB->overflowBuckets, tempBucket.overflowIndex );
+        }
+    }
+    
+    inDB->hashTableSizeB--;
+    inDB->hashTable->numBuckets--;
+    STAT( inDB, numContractions );
+    
+    return 0;
+}
+
+
+
+// frees pages at end of inPM beyond those holding its first inNumBuckets
+// buckets (which must be all that's in use), keeping half a page spare 
+// so a table hovering around a page boundary doesn't thrash
+// 释放尾部的空页
+static void releaseTrailingPages( LINEARDB3 *inDB, PageManager *inPM,
+                                  uint32_t inNumBuckets ) {
+    
+    while( inPM->numPages > 1 &&
+           (uint64_t)inNumBuckets + BUCKETS_PER_PAGE / 2 <= 
+               (uint64_t)( inPM->numPages - 1 ) * BUCKETS_PER_PAGE ) {
+        
+        inPM->numPages--;
+        deleteBucketPage( inPM, inPM->pages[ inPM->numPages ] );
+        inPM->pages[ inPM->numPages ] = NULL;
+        
+        inDB->numPagesReleased++;
+    }
+    
+    uint32_t end = inPM->numPages * BUCKETS_PER_PAGE;
+    
+    if( inPM->numBuckets > end ) {
+        inPM->numBuckets = end;
+    }
+    if( inPM->firstEmptyBucket > end ) {
+        inPM->firstEmptyBucket = end;
+    }
+}
+
+
+
+// Moves overflow buckets from the end of overflow storage down into 
+// holes, fixing the link that points to each, so trailing overflow
+// pages end up empty.  One walk of every chain to count, and one more 
+// to move, only if there's a page to gain.
+// 压缩溢出桶, 便于释放尾部页
+static void compactOverflowBuckets( LINEARDB3 *inDB ) {
+    PageManager *pm = inDB->overflowBuckets;
+    
+    uint64_t numInUse = 0;
+    
+    for( uint32_t b=0; b<inDB->hashTableSizeB; b++ ) {
+        FingerprintBucket *bucket = getBucket( inDB->hashTable, b );
+        
+        while( bucket->overflowIndex != 0 ) {
+            numInUse++;
+            bucket = getBucket( pm, bucket->overflowIndex );
+        }
+    }
+    
+    // index 0 is never used
+    uint64_t limit = numInUse + 1;
+    
+    if( limit + BUCKETS_PER_PAGE / 2 > 
+        (uint64_t)( pm->numPages - 1 ) * BUCKETS_PER_PAGE ) {
+        // nothing to free
+        return;
+    }
+    
+    // holes get filled lowest first
+    pm->firstEmptyBucket = 0;
+    
+    for( uint32_t b=0; b<inDB->hashTableSizeB; b++ ) {
+        FingerprintBucket *bucket = getBucket( inDB->hashTable, b );
+        
+        while( bucket->overflowIndex != 0 ) {
+            uint32_t index = bucket->overflowIndex;
+            
+            if( index >= limit ) {
+                // first empty is always below limit, there are only
+                // numInUse buckets in use
+                uint32_t newIndex = getFirstEmptyBucketIndex( pm );
+                FingerprintBucket *oldBucket = getBucket( pm, index );
+                
+                memcpy( getBucket( pm, newIndex ), oldBucket, 
+                        sizeof( FingerprintBucket ) );
+                memset( oldBucket, 0, sizeof( FingerprintBucket ) );
+                
+                bucket->overflowIndex = newIndex;
+            }
+            bucket = getBucket( pm, bucket->overflowIndex );
+        }
+    }
+    
+    releaseTrailingPages( inDB, pm, (uint32_t)limit );
+}
+
+
+
+int64_t LINEARDB3_contract( LINEARDB3 *inDB ) {
+    if( inDB->readOnly ) {
+        return -1;
+    }
+    
+    uint32_t startSize = inDB->hashTableSizeB;
+    
+    // stop while one more merge would still leave table at or below 
+    // maxLoad, same line expandTable grows to
+    while( (double)inDB->numRecords / 
+           ( (double)( inDB->hashTableSizeB - 1 ) * RECORDS_PER_BUCKET ) 
+           <= inDB->maxLoad ) {
+        
+        if( mergeLastBucket( inDB ) != 0 ) {
+            break;
+        }
+    }
+    
+    releaseTrailingPages( inDB, inDB->hashTable, inDB->hashTableSizeB );
+    
+    compactOverflowBuckets( inDB );
+    
+    return (int64_t)( startSize - inDB->hashTableSizeB );
+}
+
+
+
 // 基于64位哈希值获取桶号 (通过指纹也是等效的)
 static uint64_t getBinNumberFromHash( LINEARDB3 *inDB, uint64_t inHashVal ) {
 
@@ -955,7 +4297,7 @@ static uint64_t getBinNumberFromHash( LINEARDB3 *inDB, uint64_t inHashVal ) {
         // points before split can be mod'ed with double base table size
 
         // binNumberB will always fit in hashTableSizeB, the expanded table
-        binNumberB = inHashVal % (uint64_t)( inDB->hashTableSizeA * 2 );
+        binNumberB = inHashVal % ( (uint64_t)inDB->hashTableSizeA * 2 );
     }
     return binNumberB;
 }
@@ -970,7 +4312,8 @@ static uint64_t getBinNumber( LINEARDB3 *inDB, uint32_t inFingerprint ) {
 
 
 // 基于key获取桶号
-static uint64_t getBinNumber( LINEARDB3 *inDB, const void *inKey, uint32_t *outFingerprint ) {
+static uint64_t getBinNumber( LINEARDB3 *inDB, const void *inKey, 
+                              uint32_t *outFingerprint, uint8_t *outTag ) {
     // murmurhash2计算key的64位哈希值
     uint64_t hashVal = LINEARDB3_hash( inKey, inDB->keySize );
     // 哈希值取模得到指纹
@@ -991,6 +4334,11 @@ static uint64_t getBinNumber( LINEARDB3 *inDB, const void *inKey, uint32_t *outF
         
         *outFingerprint = hashVal % inDB->fingerprintMod;
     }
+
+    // fingerprints in one bucket all agree on their bin-number bits, 
+    // so tag comes from the other end of the hash to actually tell them apart
+    // 标签取哈希最高字节, 与桶号无关
+    *outTag = (uint8_t)( hashVal >> 56 );
     
     
     return getBinNumberFromHash( inDB, hashVal );
@@ -1015,6 +4363,7 @@ static int LINEARDB3_considerFingerprintBucket(
     const void *inKey,
     void *inOutValue, // 输入/输出值（put 时写入，get 时读取）
     uint32_t inFingerprint,
+    uint8_t inTag,
     char inPut, // 0 for get, 1 for put
     char inIgnoreDataFile, // 仅更新RAM
     FingerprintBucket *inBucket, // 要检查的桶
@@ -1023,6 +4372,8 @@ static int LINEARDB3_considerFingerprintBucket(
     
     int i = inRecIndex;
     
+    STAT( inDB, numSlotProbes );
+    
     uint32_t binFP = inBucket->fingerprints[ i ]; // 当前桶指纹
         
     char emptyRec = false;
@@ -1034,10 +4385,15 @@ static int LINEARDB3_considerFingerprintBucket(
             // set fingerprint and file pos for insert
             binFP = inFingerprint;
             inBucket->fingerprints[ i ] = inFingerprint;
+            inBucket->tags[ i ] = inTag;
                 
             // will go at end of file
-            inBucket->fileIndex[ i ] = inDB->numRecords;
+            setFileIndex( inBucket, i, inDB->numRecords );
                 
+            if( storeRAMKey( inDB, inDB->numRecords, inKey ) != 0 ||
+                indexSpatialKey( inDB, inDB->numRecords, inKey ) != 0 ) {
+                return -1;
+            }
 
             inDB->numRecords++;
 
@@ -1050,6 +4406,15 @@ static int LINEARDB3_considerFingerprintBucket(
         }
     }
 
+    if( binFP == inFingerprint && ! emptyRec && 
+        inBucket->tags[ i ] != inTag && ! inIgnoreDataFile ) {
+        // same fingerprint, different key, and we know it without
+        // reading the key from disk
+        // 指纹相同但标签不同, 无需读盘即可排除
+        inDB->numTagRejects.fetch_add( 1, std::memory_order_relaxed );
+        return 2;
+    }
+
     if( binFP == inFingerprint ) { // 指纹匹配
         // hit
 
@@ -1063,22 +4428,103 @@ static int LINEARDB3_considerFingerprintBucket(
         // 文件偏移量(字节) = 文件头大小 + 文件索引 * 记录大小
         // [MARK] (uint64_t)inBucket->fileIndex[i] * (uint64_t)inDB->recordSizeBytes;
         uint64_t filePosRec = 
-            LINEARDB3_HEADER_SIZE + (uint64_t)inBucket->fileIndex[ i ] * (uint64_t)inDB->recordSizeBytes;
+            LINEARDB3_HEADER_SIZE + (uint64_t)getFileIndex( inBucket, i ) * (uint64_t)inDB->recordSizeBytes;
+            
+        const uint8_t *record = NULL;
+        
+        if( !emptyRec ) {
+            record = getRecordInRAM( inDB, getFileIndex( inBucket, i ) );
+        }
+        
+        if( record != NULL ) {
+            // whole file in RAM, compare straight against it
+            // no seeking, no recordBuffer, so read-only gets are
+            // safe to do from many threads
+            // 记录在内存中, 直接比较, 无需读盘
+            if( ! keyComp( inDB->keySize, record, inKey ) ) {
+                STAT( inDB, numKeyMismatches );
+                return 2;
+            }
+            
+            if( inPut ) {
+                // in-memory mode, puts are refused in read-only mode
+                return putInMemory( inDB, getFileIndex( inBucket, i ),
+                                    inKey, inOutValue, true );
+            }
+
+            memcpy( inOutValue, &( record[ inDB->keySize ] ), 
+                    inDB->valueSize );
+            return 0;
+        }
+        
+        if( !emptyRec && inDB->ramKeys != NULL &&
+            ! ramKeyMatches( inDB, getFileIndex( inBucket, i ), inKey ) ) {
+            // ruled out from RAM copy of key, no disk read
+            // 内存中的key不匹配, 无需读盘
+            STAT( inDB, numKeyMismatches );
+            return 2;
+        }
+        
+        if( !emptyRec && inDB->recordCache != NULL ) {
+            const uint8_t *cached = 
+                getCachedRecord( inDB, getFileIndex( inBucket, i ) );
+            
+            if( cached != NULL ) {
+                // hot record, no disk read
+                // 缓存命中
+                if( ! keyComp( inDB->keySize, cached, inKey ) ) {
+                    STAT( inDB, numKeyMismatches );
+                    return 2;
+                }
+                
+                if( inPut ) {
+                    if( putRecord( inDB, getFileIndex( inBucket, i ),
+                                   inKey, inOutValue, true ) != 0 ) {
+                        return -1;
+                    }
+                    cacheRecord( inDB, getFileIndex( inBucket, i ),
+                                 inKey, inOutValue );
+                    return 0;
+                }
+                
+                memcpy( inOutValue, &( cached[ inDB->keySize ] ),
+                        inDB->valueSize );
+                return 0;
+            }
+        }
+        
+        // with full keys in RAM, a match there is final, no need to
+        // read key back (digests still need checking against file)
+        char keyRead = false;
+
+        // a get that's going to fill the cache reads value along with key
+        char valueRead = false;
+
+        if( !emptyRec && 
+            ( inDB->ramKeys == NULL || inDB->ramKeysAreDigests ) ) { // 桶内记录非空 (检查key是否匹配, 哈希匹配不代表完全一致)
             
-        if( !emptyRec ) { // 桶内记录非空 (检查key是否匹配, 哈希匹配不代表完全一致)
+            keyRead = true;
             
             // read key to make sure it actually matches
             // 即使指纹匹配, 也要拿到原始key做比较
-            
-            // never seek unless we have to 非必要不做fseek (off_t 是 int64_t)
-            if( inDB->lastOp == opWrite || ftello( inDB->file ) != (off_t)filePosRec ) {
 
-                if( fseeko( inDB->file, filePosRec, SEEK_SET ) ) {
-                    return -1;
-                }
+            // pending group of puts might include this record
+            if( commitWALBatch( inDB ) != 0 ) {
+                return -1;
+            }
+            
+            // never seek unless we have to 非必要不做fseek
+            if( seekDataFile( inDB, filePosRec, opRead ) != 0 ) {
+                return -1;
             }
             
-            int numRead = fread( inDB->recordBuffer, inDB->keySize, 1, inDB->file );
+            valueRead = ! inPut && inDB->recordCache != NULL;
+            
+            int numRead = fread( inDB->recordBuffer, 
+                                 valueRead ? inDB->recordSizeBytes 
+                                           : inDB->keySize, 
+                                 1, inDB->file );
+            STAT( inDB, numReads );
             inDB->lastOp = opRead;
     
             if( numRead != 1 ) {
@@ -1087,63 +4533,67 @@ static int LINEARDB3_considerFingerprintBucket(
             if( ! keyComp( inDB->keySize, inDB->recordBuffer, inKey ) ) {
                 // false match on non-empty rec because of fingerprint collision
                 // 指纹相同但是key不同, 是哈希碰撞
+                // (wasted disk read)
+                inDB->numFalsePositives.fetch_add( 1, 
+                                                   std::memory_order_relaxed );
+                STAT( inDB, numKeyMismatches );
                 return 2;
             }
         }
 
             
         if( inPut ) { // 写入操作
-            if( emptyRec ) {
-
-                // don't seek unless we have to. if we're doing a series of fresh inserts,
-                // the file pos is already waiting at the end of the file for us
-                // 如果当前是连续的插入, 那么指针位置是正好的
-                if( inDB->lastOp == opRead || ftello( inDB->file ) != (off_t)filePosRec ) {
-                    
-                    // no seeking done yet, go to end of file
-                    if( fseeko( inDB->file, 0, SEEK_END ) ) {
-                        return -1;
-                    }
-                    // make sure it matches where we've documented that the record should go
-                    if( ftello( inDB->file ) != (off_t)filePosRec ) {
-                        return -1;
-                    }
-                }
-                
-                // 写入key
-                int numWritten = fwrite( inKey, inDB->keySize, 1, inDB->file );
-                inDB->lastOp = opWrite;
-                
-                if( numWritten != 1 ) {
-                    return -1;
-                }
+            // empty rec gets whole record appended at end of file,
+            // else we already read key of non-empty record, only value changes
+            // 空槽追加整条记录, 否则只覆盖value
+            if( putRecord( inDB, getFileIndex( inBucket, i ), 
+                           inKey, inOutValue, !emptyRec ) != 0 ) {
+                return -1;
             }
             
-            // else already seeked and read key of non-empty record ready to write value
-
-            // still need to seek here after reading before writing according to fopen docs
-            fseeko( inDB->file, 0, SEEK_CUR );
-            
-            // 写入value
-            int numWritten = fwrite( inOutValue, inDB->valueSize, 1, inDB->file );
-            inDB->lastOp = opWrite;
-    
-            if( numWritten != 1 ) {
-                return -1;
+            if( !emptyRec && inDB->recordCache != NULL ) {
+                cacheRecord( inDB, getFileIndex( inBucket, i ),
+                             inKey, inOutValue );
             }
             
             // successful put    
             return 0;
         }
         else { // 读取操作
-            // we don't need to seek here, we know (!emptyRec), 
-            // so we already seeked and read the key above, ready to read value now
+            // we don't need to seek here if we already seeked and read the 
+            // key above, ready to read value now
             // 因为我们已经读取了key, 所以可以继续读取value
-            int numRead = fread( inOutValue, inDB->valueSize, 1, inDB->file );
-            inDB->lastOp = opRead;
+            if( ! keyRead ) {
+                // key matched in RAM, go straight to value
+                if( commitWALBatch( inDB ) != 0 ) {
+                    return -1;
+                }
+                
+                uint64_t filePosValue = filePosRec + inDB->keySize;
+
+                if( seekDataFile( inDB, filePosValue, opRead ) != 0 ) {
+                    return -1;
+                }
+            }
+
+            if( valueRead ) {
+                memcpy( inOutValue, &( inDB->recordBuffer[ inDB->keySize ] ),
+                        inDB->valueSize );
+            }
+            else {
+                int numRead = fread( inOutValue, inDB->valueSize, 1, 
+                                     inDB->file );
+                STAT( inDB, numReads );
+                inDB->lastOp = opRead;
+                
+                if( numRead != 1 ) {
+                    return -1;
+                }
+            }
             
-            if( numRead != 1 ) {
-                return -1;
+            if( inDB->recordCache != NULL ) {
+                cacheRecord( inDB, getFileIndex( inBucket, i ),
+                             inKey, inOutValue );
             }
             return 0;
         }
@@ -1155,6 +4605,21 @@ static int LINEARDB3_considerFingerprintBucket(
 
 
 
+// what lookups cost over the current window, for LINEARDB3_setAdaptiveLoad
+struct LINEARDB3_AdaptiveLoad {
+    uint64_t ramBudget;
+    double targetBuckets;
+    
+    // gets and puts, and overflow buckets they walked to
+    uint64_t numLookups;
+    uint64_t numOverflowWalks;
+    
+    // overflow buckets in use when window started
+    uint32_t startOverflowBuckets;
+};
+
+
+
 
 // 获取或写入
 int LINEARDB3_getOrPut( 
@@ -1166,8 +4631,9 @@ int LINEARDB3_getOrPut(
 ) {
 
     uint32_t fingerprint;
+    uint8_t tag;
 
-    uint64_t binNumber = getBinNumber( inDB, inKey, &fingerprint );
+    uint64_t binNumber = getBinNumber( inDB, inKey, &fingerprint, &tag );
 
     
     unsigned int overflowDepth = 0;
@@ -1186,7 +4652,7 @@ int LINEARDB3_getOrPut(
 
         int result = LINEARDB3_considerFingerprintBucket(
             inDB, inKey, inOutValue,
-            fingerprint,
+            fingerprint, tag,
             inPut, inIgnoreDataFile,
             thisBucket, 
             i );
@@ -1205,7 +4671,8 @@ int LINEARDB3_getOrPut(
         // consider overflow
         overflowDepth++;
 
-        if( overflowDepth > inDB->maxOverflowDepth ) {
+        // shared by concurrent lookups when read-only, leave it alone
+        if( overflowDepth > inDB->maxOverflowDepth && ! inDB->readOnly ) {
             inDB->maxOverflowDepth = overflowDepth;
         }
         
@@ -1213,13 +4680,18 @@ int LINEARDB3_getOrPut(
         thisBucketIndex = thisBucket->overflowIndex;
         
         thisBucket = getBucket( inDB->overflowBuckets, thisBucketIndex );
+        STAT( inDB, numOverflowWalks );
+
+        if( inDB->adaptiveLoad != NULL ) {
+            inDB->adaptiveLoad->numOverflowWalks++;
+        }
 
         if( !skipToOverflow || thisBucket->overflowIndex == 0 )
         for( int i=0; i<RECORDS_PER_BUCKET; i++ ) {
 
             int result = LINEARDB3_considerFingerprintBucket(
                 inDB, inKey, inOutValue,
-                fingerprint,
+                fingerprint, tag,
                 inPut, inIgnoreDataFile,
                 thisBucket, 
                 i );
@@ -1233,91 +4705,295 @@ int LINEARDB3_getOrPut(
     }
 
     
-    if( inPut && thisBucket->overflowIndex == 0 ) {
+    if( inPut && thisBucket->overflowIndex == 0 ) {
+
+        // reached end of overflow chain without finding place to put value
+        // need to make a new overflow bucket
+        // 走完溢出链也没找到插入的位置, 需要创建一个溢出桶
+
+        overflowDepth++;
+
+        if( overflowDepth > inDB->maxOverflowDepth ) {
+            inDB->maxOverflowDepth = overflowDepth;
+        }
+        
+
+        thisBucket->overflowIndex = 
+            getFirstEmptyBucketIndex( inDB->overflowBuckets );
+
+        FingerprintBucket *newBucket = 
+            getBucket( inDB->overflowBuckets, thisBucket->overflowIndex );
+        newBucket->fingerprints[0] = fingerprint;
+        newBucket->tags[0] = tag;
+
+        // will go at end of file
+        setFileIndex( newBucket, 0, inDB->numRecords );
+        
+        if( storeRAMKey( inDB, inDB->numRecords, inKey ) != 0 ||
+            indexSpatialKey( inDB, inDB->numRecords, inKey ) != 0 ) {
+            return -1;
+        }
+        
+        inDB->numRecords++;
+        
+        if( ! inIgnoreDataFile ) {
+            // 写入key与value
+            return putRecord( inDB, getFileIndex( newBucket, 0 ), 
+                              inKey, inOutValue, false );
+        }
+        
+
+        return 0;
+    }
+
+
+
+    // not found
+    return 1;
+}
+
+
+
+struct LINEARDB3_Trace {
+        FILE *file;
+
+        // read-only gets may be logged from many threads at once
+        std::mutex lock;
+
+        std::chrono::steady_clock::time_point start;
+        
+        // op, time, and key, built here then written in one go
+        uint8_t *entry;
+
+        // a write failed, rest of capture is dropped
+        char failed;
+    };
+
+
+
+int LINEARDB3_setTraceFile( LINEARDB3 *inDB, const char *inPath ) {
+    int result = 0;
+    
+    if( inDB->trace != NULL ) {
+        LINEARDB3_Trace *t = inDB->trace;
+        
+        if( fclose( t->file ) != 0 || t->failed ) {
+            result = -1;
+        }
+        delete [] t->entry;
+        delete t;
+        inDB->trace = NULL;
+    }
+
+    if( inPath == NULL ) {
+        return result;
+    }
+    
+    FILE *file = fopen( inPath, "wb" );
+    
+    if( file == NULL ) {
+        return -1;
+    }
+    
+    uint32_t val32[2] = { inDB->keySize, inDB->valueSize };
+    
+    if( fwrite( "Lt1", 3, 1, file ) != 1 ||
+        fwrite( val32, sizeof( val32 ), 1, file ) != 1 ) {
+        fclose( file );
+        return -1;
+    }
+    
+    LINEARDB3_Trace *t = new LINEARDB3_Trace;
+    t->file = file;
+    t->start = std::chrono::steady_clock::now();
+    t->entry = new uint8_t[ 1 + sizeof( uint64_t ) + inDB->keySize ];
+    t->failed = false;
+    
+    inDB->trace = t;
+    
+    return result;
+}
+
+
+
+// appends one entry to trace, inKey NULL for iterator ops
+static void traceOp( LINEARDB3 *inDB, LINEARDB3_TraceOp inOp, 
+                     const void *inKey ) {
+    LINEARDB3_Trace *t = inDB->trace;
+    
+    std::lock_guard<std::mutex> guard( t->lock );
+    
+    if( t->failed ) {
+        return;
+    }
+    
+    uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>( 
+        std::chrono::steady_clock::now() - t->start ).count();
+
+    unsigned int size = 1 + sizeof( uint64_t );
+    
+    t->entry[0] = (uint8_t)inOp;
+    memcpy( &( t->entry[1] ), &nanos, sizeof( uint64_t ) );
 
-        // reached end of overflow chain without finding place to put value
-        // need to make a new overflow bucket
-        // 走完溢出链也没找到插入的位置, 需要创建一个溢出桶
+    if( inKey != NULL ) {
+        memcpy( &( t->entry[ size ] ), inKey, inDB->keySize );
+        size += inDB->keySize;
+    }
+    
+    if( fwrite( t->entry, size, 1, t->file ) != 1 ) {
+        t->failed = true;
+    }
+}
 
-        overflowDepth++;
 
-        if( overflowDepth > inDB->maxOverflowDepth ) {
-            inDB->maxOverflowDepth = overflowDepth;
-        }
-        
 
-        thisBucket->overflowIndex = 
-            getFirstEmptyBucketIndex( inDB->overflowBuckets );
+// one maxLoad step, as a factor 每次调整的比例
+#define ADAPTIVE_LOAD_STEP 0.9
 
-        FingerprintBucket *newBucket = 
-            getBucket( inDB->overflowBuckets, thisBucket->overflowIndex );
-        newBucket->fingerprints[0] = fingerprint;
 
-        // will go at end of file
-        newBucket->fileIndex[0] = inDB->numRecords;
+// end of a LINEARDB3_setAdaptiveLoad window: moves maxLoad one step,
+// if lookups cost too much or too little for the RAM they're using,
+// and starts next window
+static void adjustAdaptiveLoad( LINEARDB3 *inDB ) {
+    LINEARDB3_AdaptiveLoad *a = inDB->adaptiveLoad;
+    
+    double bucketsPerLookup = 
+        1.0 + (double)a->numOverflowWalks / (double)a->numLookups;
+    
+    // overflow chains getting longer: more overflow buckets in use than
+    // this window started with, and more per table bucket than the 
+    // target allows for
+    uint32_t overflowBuckets = inDB->overflowBuckets->numBuckets;
+    
+    char overflowGrowing = 
+        overflowBuckets > a->startOverflowBuckets &&
+        (double)overflowBuckets / inDB->hashTableSizeB > 
+            a->targetBuckets - 1;
+    
+    uint64_t ram = LINEARDB3_getRAMUsage( inDB );
+    
+    double raisedLoad = inDB->maxLoad / ADAPTIVE_LOAD_STEP;
+    if( raisedLoad > LINEARDB3_ADAPTIVE_LOAD_MAX ) {
+        raisedLoad = LINEARDB3_ADAPTIVE_LOAD_MAX;
+    }
+    
+    double loweredLoad = inDB->maxLoad * ADAPTIVE_LOAD_STEP;
+    if( loweredLoad < LINEARDB3_ADAPTIVE_LOAD_MIN ) {
+        loweredLoad = LINEARDB3_ADAPTIVE_LOAD_MIN;
+    }
+    
+    if( ram > a->ramBudget ) {
+        // over budget, hold off expanding, and give back what the
+        // table doesn't need at the new load 超出预算
+        inDB->maxLoad = raisedLoad;
+        LINEARDB3_contract( inDB );
+    }
+    else if( bucketsPerLookup > a->targetBuckets || overflowGrowing ) {
+        // too slow, expand if the bigger table fits 太慢
+        double tableBuckets = 
+            ceil( inDB->numRecords / ( loweredLoad * RECORDS_PER_BUCKET ) );
         
+        double extraRAM = 0;
         
-        inDB->numRecords++;
+        if( tableBuckets > inDB->hashTableSizeB ) {
+            extraRAM = ( tableBuckets - inDB->hashTableSizeB ) * 
+                sizeof( FingerprintBucket );
+        }
         
-        if( ! inIgnoreDataFile ) {
-
-            // [MARK]
-            uint64_t filePosRec = 
-                LINEARDB3_HEADER_SIZE + (uint64_t)newBucket->fileIndex[0] * (uint64_t)inDB->recordSizeBytes;
+        if( (double)ram + extraRAM <= (double)a->ramBudget ) {
+            inDB->maxLoad = loweredLoad;
+        }
+    }
+    else if( bucketsPerLookup - 1 < ( a->targetBuckets - 1 ) / 4 ) {
+        // well under target, let table fill up more before expanding
+        inDB->maxLoad = raisedLoad;
+    }
+    
+    a->numLookups = 0;
+    a->numOverflowWalks = 0;
+    a->startOverflowBuckets = overflowBuckets;
+}
 
-            // don't seek unless we have to
-            if( inDB->lastOp == opRead || ftello( inDB->file ) != (off_t)filePosRec ) {
-            
-                // go to end of file
-                if( fseeko( inDB->file, 0, SEEK_END ) ) {
-                    return -1;
-                }
 
-                // make sure it matches where we've documented that the record should go
-                if( ftello( inDB->file ) != (off_t)filePosRec ) {
-                    return -1;
-                }
-            }
-            
-            // 写入key与value
-            int numWritten = fwrite( inKey, inDB->keySize, 1, inDB->file );
-            inDB->lastOp = opWrite;
 
-            numWritten += fwrite( inOutValue, inDB->valueSize, 1, inDB->file );
-                
-            if( numWritten != 2 ) {
-                return -1;
-            }
-            return 0;
-        }
-        
+// most records inDB's table can hold: record numbers run out at
+// LINEARDB3_MAX_RECORDS, and LINEARDB3_MAX_BUCKETS buckets fill up to 
+// maxLoad 最大记录数
+static uint64_t getRecordCapacity( LINEARDB3 *inDB ) {
+    double bucketCapacity = 
+        (double)LINEARDB3_MAX_BUCKETS * RECORDS_PER_BUCKET * inDB->maxLoad;
 
-        return 0;
+    if( bucketCapacity < (double)LINEARDB3_MAX_RECORDS ) {
+        return (uint64_t)bucketCapacity;
     }
+    return LINEARDB3_MAX_RECORDS;
+}
 
 
 
-    // not found
-    return 1;
+// 1 if inKey has a record already
+static char isKeyPresent( LINEARDB3 *inDB, const void *inKey ) {
+    uint8_t *value = new uint8_t[ inDB->valueSize ];
+    
+    int result = LINEARDB3_getOrPut( inDB, inKey, value, false, false );
+
+    delete [] value;
+    return result == 0;
 }
 
 
 
 int LINEARDB3_get( LINEARDB3 *inDB, const void *inKey, void *outValue ) {
+    STAT( inDB, numGets );
+
+    if( inDB->trace != NULL ) {
+        traceOp( inDB, traceGet, inKey );
+    }
+
+    if( inDB->archiveOffsets != NULL ) {
+        return getFromArchive( inDB, inKey, outValue );
+    }
+
+    if( inDB->adaptiveLoad != NULL ) {
+        inDB->adaptiveLoad->numLookups++;
+    }
     return LINEARDB3_getOrPut( inDB, inKey, outValue, false, false );
 }
 
 
 
 int LINEARDB3_put( LINEARDB3 *inDB, const void *inKey, const void *inValue ) {
+    if( inDB->readOnly ) {
+        return -1;
+    }
+
+    if( inDB->numRecords + (uint64_t)1 >= getRecordCapacity( inDB ) &&
+        ! isKeyPresent( inDB, inKey ) ) {
+        // full, only overwrites of keys already there still fit
+        // 表已满, 只允许覆盖已有key (see LINEARDB3_WIDE_INDEX)
+        return -1;
+    }
+
+    STAT( inDB, numPuts );
+
+    if( inDB->trace != NULL ) {
+        traceOp( inDB, tracePut, inKey );
+    }
+    
     int result = LINEARDB3_getOrPut( inDB, inKey, (void *)inValue, true, false );
 
     if( result == -1 ) {
         return result;
     }
 
+    if( inDB->adaptiveLoad != NULL &&
+        ++( inDB->adaptiveLoad->numLookups ) >= 
+            LINEARDB3_ADAPTIVE_LOAD_WINDOW ) {
+        adjustAdaptiveLoad( inDB );
+    }
+
     // 每次插入检查负载, 超出则立刻扩容
-    if( inDB->numRecords > ( inDB->hashTableSizeB * RECORDS_PER_BUCKET ) * inDB->maxLoad ) {
+    if( inDB->numRecords > ( (double)inDB->hashTableSizeB * RECORDS_PER_BUCKET ) * inDB->maxLoad ) {
         result = expandTable( inDB );
     }
     return result;
@@ -1325,7 +5001,152 @@ int LINEARDB3_put( LINEARDB3 *inDB, const void *inKey, const void *inValue ) {
 
 
 
+int LINEARDB3_sync( LINEARDB3 *inDB ) {
+    if( inDB->memWriter != NULL ) {
+        // writer commits its own batches
+        return waitForMemWriter( inDB );
+    }
+    return commitWALBatch( inDB );
+}
+
+
+
+// reports every record in chain starting at inHead
+// returns number reported, -1 on I/O error, and sets *outStop if 
+// callback asked to stop
+static int64_t reportSpatialChain( LINEARDB3 *inDB, 
+                                   LINEARDB3_RecordIndex inHead,
+                                   LINEARDB3_RangeCallback inCallback,
+                                   void *inContext,
+                                   char *outStop ) {
+    int64_t count = 0;
+    
+    for( LINEARDB3_RecordIndex r = inHead; r != NO_RECORD; 
+         r = inDB->spatialIndex->next[ r ] ) {
+        
+        const uint8_t *record = getRecordInRAM( inDB, r );
+        
+        if( record == NULL ) {
+            // pending group of puts might include this record
+            if( commitWALBatch( inDB ) != 0 ) {
+                return -1;
+            }
+            
+            uint64_t filePosRec = 
+                LINEARDB3_HEADER_SIZE + (uint64_t)r * inDB->recordSizeBytes;
+            
+            if( seekDataFile( inDB, filePosRec, opRead ) != 0 ) {
+                return -1;
+            }
+            
+            int numRead = fread( inDB->recordBuffer, 
+                                 inDB->recordSizeBytes, 1, inDB->file );
+            STAT( inDB, numReads );
+            inDB->lastOp = opRead;
+            
+            if( numRead != 1 ) {
+                return -1;
+            }
+            record = inDB->recordBuffer;
+        }
+        
+        count++;
+        
+        if( inCallback( record, &( record[ inDB->keySize ] ), r, 
+                        inContext ) != 0 ) {
+            *outStop = true;
+            break;
+        }
+    }
+    return count;
+}
+
+
+
+int64_t LINEARDB3_getRange( LINEARDB3 *inDB, 
+                            int32_t inMinX, int32_t inMinY,
+                            int32_t inMaxX, int32_t inMaxY,
+                            LINEARDB3_RangeCallback inCallback,
+                            void *inContext ) {
+    LINEARDB3_SpatialIndex *index = inDB->spatialIndex;
+    
+    if( index == NULL ) {
+        return -1;
+    }
+    
+    if( inMinX > inMaxX || inMinY > inMaxY ) {
+        return 0;
+    }
+    
+    int64_t total = 0;
+    char stop = false;
+    
+    uint64_t area = 
+        (uint64_t)( (int64_t)inMaxX - inMinX + 1 ) *
+        (uint64_t)( (int64_t)inMaxY - inMinY + 1 );
+    
+    if( area <= index->numPrefixes ) {
+        // small rectangle, look up each tile in it
+        // 小矩形: 逐个地块查找
+        for( int64_t y = inMinY; y <= inMaxY && !stop; y++ ) {
+            for( int64_t x = inMinX; x <= inMaxX && !stop; x++ ) {
+                int32_t xy[2] = { (int32_t)x, (int32_t)y };
+                
+                uint64_t pos = findSpatialPrefix( index, 
+                                                  getSpatialPrefix( xy ) );
+                
+                if( index->heads[ pos ] == NO_RECORD ) {
+                    continue;
+                }
+                
+                int64_t count = 
+                    reportSpatialChain( inDB, index->heads[ pos ], 
+                                        inCallback, inContext, &stop );
+                if( count < 0 ) {
+                    return -1;
+                }
+                total += count;
+            }
+        }
+        return total;
+    }
+    
+    
+    // rectangle covers more tiles than the whole index holds, 
+    // walk index instead
+    // 大矩形: 遍历索引
+    for( uint64_t pos = 0; pos < index->tableSize && !stop; pos++ ) {
+        if( index->heads[ pos ] == NO_RECORD ) {
+            continue;
+        }
+        
+        int32_t xy[2];
+        memcpy( xy, &( index->prefixes[ pos ] ), sizeof( uint64_t ) );
+        
+        if( xy[0] < inMinX || xy[0] > inMaxX ||
+            xy[1] < inMinY || xy[1] > inMaxY ) {
+            continue;
+        }
+        
+        int64_t count = 
+            reportSpatialChain( inDB, index->heads[ pos ], 
+                                inCallback, inContext, &stop );
+        if( count < 0 ) {
+            return -1;
+        }
+        total += count;
+    }
+    
+    return total;
+}
+
+
+
 void LINEARDB3_Iterator_init( LINEARDB3 *inDB, LINEARDB3_Iterator *inDBi ) {
+    if( inDB->trace != NULL ) {
+        traceOp( inDB, traceIteratorInit, NULL );
+    }
+
     inDBi->db = inDB;
     inDBi->nextRecordIndex = 0;
 }
@@ -1335,6 +5156,10 @@ void LINEARDB3_Iterator_init( LINEARDB3 *inDB, LINEARDB3_Iterator *inDBi ) {
 
 int LINEARDB3_Iterator_next( LINEARDB3_Iterator *inDBi, void *outKey, void *outValue ) {
     LINEARDB3 *db = inDBi->db;
+
+    if( db->trace != NULL ) {
+        traceOp( db, traceIteratorNext, NULL );
+    }
     
     while( true ) {        
         
@@ -1342,24 +5167,36 @@ int LINEARDB3_Iterator_next( LINEARDB3_Iterator *inDBi, void *outKey, void *outV
             return 0;
         }
 
+        const uint8_t *record = getRecordInRAM( db, inDBi->nextRecordIndex );
+
+        if( record != NULL ) {
+
+            memcpy( outKey, record, db->keySize );
+            memcpy( outValue, &( record[ db->keySize ] ), db->valueSize );
+
+            inDBi->nextRecordIndex++;
+            return 1;
+        }
+
+        // pending group of puts might include this record
+        if( commitWALBatch( db ) != 0 ) {
+            return -1;
+        }
+
         // fseek is needed here to make iterator safe to interleave with other calls
         
         // BUT, don't seek unless we have to
-        // even seeking to current location has a performance hit
         // [MARK]
         uint64_t filePosRec = 
             LINEARDB3_HEADER_SIZE + (uint64_t)inDBi->nextRecordIndex * (uint64_t)db->recordSizeBytes;
         
-
-        if( db->lastOp == opWrite || ftello( db->file ) != (off_t)filePosRec ) {
-    
-            if( fseeko( db->file, filePosRec, SEEK_SET ) ) {
-                return -1;
-            }
+        if( seekDataFile( db, filePosRec, opRead ) != 0 ) {
+            return -1;
         }
         
 
         int numRead = fread( outKey, db->keySize, 1, db->file );
+        STAT( db, numReads );
         db->lastOp = opRead;
         
         if( numRead != 1 ) {
@@ -1367,6 +5204,7 @@ int LINEARDB3_Iterator_next( LINEARDB3_Iterator *inDBi, void *outKey, void *outV
         }
         
         numRead = fread( outValue, db->valueSize, 1, db->file );
+        STAT( db, numReads );
         if( numRead != 1 ) {
             return -1;
         }
@@ -1385,14 +5223,200 @@ unsigned int LINEARDB3_getCurrentSize( LINEARDB3 *inDB ) {
 
 
 
-unsigned int LINEARDB3_getNumRecords( LINEARDB3 *inDB ) {
+LINEARDB3_RecordIndex LINEARDB3_getNumRecords( LINEARDB3 *inDB ) {
     return inDB->numRecords;
 }
 
 
 
+static uint64_t getPageManagerRAM( PageManager *inPM ) {
+    return (uint64_t)inPM->numPages * sizeof( BucketPage ) +
+        (uint64_t)inPM->pageAreaSize * sizeof( BucketPage * );
+}
+
+
+
+uint64_t LINEARDB3_getRAMUsage( LINEARDB3 *inDB ) {
+    uint64_t total = 
+        getPageManagerRAM( inDB->hashTable ) +
+        getPageManagerRAM( inDB->overflowBuckets );
+    
+    if( inDB->indexSpill != NULL ) {
+        // OS pages those in and out as it likes
+        total -= inDB->indexSpill->numSpilledPages * sizeof( BucketPage );
+    }
+    
+    if( inDB->ramKeys != NULL ) {
+        total += inDB->ramKeysCapacity * inDB->ramKeySize;
+    }
+
+    if( inDB->memRecords != NULL ) {
+        total += inDB->memRecordsCapacity * inDB->recordSizeBytes;
+    }
+
+    if( inDB->spatialIndex != NULL ) {
+        total += inDB->spatialIndex->tableSize * 
+            ( sizeof( uint64_t ) + sizeof( LINEARDB3_RecordIndex ) ) +
+            inDB->spatialIndex->nextCapacity * sizeof( LINEARDB3_RecordIndex );
+    }
+
+    total += inDB->archiveIndexFileSize;
+
+    if( inDB->recordCache != NULL ) {
+        total += (uint64_t)inDB->recordCache->numSlots * 
+            ( inDB->recordSizeBytes + sizeof( uint64_t ) + 1 +
+              2 * sizeof( uint32_t ) );
+    }
+    
+    return total;
+}
+
+
+
+uint64_t LINEARDB3_getNumFalsePositives( LINEARDB3 *inDB ) {
+    return inDB->numFalsePositives.load( std::memory_order_relaxed );
+}
+
+
+
+uint64_t LINEARDB3_getNumTagRejects( LINEARDB3 *inDB ) {
+    return inDB->numTagRejects.load( std::memory_order_relaxed );
+}
+
+
+
+void LINEARDB3_getStats( LINEARDB3 *inDB, LINEARDB3_Stats *outStats ) {
+#ifdef LINEARDB3_STATS
+    uint64_t *fields = (uint64_t *)outStats;
+    
+    for( unsigned int i=0; i<LINEARDB3_NUM_STATS; i++ ) {
+        fields[i] = inDB->stats[i].load( std::memory_order_relaxed );
+    }
+#else
+    memset( outStats, 0, sizeof( LINEARDB3_Stats ) );
+#endif
+
+    // always kept 始终统计
+    outStats->numFalsePositives = LINEARDB3_getNumFalsePositives( inDB );
+    outStats->numTagRejects = LINEARDB3_getNumTagRejects( inDB );
+
+    // what's there now, plus what was given back
+    outStats->numPageAllocs = inDB->numPagesReleased;
+    
+    if( inDB->hashTable != NULL ) {
+        outStats->numPageAllocs += inDB->hashTable->numPages;
+    }
+    if( inDB->overflowBuckets != NULL ) {
+        outStats->numPageAllocs += inDB->overflowBuckets->numPages;
+    }
+}
+
+
+
+int LINEARDB3_setCacheSize( LINEARDB3 *inDB, uint64_t inBytes ) {
+    freeRecordCache( inDB );
+    
+    if( inDB->readOnly || inDB->memRecords != NULL ) {
+        // every record already in RAM
+        return 0;
+    }
+    
+    // slot, its record number and reference bit, and two index entries
+    uint64_t slotBytes = 
+        inDB->recordSizeBytes + sizeof( uint64_t ) + 1 + 
+        2 * sizeof( uint32_t );
+    
+    uint64_t numSlots = inBytes / slotBytes;
+    
+    if( numSlots == 0 ) {
+        return 0;
+    }
+    if( numSlots > ( 1 << 30 ) ) {
+        numSlots = 1 << 30;
+    }
+    
+    // power of two, at least twice slots, keeps probe runs short
+    uint32_t indexSize = 2;
+    while( indexSize < 2 * numSlots ) {
+        indexSize *= 2;
+    }
+    
+    LINEARDB3_RecordCache *c = new LINEARDB3_RecordCache;
+    
+    c->numSlots = (uint32_t)numSlots;
+    c->numSlotsUsed = 0;
+    c->clockHand = 0;
+    c->slotFileIndex = (uint64_t *)malloc( numSlots * sizeof( uint64_t ) );
+    c->slotReferenced = (uint8_t *)malloc( numSlots );
+    c->slotRecords = (uint8_t *)malloc( numSlots * inDB->recordSizeBytes );
+    c->index = (uint32_t *)calloc( indexSize, sizeof( uint32_t ) );
+    c->indexMask = indexSize - 1;
+    c->hits = 0;
+    c->misses = 0;
+    
+    inDB->recordCache = c;
+    
+    if( c->slotFileIndex == NULL || c->slotReferenced == NULL ||
+        c->slotRecords == NULL || c->index == NULL ) {
+        freeRecordCache( inDB );
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+
+uint64_t LINEARDB3_getCacheHits( LINEARDB3 *inDB ) {
+    if( inDB->recordCache == NULL ) {
+        return 0;
+    }
+    return inDB->recordCache->hits;
+}
+
+
+
+int LINEARDB3_setAdaptiveLoad( LINEARDB3 *inDB, uint64_t inRAMBudgetBytes,
+                               double inTargetBuckets ) {
+    if( inRAMBudgetBytes == 0 ) {
+        delete inDB->adaptiveLoad;
+        inDB->adaptiveLoad = NULL;
+        return 0;
+    }
+    
+    if( inDB->readOnly || ! ( inTargetBuckets > 1 ) ) {
+        return -1;
+    }
+    
+    if( inDB->adaptiveLoad == NULL ) {
+        inDB->adaptiveLoad = new LINEARDB3_AdaptiveLoad;
+    }
+    
+    LINEARDB3_AdaptiveLoad *a = inDB->adaptiveLoad;
+    
+    a->ramBudget = inRAMBudgetBytes;
+    a->targetBuckets = inTargetBuckets;
+    a->numLookups = 0;
+    a->numOverflowWalks = 0;
+    a->startOverflowBuckets = inDB->overflowBuckets->numBuckets;
+    
+    return 0;
+}
+
+
+
+uint64_t LINEARDB3_getCacheMisses( LINEARDB3 *inDB ) {
+    if( inDB->recordCache == NULL ) {
+        return 0;
+    }
+    return inDB->recordCache->misses;
+}
+
+
+
 
-unsigned int LINEARDB3_getShrinkSize( LINEARDB3 *inDB, unsigned int inNewNumRecords ) {
+unsigned int LINEARDB3_getShrinkSize( LINEARDB3 *inDB, 
+                                      LINEARDB3_RecordIndex inNewNumRecords ) {
 
     // perfect size to insert this many with no table expansion
     
@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 
+#include <atomic>
+
 
 // larger values here reduce RAM overhead per record slightly
 // and may speed up lookup in over-full tables, but might slow
@@ -11,6 +13,31 @@
 #define LINEARDB3_RECORDS_PER_BUCKET 8
 
 
+// Define LINEARDB3_WIDE_INDEX to hold more than 2^32 records in one table.
+// This only changes the RAM index, the file format has no record numbers in it.
+// Record numbers become 40 bits (one extra byte per fileIndex slot,
+// 8 bytes per bucket), and record counts become 64-bit.
+// 宽索引: 40位记录编号, 64位记录数
+//
+// Bucket numbers and fingerprints stay 32-bit, so a table has at most
+// LINEARDB3_MAX_BUCKETS buckets, which hold LINEARDB3_MAX_BUCKETS * 8 *
+// maxLoad records, about 2^33 at maxLoad 0.5, well short of 2^40.  Open
+// and put refuse to go past that.  Near the top, fingerprints have only
+// one bit beyond the bin number, and tags do most of the work of telling
+// keys in a bucket apart.
+#ifdef LINEARDB3_WIDE_INDEX
+typedef uint64_t LINEARDB3_RecordIndex;
+#define LINEARDB3_MAX_RECORDS ( (uint64_t)1 << 40 )
+#else
+typedef uint32_t LINEARDB3_RecordIndex;
+#define LINEARDB3_MAX_RECORDS ( (uint64_t)UINT32_MAX + 1 )
+#endif
+
+// largest table, so fingerprintMod (a multiple of twice the base table
+// size while expanding) still fits in 32 bits 最大桶数
+#define LINEARDB3_MAX_BUCKETS ( (uint64_t)INT32_MAX )
+
+
 
 typedef struct {
         // index of another FingerprintBucket in the overflow array,
@@ -21,11 +48,25 @@ typedef struct {
         // val并非数据而是类似fseek的偏移量
         uint32_t fileIndex[ LINEARDB3_RECORDS_PER_BUCKET ];
 
+#ifdef LINEARDB3_WIDE_INDEX
+        // bits 32..39 of each record number
+        uint8_t fileIndexHigh[ LINEARDB3_RECORDS_PER_BUCKET ];
+#endif
+
         // fingerprint mini-hash, mod the largest possible table size in the 32-bit space.
         // We can mod this with our current table size to find the current bin number
         // 指纹迷你哈希, 对当前表的扩容前当前最大表容量, 对key的低32位进行取模
         // (rehashing without actually rehashing the full key 重新哈希但不是重新哈希整个key)
         uint32_t fingerprints[ LINEARDB3_RECORDS_PER_BUCKET ];
+
+        // top 8 bits of each record's full hash
+        // All fingerprints that land in one bucket share their low 
+        // (bin-number) bits, so only their few remaining high bits 
+        // tell them apart. Tags come from hash bits that don't go into
+        // the bin number, so a fingerprint collision only costs a 
+        // disk read when the tags collide too.
+        // 标签: 与桶号无关的哈希位, 减少指纹误判导致的读盘
+        uint8_t tags[ LINEARDB3_RECORDS_PER_BUCKET ];
     } LINEARDB3_FingerprintBucket;
 
 
@@ -38,6 +79,11 @@ typedef struct {
 
 
 
+// file-backed page storage, see LINEARDB3_setIndexRAMBudget,
+// private to lineardb3.cpp
+typedef struct LINEARDB3_IndexSpill LINEARDB3_IndexSpill;
+
+
 typedef struct {
         // 使用中的桶数量 (bucket是不用new的, 只需要new页, 因此是逻辑使用的桶)
         uint32_t numBuckets;
@@ -52,6 +98,10 @@ typedef struct {
 
         uint32_t firstEmptyBucket;
 
+        // where pages past the RAM budget go, shared by a database's page
+        // managers, NULL if every page is on the heap 溢出到文件的页
+        LINEARDB3_IndexSpill *spill;
+
     } LINEARDB3_PageManager;
     
     
@@ -59,12 +109,93 @@ typedef struct {
 enum LastFileOp{ opRead, opWrite };
 
 
+// how hard puts work to survive a crash
+// 写入持久化级别
+enum LINEARDB3_Durability{ 
+    // no write-ahead log, puts go straight to the data file
+    durabilityNone, 
+    // puts are logged, and the log is synced once per batch of puts
+    // (group commit), then the batch is applied to the data file
+    durabilityBatch, 
+    // log is synced before every put is applied to the data file
+    durabilityOp };
+
+
+// background writer for LINEARDB3_OPEN_IN_MEMORY, private to lineardb3.cpp
+typedef struct LINEARDB3_MemWriter LINEARDB3_MemWriter;
+
+// hot-record cache, see LINEARDB3_setCacheSize, private to lineardb3.cpp
+typedef struct LINEARDB3_RecordCache LINEARDB3_RecordCache;
+
+// (x,y) secondary index, see LINEARDB3_OPEN_SPATIAL_INDEX, 
+// private to lineardb3.cpp
+typedef struct LINEARDB3_SpatialIndex LINEARDB3_SpatialIndex;
+
+// workload trace being captured, see LINEARDB3_setTraceFile,
+// private to lineardb3.cpp
+typedef struct LINEARDB3_Trace LINEARDB3_Trace;
+
+// load tuner, see LINEARDB3_setAdaptiveLoad, private to lineardb3.cpp
+typedef struct LINEARDB3_AdaptiveLoad LINEARDB3_AdaptiveLoad;
+
+
+
+// Define LINEARDB3_STATS (for every file that includes this header, it
+// changes the LINEARDB3 struct) to count what lookups and puts cost, 
+// see LINEARDB3_getStats.  Compiled out, the counting costs nothing.
+// 热路径计数器, 编译期开关
+//
+// Only uint64_t fields: the live counters are an array of atomics, one
+// per field in this order.
+typedef struct {
+        uint64_t numGets;
+        uint64_t numPuts;
+
+        // fingerprint slots examined 探测的槽数
+        uint64_t numSlotProbes;
+
+        // overflow buckets walked to 遍历的溢出桶数
+        uint64_t numOverflowWalks;
+        
+        // fingerprint and tag matched, but key didn't, wherever the key 
+        // was compared (RAM, cache, or data file)
+        uint64_t numKeyMismatches;
+
+        // of those, the ones that cost a data file read (same as 
+        // LINEARDB3_getNumFalsePositives), and fingerprint matches the
+        // tag ruled out (same as LINEARDB3_getNumTagRejects)
+        uint64_t numFalsePositives;
+        uint64_t numTagRejects;
+
+        // data file calls: fseeko done, fseeko skipped because file
+        // position was already right, ftello probes, fread, fwrite
+        uint64_t numSeeks;
+        uint64_t numSeeksAvoided;
+        uint64_t numTells;
+        uint64_t numReads;
+        uint64_t numWrites;
+
+        // buckets added to hash table by expansion 扩容次数
+        uint64_t numExpansions;
+
+        // buckets merged back by LINEARDB3_contract 收缩次数
+        uint64_t numContractions;
+
+        // bucket pages allocated for hash table and overflow, 
+        // including any LINEARDB3_contract gave back since
+        uint64_t numPageAllocs;
+    } LINEARDB3_Stats;
+
+#define LINEARDB3_NUM_STATS ( sizeof( LINEARDB3_Stats ) / sizeof( uint64_t ) )
+
+
+
 typedef struct {
         // load above this causes table to expand incrementally 扩容因子 0.5
         double maxLoad;
         
         // number of inserted records in database 表记录数
-        uint32_t numRecords;
+        LINEARDB3_RecordIndex numRecords;
         
 
         // for linear hashing table expansion number of slots in base table 
@@ -103,12 +234,99 @@ typedef struct {
 
         unsigned int maxOverflowDepth; // 最大溢出深度?
 
+        // fingerprint and tag matched, but key read from disk didn't 
+        // (each one is a wasted random read) 指纹误判次数
+        // relaxed atomics, read-only lookups run concurrently
+        std::atomic<uint64_t> numFalsePositives;
+
+        // fingerprint matched, but tag ruled the record out without 
+        // a disk read 被标签排除的次数
+        std::atomic<uint64_t> numTagRejects;
+
+        // bucket pages LINEARDB3_contract freed 已释放的页数
+        uint64_t numPagesReleased;
+
+
+        // LINEARDB3_OPEN_KEYS_IN_RAM / KEY_DIGESTS_IN_RAM only, NULL otherwise:
+        // key (or 64-bit digest) of each record, indexed by record number
+        // 按记录编号索引的key副本
+        uint8_t *ramKeys;
+        unsigned int ramKeySize;
+        uint64_t ramKeysCapacity;
+        char ramKeysAreDigests;
+
+        // NULL unless LINEARDB3_setCacheSize gave it a budget 记录缓存
+        LINEARDB3_RecordCache *recordCache;
+
+        // LINEARDB3_OPEN_SPATIAL_INDEX only, NULL otherwise 空间索引
+        LINEARDB3_SpatialIndex *spatialIndex;
+
+        // NULL unless LINEARDB3_setTraceFile is capturing 访问轨迹
+        LINEARDB3_Trace *trace;
+
+        // NULL unless LINEARDB3_setAdaptiveLoad gave it a budget 自适应负载
+        LINEARDB3_AdaptiveLoad *adaptiveLoad;
+
 
         
         // sized to hashTableSizeB buckets 容量为sizeB
         LINEARDB3_PageManager *hashTable;
 
         LINEARDB3_PageManager *overflowBuckets; // 溢出桶页数组
+
+        // NULL unless LINEARDB3_setIndexRAMBudget was set at open
+        LINEARDB3_IndexSpill *indexSpill;
+
+
+        LINEARDB3_Durability durability;
+
+        // write-ahead log, NULL when durability is durabilityNone 预写日志
+        FILE *walFile;
+        char *walPath;
+
+        // bytes of log entries written since last checkpoint
+        uint64_t walBytes;
+
+        // durabilityBatch only:
+        // puts that are logged in RAM but not yet synced or applied
+        // to the data file 尚未提交的批次
+        uint8_t *walBatch;
+        unsigned int walBatchCount;
+        unsigned int walBatchMaxCount;
+
+
+        // opened with LINEARDB3_OPEN_READ_ONLY 只读模式
+        char readOnly;
+        
+        // read-only only: whole data file mapped into memory, NULL otherwise
+        uint8_t *mappedFile;
+        uint64_t mappedFileSize;
+
+        // first record in mappedFile
+        const uint8_t *mappedRecords;
+
+        // LINEARDB3_OPEN_ARCHIVE only, NULL otherwise:
+        // static index (inPath.idx) mapped into memory, used in place
+        // of the hash table 归档静态索引
+        uint8_t *archiveIndexFile;
+        uint64_t archiveIndexFileSize;
+        uint64_t archiveNumBuckets;
+        unsigned int archiveOffsetBytes;
+        const uint8_t *archiveOffsets;
+
+
+        // LINEARDB3_OPEN_IN_MEMORY only, NULL otherwise:
+        // every record, indexed by record number, and the background
+        // thread that writes puts through to the data file 内存记录数组
+        uint8_t *memRecords;
+        uint64_t memRecordsCapacity;
+        LINEARDB3_MemWriter *memWriter;
+
+#ifdef LINEARDB3_STATS
+        // LINEARDB3_Stats fields by position, relaxed atomics so
+        // concurrent read-only lookups are counted too
+        std::atomic<uint64_t> stats[ LINEARDB3_NUM_STATS ];
+#endif
         
 
     } LINEARDB3;
@@ -123,6 +341,7 @@ typedef struct {
 
 /**
  * Set maximum table load for all subsequent callst to LINEARDB3_open.
+ * LINEARDB3_openWithMaxLoad sets it for one database instead.
  *
  * Defaults to 0.5.
  *
@@ -143,6 +362,143 @@ void LINEARDB3_setMaxLoad( double inMaxLoad );
 
 
 
+/**
+ * Set how much heap RAM hash table and overflow pages of each database
+ * may use, for all subsequent calls to LINEARDB3_open.  0 (the default)
+ * means no limit.
+ * 索引内存预算, 超出部分映射到临时文件
+ *
+ * Pages past the budget are carved out of a scratch file mapped into 
+ * memory, created next to the data file (inPath.spill.XXXXXX) and 
+ * unlinked right away, so it never outlives the process.  Lookups reach
+ * those pages exactly like heap pages, but the OS can write cold ones 
+ * out and drop them under memory pressure, while hot ones stay in the
+ * page cache.  So several big databases can be open on one host without
+ * running out of RAM, and hot keys cost the same as before.
+ *
+ * Needs mmap; elsewhere, or if the scratch file can't be made, every 
+ * page stays on the heap.
+ */
+void LINEARDB3_setIndexRAMBudget( uint64_t inBytes );
+
+
+
+
+/**
+ * Set durability level for all subsequent calls to LINEARDB3_open.
+ *
+ * Defaults to durabilityNone.
+ *
+ * Above durabilityNone, each put is first logged (key, value, and record
+ * position, checksummed) to a write-ahead log file named inPath.wal
+ * before the data file is touched.  If a previous run crashed,
+ * LINEARDB3_open replays any complete log entries into the data file.
+ *
+ * durabilityBatch collects puts in RAM and commits them as one group:
+ * a single log write and sync, then the data file writes.  A batch is
+ * committed when it fills (see LINEARDB3_setWALBatchSize), 
+ * on LINEARDB3_sync, on close, and before anything needs to read from
+ * the data file.  Puts since the last commit are lost on a crash,
+ * but the data file never ends up with a torn record.
+ *
+ * durabilityOp syncs the log before applying every put.
+ */
+void LINEARDB3_setDurability( LINEARDB3_Durability inDurability );
+
+
+
+/**
+ * Set maximum number of puts grouped into one log sync under 
+ * durabilityBatch, for all subsequent calls to LINEARDB3_open.
+ *
+ * Defaults to 1024.
+ */
+void LINEARDB3_setWALBatchSize( unsigned int inNumPuts );
+
+
+
+
+/**
+ * Set whether subsequent calls to LINEARDB3_open save the bytes they drop
+ * when repairing a data file that doesn't end on a whole record.
+ *
+ * Defaults to false.
+ *
+ * A torn final record is cut off in place (the file is truncated to the
+ * last whole record, nothing else is rewritten).  When enabled, the
+ * dropped bytes are first written to a file named inPath.tail.
+ */
+void LINEARDB3_setBackupTruncatedTail( char inBackup );
+
+
+
+
+// flags for inMode in LINEARDB3_open, or'ed together
+// 0 is the default read-write-create mode
+// 打开模式标志
+
+// Open existing file for lookups only.  The file is never created, 
+// repaired, or written to.  The data file is mapped into memory, and 
+// lookups read it there without any seeks or shared scratch state, 
+// so LINEARDB3_get and iterators may be used from many threads at once.  
+// Processes opening the same file this way share its page cache.
+// LINEARDB3_put fails.
+#define LINEARDB3_OPEN_READ_ONLY   0x01
+
+// Keep a copy of every key in RAM, indexed by record number, so 
+// fingerprint collisions are ruled out without a disk read, a get only
+// reads the value from disk, and a miss never touches the disk.
+// Costs keySize bytes of RAM per record (see LINEARDB3_getRAMUsage).
+// Ignored in read-only mode, where keys are compared in mapped memory anyway.
+// 内存中保存完整key
+#define LINEARDB3_OPEN_KEYS_IN_RAM   0x02
+
+// Like LINEARDB3_OPEN_KEYS_IN_RAM, but keys longer than 8 bytes are kept
+// as 64-bit digests.  A digest match is still verified against the key 
+// in the data file (read along with the value), but misses stay off disk.
+// 内存中保存64位key摘要
+#define LINEARDB3_OPEN_KEY_DIGESTS_IN_RAM   0x04
+
+// Load every record into one array in RAM at open, and serve gets, puts,
+// and iterators from it without touching the disk.  The data file (same
+// format) becomes a persistence log: a background thread appends or 
+// overwrites the records that puts changed.  LINEARDB3_sync waits until
+// the file has caught up, and durability settings apply to those writes.
+// Costs recordSizeBytes of RAM per record (see LINEARDB3_getRAMUsage).
+// Ignored in read-only mode.  Key flags above are ignored with this one.
+// 全内存模式, 数据文件由后台线程异步写入
+#define LINEARDB3_OPEN_IN_MEMORY   0x08
+
+// Keep a secondary index on the first 8 key bytes, read as two int32
+// tile coordinates (x, y), so LINEARDB3_getRange can find every record
+// on a tile or in a rectangle without probing for each possible key.
+// Built at open and maintained on put.  Costs about 4 bytes of RAM per
+// record (8 with LINEARDB3_WIDE_INDEX) plus 16 per distinct tile.
+// Ignored for keys shorter than 8 bytes.
+// 按(x,y)建立二级索引, 用于地块/矩形范围查询
+#define LINEARDB3_OPEN_SPATIAL_INDEX   0x10
+
+// Open an archive made by LINEARDB3_writeArchive.  Implies 
+// LINEARDB3_OPEN_READ_ONLY.  Data file and its static index are mapped,
+// no hash table is built, and a get is one index probe plus one read of
+// a few neighboring records.  inHashTableStartSize is ignored.
+// Fails if the index is missing or doesn't match the data file.
+// 打开归档 (只读, 静态索引)
+#define LINEARDB3_OPEN_ARCHIVE   0x20
+
+// Check at open that no key appears in the data file more than once 
+// (a file appended to by other tools, or damaged), before the hash table
+// is built.  Of each set of records with the same key, the last-written
+// (highest record number) is kept, and the others are removed by sliding
+// later records down and truncating the file.  Read-only, duplicates are
+// only reported.  Keys are hashed once in parallel and grouped by digest,
+// so it costs about one extra scan of the file, and 16 bytes of RAM per
+// record while it runs.  Ignored with LINEARDB3_OPEN_ARCHIVE.
+// 打开时检测并修复重复key
+#define LINEARDB3_OPEN_VERIFY_UNIQUE   0x40
+
+
+
 /**
  * Open database
  * 
@@ -153,7 +509,7 @@ void LINEARDB3_setMaxLoad( double inMaxLoad );
  *
  * @param db Database struct
  * @param path Path to data file.
- * @param inMode is ignored, and always opened in RW-create mode (left for compatibility with KISSDB api)
+ * @param inMode 0 for read-write-create mode, or LINEARDB3_OPEN_ flags above
  * @param inHashTableStartSize Size of hash table in entries
  *   This is the starting size of the table, which will grow as the table
  *   becomes full.  If less than 2, will be automatically raised to 2.
@@ -171,6 +527,25 @@ int LINEARDB3_open(
 
 
 
+/**
+ * Same as LINEARDB3_open, but with this database's own maximum table 
+ * load (see LINEARDB3_setMaxLoad), so databases open at the same time
+ * can trade RAM for speed differently.
+ * 按数据库指定负载因子打开
+ *
+ * @param inMaxLoad above 0, 0.5 is the usual default
+ */
+int LINEARDB3_openWithMaxLoad(
+    LINEARDB3 *inDB,
+    const char *inPath,
+    int inMode,
+    unsigned int inHashTableStartSize,
+    unsigned int inKeySize,
+    unsigned int inValueSize,
+    double inMaxLoad );
+
+
+
 /**
  * Close database
  *
@@ -201,19 +576,75 @@ int LINEARDB3_get( LINEARDB3 *inDB, const void *inKey, void *outValue );
  * @param db Database struct
  * @param key Key (key_size bytes)
  * @param value Value (value_size bytes)
- * @return -1 on I/O error, 0 on success
+ * @return -1 on I/O error (or if opened read-only), 0 on success
  */
 int LINEARDB3_put( LINEARDB3 *inDB, const void *inKey, const void *inValue );
 
 
 
+/**
+ * Commit any puts still waiting in the current durabilityBatch group.
+ *
+ * In LINEARDB3_OPEN_IN_MEMORY mode, first waits until the background
+ * writer has written every put so far to the data file.
+ *
+ * Otherwise does nothing unless durability is durabilityBatch.
+ *
+ * @param db Database struct
+ * @return -1 on I/O error, 0 on success
+ */
+int LINEARDB3_sync( LINEARDB3 *inDB );
+
+
+
+/**
+ * Called by LINEARDB3_getRange for each record found.
+ *
+ * inKey and inValue are only valid until the callback returns or
+ * calls another function on the same database.
+ *
+ * @param inFileIndex record number of this record in the data file
+ * @param inContext passed through from LINEARDB3_getRange
+ * @return 0 to keep going, non-zero to stop the query
+ */
+typedef int (*LINEARDB3_RangeCallback)( const void *inKey, 
+                                        const void *inValue,
+                                        LINEARDB3_RecordIndex inFileIndex,
+                                        void *inContext );
+
+
+
+/**
+ * Report every record whose tile coordinates (first two int32s of the
+ * key) lie in the rectangle inMinX..inMaxX, inMinY..inMaxY, inclusive.
+ * A single tile (main object plus all its sub-slots) is the rectangle
+ * x..x, y..y.
+ * 范围查询: 返回矩形内所有地块的全部记录
+ *
+ * Needs LINEARDB3_OPEN_SPATIAL_INDEX.  Records on one tile are reported 
+ * newest first, tiles in no particular order.  Safe from many threads 
+ * at once in read-only mode, like LINEARDB3_get.
+ *
+ * @param inCallback called for each record found
+ * @param inContext passed to inCallback
+ * @return number of records reported, or -1 on I/O error or if 
+ *   database has no spatial index
+ */
+int64_t LINEARDB3_getRange( LINEARDB3 *inDB, 
+                            int32_t inMinX, int32_t inMinY,
+                            int32_t inMaxX, int32_t inMaxY,
+                            LINEARDB3_RangeCallback inCallback,
+                            void *inContext );
+
+
+
 /**
  * Cursor used for iterating over all entries in database
  * 游标
  */
 typedef struct {
         LINEARDB3 *db;
-        uint32_t nextRecordIndex;
+        LINEARDB3_RecordIndex nextRecordIndex;
 } LINEARDB3_Iterator;
 
 
@@ -273,7 +704,190 @@ unsigned int LINEARDB3_getCurrentSize( LINEARDB3 *inDB );
  * Number of records that have been inserted in the database.
  * 获取插入的记录数
  */
-unsigned int LINEARDB3_getNumRecords( LINEARDB3 *inDB );
+LINEARDB3_RecordIndex LINEARDB3_getNumRecords( LINEARDB3 *inDB );
+
+
+
+
+/**
+ * Bytes of RAM used by the index: hash table and overflow pages (those
+ * on the heap, not spilled ones, see LINEARDB3_setIndexRAMBudget), plus 
+ * keys or digests kept in RAM, plus records in LINEARDB3_OPEN_IN_MEMORY mode,
+ * plus the static index of an archive.
+ * 索引占用的内存字节数
+ *
+ * Useful for picking an open mode per database.
+ */
+uint64_t LINEARDB3_getRAMUsage( LINEARDB3 *inDB );
+
+
+
+/**
+ * Number of lookups and puts where a record's fingerprint and tag matched
+ * but the key read back from the data file didn't (wasted disk reads), 
+ * and number of fingerprint matches that the tag ruled out without a read.
+ * 指纹误判次数, 以及被标签排除的次数
+ *
+ * Counted in read-only mode too, where lookups may run concurrently.
+ */
+uint64_t LINEARDB3_getNumFalsePositives( LINEARDB3 *inDB );
+
+uint64_t LINEARDB3_getNumTagRejects( LINEARDB3 *inDB );
+
+
+
+
+/**
+ * Counters for everything this database has done since it was opened.
+ * 获取计数器
+ *
+ * Take a snapshot before and after some calls and subtract to see
+ * what they cost.
+ *
+ * All zero except numFalsePositives, numTagRejects and numPageAllocs 
+ * unless LINEARDB3_STATS is defined.  Read-only mode is counted too: 
+ * counters are relaxed atomics, so concurrent lookups each add theirs,
+ * though threads bumping the same counters contend for them.
+ */
+void LINEARDB3_getStats( LINEARDB3 *inDB, LINEARDB3_Stats *outStats );
+
+
+
+
+/**
+ * Give this database a cache of recently used records, at most inBytes
+ * of RAM, or 0 to drop the cache.  Starts empty.
+ * 设置热点记录缓存大小
+ *
+ * Records are cached by record number, with CLOCK eviction.  A get that
+ * hits the cache compares the key and copies the value without any disk
+ * reads, and a fingerprint collision with a cached record costs nothing.
+ * Gets and overwriting puts fill the cache, and puts write through it.
+ * Fresh records appended by puts are not cached, so a bulk load doesn't 
+ * flush out hot records.
+ *
+ * Ignored in read-only and LINEARDB3_OPEN_IN_MEMORY modes, where every
+ * record is in RAM already.
+ *
+ * @return 0 on success, -1 if cache RAM couldn't be allocated
+ */
+int LINEARDB3_setCacheSize( LINEARDB3 *inDB, uint64_t inBytes );
+
+
+
+/**
+ * Number of record lookups that were answered from the cache, and number
+ * that had to go to the data file, since the cache was last sized.
+ * 缓存命中/未命中次数
+ */
+uint64_t LINEARDB3_getCacheHits( LINEARDB3 *inDB );
+
+uint64_t LINEARDB3_getCacheMisses( LINEARDB3 *inDB );
+
+
+
+// lookups per adaptive load adjustment
+#define LINEARDB3_ADAPTIVE_LOAD_WINDOW 65536
+
+// adaptive maxLoad stays within these
+#define LINEARDB3_ADAPTIVE_LOAD_MIN 0.25
+#define LINEARDB3_ADAPTIVE_LOAD_MAX 1.0
+
+
+/**
+ * Let this database tune its own maxLoad while it runs, or pass 
+ * inRAMBudgetBytes 0 to stop (maxLoad stays where it got to).
+ * 自适应调整负载因子
+ *
+ * Every LINEARDB3_ADAPTIVE_LOAD_WINDOW gets and puts, looks at how many
+ * buckets lookups visited on average (1 means no overflow walks) and
+ * whether overflow buckets are piling up.  Lookups slower than 
+ * inTargetBuckets lower maxLoad a step, so the table expands, as long as
+ * the bigger table still fits in inRAMBudgetBytes (LINEARDB3_getRAMUsage).
+ * Lookups well under target raise it a step, so the table holds off 
+ * expanding.  RAM over budget raises it too, and also contracts the table
+ * to fit the new load (see LINEARDB3_contract).
+ *
+ * Read-only tables never grow, so there's nothing to tune.
+ *
+ * @param inTargetBuckets average buckets per lookup to aim for, 
+ *   above 1, 1.05 is a good start
+ * @return 0 on success, -1 if read-only or target out of range
+ */
+int LINEARDB3_setAdaptiveLoad( LINEARDB3 *inDB, uint64_t inRAMBudgetBytes,
+                               double inTargetBuckets );
+
+
+
+// Workload trace file format, for replaying a real access pattern later:
+// 访问轨迹文件格式
+//
+// header:  "Lt1", uint32 key size, uint32 value size  (11 bytes)
+// entries: uint8 op, uint64 nanoseconds since capture started, then
+//          for gets and puts only, the key (key size bytes)
+//
+// Values aren't captured, a put's value is always value size bytes.
+// Everything is in host byte order.
+#define LINEARDB3_TRACE_HEADER_SIZE 11
+
+enum LINEARDB3_TraceOp{ 
+    traceGet = 1, 
+    tracePut = 2, 
+    // LINEARDB3_Iterator_init and LINEARDB3_Iterator_next
+    traceIteratorInit = 3, 
+    traceIteratorNext = 4 };
+
+
+
+/**
+ * Log every get, put, and iterator call on this database to a binary
+ * trace file at inPath, replacing it, or stop logging if inPath is NULL.
+ * 记录访问轨迹
+ *
+ * Calls are logged before they run.  Safe with concurrent read-only gets,
+ * but don't start or stop a capture while other threads use inDB.
+ * While not capturing, costs one NULL check per call.
+ *
+ * @return 0 on success, -1 if trace file couldn't be created
+ */
+int LINEARDB3_setTraceFile( LINEARDB3 *inDB, const char *inPath );
+
+
+
+// average records per bucket of an archive's static index
+// index costs 32 bits per bucket (64 past 2^32 records), so 4 bits per key
+#define LINEARDB3_ARCHIVE_RECORDS_PER_BUCKET 8
+
+// archive index file header: "La2", uint8 offset bytes (4 or 8), 
+// uint32 key size, uint32 value size, uint64 records, uint64 buckets,
+// uint64 fingerprint of keys in the regrouped data file, uint32 zero,
+// then buckets + 1 offsets, the first record of each bucket
+#define LINEARDB3_ARCHIVE_INDEX_HEADER_SIZE 40
+
+
+
+/**
+ * Turn a closed, finished data file into an archive for 
+ * LINEARDB3_OPEN_ARCHIVE: records are rewritten in place, grouped by 
+ * hash bucket, and a static index is written to inPath.idx.
+ * 写归档: 按哈希桶重排记录, 并写出静态索引
+ *
+ * The data file stays an ordinary lineardb3 file, and can still be opened
+ * without LINEARDB3_OPEN_ARCHIVE.  Adding records to it, or rewriting it
+ * in another order, makes the index stale (archive open then fails, the
+ * index holds a fingerprint of keys sampled across the data file),
+ * overwriting values doesn't.
+ * Keys must be unique.
+ *
+ * RAM use is bounded: records are regrouped in a few passes over the file
+ * when they don't all fit in inMemoryBytes.  Needs disk room for a second 
+ * copy of the data file while it runs.
+ *
+ * @return 0 on success, -1 on error (data file still holds the same records)
+ */
+int LINEARDB3_writeArchive( const char *inPath, 
+                            unsigned int inKeySize, unsigned int inValueSize,
+                            uint64_t inMemoryBytes );
 
 
 
@@ -284,7 +898,27 @@ unsigned int LINEARDB3_getNumRecords( LINEARDB3 *inDB );
  * Return value can be used for inHashTableStartSize in LINEARDB3_open.
  * 返回值可用于LINEARDB3_open中的inHashTableStartSize字段
  */
-uint32_t LINEARDB3_getPerfectTableSize( double inMaxLoad, uint32_t inNumRecords );
+uint32_t LINEARDB3_getPerfectTableSize( double inMaxLoad, 
+                                        LINEARDB3_RecordIndex inNumRecords );
+
+
+
+/**
+ * Shrinks the hash table in place to what its records need at inDB's 
+ * maxLoad, after maxLoad was raised, or the table was opened with a large
+ * inHashTableStartSize.  Undoes linear hashing one bucket at a time, 
+ * merging the last bucket back into the one it was split from, and
+ * frees whole bucket pages left empty at the end of the table.  Then
+ * moves overflow buckets down into holes left by merged chains, so 
+ * trailing overflow pages can be freed too.  No records are copied or
+ * rehashed from the data file.
+ * 原地收缩哈希表, 释放空页
+ *
+ * Puts expand the table again as needed.  Fails in read-only mode.
+ *
+ * @return number of buckets removed, or -1 on error
+ */
+int64_t LINEARDB3_contract( LINEARDB3 *inDB );
 
 
 
@@ -299,4 +933,5 @@ uint32_t LINEARDB3_getPerfectTableSize( double inMaxLoad, uint32_t inNumRecords
  * 当迭代一个DB，将项插入一个新的较小的DB时，这很有用。
  * 返回值可用于LINEARDB3_open中的inHashTableStartSize字段
  */
-unsigned int LINEARDB3_getShrinkSize( LINEARDB3 *inDB, unsigned int inNewNumRecords );
+unsigned int LINEARDB3_getShrinkSize( LINEARDB3 *inDB, 
+                                      LINEARDB3_RecordIndex inNewNumRecords );
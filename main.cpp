@@ -1,6 +1,25 @@
 #include "lineardb3.h"
+#include "mortonsort.h"
+#include "asyncio.h"
+#include "tiledb.h"
 #include "timer.cpp"
 #include <cstring>
+#include <thread>
+#include <vector>
+#include <unordered_set>
+#if defined( _MSC_VER )
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// block filter compares with SSE2 where it's there (always on x86-64),
+// define SHRINK_NO_SIMD to leave it out
+#if !defined( SHRINK_NO_SIMD ) && \
+    ( defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+#define SHRINK_FILTER_SSE2
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 #define uint32_t unsigned int
@@ -10,8 +29,177 @@ using namespace std;
 class Timer;
 void floor_db_test();
 void map_time_db_test();
-void map_time_db_shrink();
-void map_db_shrink();
+void map_time_db_shrink( LINEARDB3 *dbFloor );
+void map_db_shrink( LINEARDB3 *db, LINEARDB3 *dbFloor );
+LINEARDB3 *openShrinkIndex( const char *dbPath, unsigned int keySize, unsigned int valueSize, int extraMode );
+int trace_replay( const char *tracePath, const char *dbPath );
+int tile_db_test();
+int unique_db_test();
+int contract_db_test();
+
+// write shrink output in Morton (Z) order of (x,y) instead of append order
+// 按Z序输出
+char mortonOrder = false;
+#define MORTON_SORT_MEMORY ( 512ULL * 1024 * 1024 )
+
+// finish shrink output as an archive (LINEARDB3_OPEN_ARCHIVE), records
+// grouped by hash bucket plus a static index next to it 输出归档格式
+char archiveOutput = false;
+#define ARCHIVE_MEMORY ( 512ULL * 1024 * 1024 )
+
+// origin records stream in through asyncio, several big reads ahead
+// 异步预读原始文件
+typedef struct {
+    ASYNCIO_Reader *reader;
+    const unsigned char *block;
+    long long numInBlock;
+    long long next;
+} ShrinkInput;
+
+// surviving records go out through asyncio (or to a Morton sorter),
+// counted and checksummed for the watermark
+typedef struct {
+    ASYNCIO_Writer *writer;
+    MORTONSORT *sorter;
+    uint64_t numKept;
+    uint64_t checksum;
+} ShrinkOutput;
+
+// how far a plain shrink got, saved next to its output as <output>.wm,
+// so the next one only filters what was appended since 增量水位线
+// puts on existing keys rewrite values in place, so the records it saw
+// are checksummed too, and read back before the next one builds on it
+typedef struct {
+    // origin and floor.db records when it finished
+    uint64_t numOriginRecords;
+    uint64_t numFloorRecords;
+    // records in output, and their chained checksum
+    uint64_t numKeptRecords;
+    uint64_t keptChecksum;
+    // chained checksums of those origin and floor.db records
+    uint64_t originChecksum;
+    uint64_t floorChecksum;
+} ShrinkWatermark;
+
+#define SHRINK_WATERMARK_MAGIC "Lw2"
+#define SHRINK_CHECKSUM_START 0xcbf29ce484222325ULL
+
+// shrink in progress, saved as <output>.ckpt every SHRINK_PROGRESS_MS,
+// so an interrupted one picks up where it stopped 断点续传
+typedef struct {
+    // finished shrink this run builds on, all 0 for a full shrink
+    ShrinkWatermark base;
+    // origin and floor.db records when run started, resuming needs same
+    uint64_t numOriginRecords;
+    uint64_t numFloorRecords;
+    // origin records filtered so far
+    uint64_t numFilteredRecords;
+    // records in output, and their chained checksum
+    uint64_t numKeptRecords;
+    uint64_t keptChecksum;
+    // chained checksums of origin records filtered so far, and of all
+    // floor.db records
+    uint64_t originChecksum;
+    uint64_t floorChecksum;
+} ShrinkCheckpoint;
+
+#define SHRINK_CHECKPOINT_MAGIC "Lc2"
+
+// between progress reports, each with a checkpoint 进度报告间隔
+#define SHRINK_PROGRESS_MS 5000
+// records between looks at the clock
+#define SHRINK_PROGRESS_CHECK 65536
+
+#define SHRINK_MAX_CATEGORIES 3
+
+// recent lookup results by tile, direct-mapped: a tile has one slot, by
+// hash of (x,y), and takes it over from whatever tile was there
+// 最近查询结果缓存, 按(x,y)直接映射
+#define SHRINK_MEMO_BITS 12
+#define SHRINK_MEMO_SLOTS ( 1 << SHRINK_MEMO_BITS )
+
+typedef struct {
+    uint64_t tile;
+    char used;
+    char result;
+} ShrinkMemoSlot;
+
+typedef struct {
+    ShrinkMemoSlot slots[ SHRINK_MEMO_SLOTS ];
+    uint64_t numLookups;
+    uint64_t numHits;
+} ShrinkMemo;
+
+// live progress of one shrink, with records seen and kept by category
+typedef struct {
+    const char *shrinkPath;
+    Timer timer;
+    long long lastReportMs;
+    // origin records this run filters
+    uint64_t firstRecord;
+    uint64_t endRecord;
+    int numCategories;
+    const char *categoryNames[ SHRINK_MAX_CATEGORIES ];
+    uint64_t numSeen[ SHRINK_MAX_CATEGORIES ];
+    uint64_t numKept[ SHRINK_MAX_CATEGORIES ];
+    // lookup memo whose hit rate is reported, or NULL
+    ShrinkMemo *memo;
+    const char *memoName;
+} ShrinkProgress;
+
+// records per block filter pass, one bit each in a mask word
+#define SHRINK_FILTER_BATCH 64
+
+// cheap-field verdicts on a batch of records, bit r for record r
+// 块过滤结果位图
+typedef struct {
+    // kept without any lookup
+    uint64_t keepBits;
+    // kept if its tile has a floor, the rest need their main object
+    uint64_t floorBits;
+} ShrinkBatchMasks;
+
+int openShrinkInput( ShrinkInput *input, FILE *originFile, uint64_t firstRecord, uint64_t endRecord, uint32_t recordSizeBytes );
+int readShrinkRecord( ShrinkInput *input, void *recordBuffer, uint32_t recordSizeBytes );
+int readShrinkBatch( ShrinkInput *input, const unsigned char **outRecords, uint32_t recordSizeBytes );
+void filterShrinkBatch( const unsigned char *records, int numRecords, uint32_t recordSizeBytes,
+                        char hasSubRecords, ShrinkBatchMasks *masks );
+int openShrinkOutput( ShrinkOutput *output, FILE *shrinkFile, MORTONSORT *sorter, uint32_t recordSizeBytes,
+                      ShrinkCheckpoint *run );
+int writeShrinkRecord( ShrinkOutput *output, const void *record, uint32_t recordSizeBytes );
+char keepMapRecord( LINEARDB3 *db, LINEARDB3 *dbFloor, const uint32_t *record );
+char keepMapTimeRecord( LINEARDB3 *dbFloor, const uint32_t *record );
+char hasFloor( LINEARDB3 *dbFloor, const uint32_t *record );
+char hasMainObject( LINEARDB3 *db, const uint32_t *record );
+ShrinkMemo *newShrinkMemo();
+char memoizedLookup( ShrinkMemo *memo, LINEARDB3 *db, const uint32_t *record,
+                     char (*lookup)( LINEARDB3 *, const uint32_t * ) );
+uint64_t getTileOf( const uint32_t *key );
+int recheckMapTile( LINEARDB3 *db, LINEARDB3 *dbFloor, uint64_t tile, char mainOnly,
+                    uint64_t numOldRecords, ShrinkOutput *output );
+int readNewFloorTiles( LINEARDB3 *dbFloor, uint64_t firstRecord, vector<uint64_t> *outTiles );
+int readShrinkWatermark( const char *shrinkPath, uint32_t recordSizeBytes, ShrinkWatermark *mark );
+uint64_t chainShrinkChecksum( uint64_t checksum, const void *record, uint32_t recordSizeBytes );
+int checksumShrinkRecords( const char *path, uint32_t recordSizeBytes, uint64_t firstRecord, uint64_t endRecord,
+                           uint64_t *checksum );
+FILE *openShrinkRun( const char *shrinkPath, const char *originPath, unsigned char *headerBuffer,
+                     uint32_t recordSizeBytes, uint64_t numRecordsInFile, LINEARDB3 *dbFloor, char canRecheck,
+                     ShrinkCheckpoint *run );
+FILE *resumeShrink( const char *shrinkPath, const char *originPath, uint32_t recordSizeBytes,
+                    uint64_t numRecordsInFile, LINEARDB3 *dbFloor, char canRecheck, ShrinkCheckpoint *run );
+FILE *openIncrementalShrink( const char *shrinkPath, const char *originPath, uint32_t recordSizeBytes,
+                             uint64_t numRecordsInFile, LINEARDB3 *dbFloor, char canRecheck,
+                             ShrinkWatermark *mark );
+FILE *startFullShrink( const char *shrinkPath, unsigned char *headerBuffer, ShrinkWatermark *mark );
+int checkShrinkOutput( FILE *shrinkFile, uint32_t recordSizeBytes, uint64_t numKeptRecords, uint64_t keptChecksum );
+int checkpointShrink( const char *shrinkPath, uint32_t recordSizeBytes, ShrinkCheckpoint *run,
+                      ShrinkOutput *output, uint64_t numFilteredRecords, uint64_t originChecksum );
+void initShrinkProgress( ShrinkProgress *progress, const char *shrinkPath, uint64_t firstRecord, uint64_t endRecord,
+                         int numCategories, const char **categoryNames );
+char shrinkProgressDue( ShrinkProgress *progress );
+void reportShrinkProgress( ShrinkProgress *progress, uint64_t numDone );
+void finishShrinkWatermark( const char *shrinkPath, uint32_t recordSizeBytes, uint64_t numRecordsInFile,
+                            ShrinkCheckpoint *run, uint64_t originChecksum, ShrinkOutput *output );
 
 int main(int argc, char *argv[]){
     // floor_db_test();
@@ -19,73 +207,147 @@ int main(int argc, char *argv[]){
     // map_time_db_shrink();
 
     if (argc < 2) {
-        printf("Usage: %s <db_name>\n", argv[0]);
+        printf("Usage: %s <db_name> [--morton | --archive]\n", argv[0]);
+        printf("       %s replay <trace_file> <db_file>\n", argv[0]);
+        printf("       %s tiletest\n", argv[0]);
+        printf("       %s uniquetest\n", argv[0]);
+        printf("       %s contracttest\n", argv[0]);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "tiletest") == 0) {
+        return tile_db_test();
+    }
+
+    if (strcmp(argv[1], "uniquetest") == 0) {
+        return unique_db_test();
+    }
+
+    if (strcmp(argv[1], "contracttest") == 0) {
+        return contract_db_test();
+    }
+
+    if (strcmp(argv[1], "replay") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s replay <trace_file> <db_file>\n", argv[0]);
+            return 0;
+        }
+        return trace_replay( argv[2], argv[3] );
+    }
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--morton") == 0) {
+            mortonOrder = true;
+        } else if (strcmp(argv[i], "--archive") == 0) {
+            archiveOutput = true;
+        }
+    }
+
+    if (mortonOrder && archiveOutput) {
+        // archive regroups records by hash bucket, Z-order would be lost
+        printf("--morton and --archive can't be combined\n");
         return 0;
     }
 
     Timer t;
-    
-    if (strcmp(argv[1], "map.db") == 0) {
-        map_db_shrink();
-    } else if (strcmp(argv[1], "mapTime.db") == 0) {
-        map_time_db_shrink();
+
+    char shrinkMap = strcmp(argv[1], "map.db") == 0;
+    char shrinkMapTime = strcmp(argv[1], "mapTime.db") == 0;
+
+    if (strcmp(argv[1], "all") == 0) {
+        shrinkMap = true;
+        shrinkMapTime = true;
+    }
+
+    if (!shrinkMap && !shrinkMapTime) {
+        printf("available db list: map.db, mapTime.db, all\n");
+        return 0;
+    }
+
+    // floor.db and map.db indexes are built once, and shared read-only
+    // by both shrinks 索引只构建一次, 只读共享
+    LINEARDB3 *dbFloor = openShrinkIndex( "floor.db", 8, 4, 0 );
+    LINEARDB3 *db = NULL;
+    if (dbFloor == NULL) {
+        return 1;
+    }
+    if (shrinkMap) {
+        // an incremental shrink finds older records again by tile
+        // 增量收缩需要空间索引
+        ShrinkWatermark mark;
+        int extraMode = 0;
+        if ( !mortonOrder && !archiveOutput && readShrinkWatermark( "map_shrink.db", 20, &mark ) == 0 ) {
+            extraMode = LINEARDB3_OPEN_SPATIAL_INDEX;
+        }
+        db = openShrinkIndex( "map.db", 16, 4, extraMode );
+        if (db == NULL) {
+            return 1;
+        }
+    }
+
+    if (shrinkMap && shrinkMapTime) {
+        // each shrink streams its own data file, run them side by side
+        // 两个文件并行处理
+        thread mapThread( map_db_shrink, db, dbFloor );
+        map_time_db_shrink( dbFloor );
+        mapThread.join();
+    } else if (shrinkMap) {
+        map_db_shrink( db, dbFloor );
     } else {
-        printf("available db list: map.db, mapTime.db\n");
+        map_time_db_shrink( dbFloor );
+    }
+
+    if (db != NULL) {
+        LINEARDB3_close( db );
     }
+    LINEARDB3_close( dbFloor );
 
     t.elapsed();
 }
 
+// opens a database that shrinking looks records up in
+// returns NULL on failure
+LINEARDB3 *openShrinkIndex( const char *dbPath, unsigned int keySize, unsigned int valueSize, int extraMode ) {
+    LINEARDB3 *db = new LINEARDB3();
+    int result = LINEARDB3_open(
+        db,
+        dbPath,
+        LINEARDB3_OPEN_READ_ONLY | extraMode,
+        8000,
+        keySize,
+        valueSize
+    );
+    if ( result != 0 ) {
+        printf( "Error opening %s\n", dbPath );
+        delete db;
+        return NULL;
+    }
+    return db;
+}
+
 /**
  * 算法已核验
  * cnt: 178956972 -> 106944141
  */
-void map_db_shrink() {
+void map_db_shrink( LINEARDB3 *db, LINEARDB3 *dbFloor ) {
 
     printf( "Generating Shrinked database...\n" );
 
     char *dbPath = "map.db";
     char *dbPathShrink = "map_shrink.db";
-    char *dbFloorPath = "floor.db";
 
     // key = x, y, s, b
     // val = oid
     // uint32_t key[4] = { 0x00000000, 0x00000000, 0x00000000, 0x00000000 };
     // uint32_t val[1] = { 0x00000000 };
     uint32_t recordSizeBytes = 20;
-    uint32_t recordBuffer[5] = { 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000 };
-    uint32_t recordBufferGet[5] = { 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000 };
-    uint32_t recordBufferGetFloor[3] = { 0x00000000, 0x00000000, 0x00000000 };
     unsigned char headerBuffer[ LINEARDB3_HEADER_SIZE ];
 
-    LINEARDB3 *db = new LINEARDB3();
-    LINEARDB3_open(
-        db,
-        dbPath,
-        0,
-        8000,
-        16,
-        4
-    );
-    LINEARDB3 *dbFloor = new LINEARDB3();
-    LINEARDB3_open(
-        dbFloor,
-        dbFloorPath,
-        0,
-        8000,
-        8,
-        4
-    );
-    FILE *originFile = fopen( dbPath, "r+b" );
+    FILE *originFile = fopen( dbPath, "rb" );
     if ( originFile == NULL ) {
         printf( "Error opening originFile\n" );
         return;
     }
-    FILE *shrinkFile = fopen( dbPathShrink, "w+b" );
-    if ( shrinkFile == NULL ) {
-        printf( "Error opening shrinkFile\n" );
-        return;
-    }
 
     if( fseeko( originFile, 0, SEEK_END ) ) return;
     uint64_t fileSize = ftello( originFile );
@@ -98,60 +360,161 @@ void map_db_shrink() {
         return;
     }
 
-    int numWritten = fwrite( headerBuffer, LINEARDB3_HEADER_SIZE, 1, shrinkFile );
-    if( numWritten != 1 ) {
-        printf( "Failed to write header to temp lineardb3 truncation file\n" );
+    // resume an interrupted shrink, or pick up where last one left off if
+    // nothing but appends happened since, which older records' checksums
+    // tell (older records are re-checked through map.db's spatial index)
+    // 增量收缩: 只处理水位线之后追加的记录
+    ShrinkCheckpoint run;
+    FILE *shrinkFile = openShrinkRun( dbPathShrink, dbPath, headerBuffer, recordSizeBytes, numRecordsInFile,
+                                      dbFloor, db->spatialIndex != NULL, &run );
+    if ( shrinkFile == NULL ) {
+        printf( "Error opening shrinkFile\n" );
+        return;
+    }
+    char incremental = run.base.numOriginRecords > 0;
+
+    MORTONSORT mortonSort;
+    MORTONSORT *sorter = NULL;
+    if ( mortonOrder ) {
+        if( MORTONSORT_open( &mortonSort, shrinkFile, dbPathShrink, recordSizeBytes, MORTON_SORT_MEMORY ) != 0 ) {
+            printf( "Failed to start Morton sort\n" );
+            return;
+        }
+        sorter = &mortonSort;
+    }
+
+    // a resumed incremental shrink reads records filtered before it was
+    // interrupted again, just for their main objects
+    uint64_t firstRecord = incremental ? run.base.numOriginRecords : run.numFilteredRecords;
+
+    ShrinkInput input;
+    if( openShrinkInput( &input, originFile, firstRecord, numRecordsInFile, recordSizeBytes ) != 0 ) {
+        printf( "Failed to start reading lineardb3 file\n" );
+        return;
+    }
+    ShrinkOutput output;
+    if ( openShrinkOutput( &output, shrinkFile, sorter, recordSizeBytes, &run ) != 0 ) {
+        printf( "Failed to start writing shrink file\n" );
         return;
     }
 
-    for( uint64_t i=0; i<numRecordsInFile; i++ ) {
-        numRead = fread( recordBuffer, recordSizeBytes, 1, originFile );
-        if( numRead != 1 ) {
+    const char *categoryNames[3] = { "main", "empty main", "sub" };
+    ShrinkProgress progress;
+    initShrinkProgress( &progress, dbPathShrink, run.numFilteredRecords, numRecordsInFile, 3, categoryNames );
+
+    // sub-records of a tile tend to sit close together, and all look up
+    // the same main object (empty ones look up floor, but there's one
+    // main object per tile, nothing to remember there)
+    ShrinkMemo *parentMemo = newShrinkMemo();
+    progress.memo = parentMemo;
+    progress.memoName = "main object";
+
+    // incremental only: tiles whose main object is new since last shrink
+    vector<uint64_t> newMainTiles;
+
+    // of origin records [0, i) for next watermark
+    uint64_t originChecksum = run.originChecksum;
+
+    // cheap fields of a whole batch are checked at once, only records that
+    // need a main object or floor go on to lookups
+    uint64_t i = firstRecord;
+    while( i < numRecordsInFile ) {
+        const unsigned char *batch = NULL;
+        int numInBatch = readShrinkBatch( &input, &batch, recordSizeBytes );
+        if( numInBatch <= 0 ) {
             printf( "Failed to read record from lineardb3 file\n" );
             return;
         }
+        ShrinkBatchMasks masks;
+        filterShrinkBatch( batch, numInBatch, recordSizeBytes, true, &masks );
 
-        if (recordBuffer[2] == 0 && recordBuffer[3] == 0) { // 主物品
-            if (recordBuffer[4] != 0) { // 主物品非0
-                numWritten = fwrite( recordBuffer, recordSizeBytes, 1, shrinkFile );
-                if( numWritten != 1 ) {
-                    printf( "Failed to record to temp lineardb3 truncation file\n" );
-                    return;
-                }
-            } else { // 有地板, 保留
-                recordBufferGetFloor[0] = recordBuffer[0];
-                recordBufferGetFloor[1] = recordBuffer[1];
-                int result = LINEARDB3_get( dbFloor, &recordBufferGetFloor[0], &recordBufferGetFloor[2] );
-                if (result == 0) {
-                    numWritten = fwrite( recordBuffer, recordSizeBytes, 1, shrinkFile );
-                    if( numWritten != 1 ) {
+        for( int r=0; r<numInBatch; r++, i++ ) {
+            const uint32_t *record = (const uint32_t *)&batch[ r * recordSizeBytes ];
+            char keepNow = ( masks.keepBits >> r ) & 1;
+            char needsFloor = ( masks.floorBits >> r ) & 1;
+
+            if ( i >= run.numFilteredRecords ) {
+                originChecksum = chainShrinkChecksum( originChecksum, record, recordSizeBytes );
+                char kept = keepNow ||
+                    ( needsFloor ? hasFloor( dbFloor, record ) :
+                                   memoizedLookup( parentMemo, db, record, hasMainObject ) );
+                if ( kept ) {
+                    if( writeShrinkRecord( &output, record, recordSizeBytes ) != 1 ) {
                         printf( "Failed to record to temp lineardb3 truncation file\n" );
                         return;
                     }
                 }
-            }
-        } else { // 子物品, 其他属性
-            recordBufferGet[0] = recordBuffer[0];
-            recordBufferGet[1] = recordBuffer[1];
-            recordBufferGet[2] = 0;
-            recordBufferGet[3] = 0;
-            // 获取主物品 -1 on I/O error, 0 on success, 1 on not found
-            int result = LINEARDB3_get( db, &recordBufferGet[0], &recordBufferGet[4] );
-            // 存在主物品记录且主物品非0
-            if (result == 0 && recordBufferGet[4] != 0) {
-                numWritten = fwrite( recordBuffer, recordSizeBytes, 1, shrinkFile );
-                if( numWritten != 1 ) {
-                    printf( "Failed to record to temp lineardb3 truncation file\n" );
-                    return;
+                int category = keepNow ? 0 : ( needsFloor ? 1 : 2 );
+                progress.numSeen[ category ]++;
+                progress.numKept[ category ] += kept;
+
+                if ( ( i + 1 ) % SHRINK_PROGRESS_CHECK == 0 && shrinkProgressDue( &progress ) ) {
+                    reportShrinkProgress( &progress, i + 1 );
+                    if( checkpointShrink( dbPathShrink, recordSizeBytes, &run, &output, i + 1, originChecksum ) != 0 ) {
+                        printf( "Failed to write records to shrink file\n" );
+                        return;
+                    }
                 }
             }
+
+            // non-empty main object
+            if ( incremental && keepNow ) {
+                newMainTiles.push_back( getTileOf( record ) );
+            }
+        }
+    }
+
+    ASYNCIO_closeReader( input.reader );
+
+    if ( incremental ) {
+        // 子物品依赖主物品, 主物品(值为0)依赖地板
+        // a tile's sub-records were all dropped while it had no main object
+        for( size_t t=0; t<newMainTiles.size(); t++ ) {
+            if( recheckMapTile( db, dbFloor, newMainTiles[t], false, run.base.numOriginRecords, &output ) != 0 ) {
+                printf( "Failed to re-check map.db records\n" );
+                return;
+            }
+        }
+        // and its empty main object was dropped while it had no floor
+        vector<uint64_t> newFloorTiles;
+        if( readNewFloorTiles( dbFloor, run.base.numFloorRecords, &newFloorTiles ) != 0 ) {
+            printf( "Failed to read new floor.db records\n" );
+            return;
+        }
+        for( size_t t=0; t<newFloorTiles.size(); t++ ) {
+            if( recheckMapTile( db, dbFloor, newFloorTiles[t], true, run.base.numOriginRecords, &output ) != 0 ) {
+                printf( "Failed to re-check map.db records\n" );
+                return;
+            }
         }
+        printf( "%s: %llu new records, %llu tiles re-checked, %llu records kept in all\n",
+                dbPathShrink, numRecordsInFile - run.base.numOriginRecords,
+                (uint64_t)( newMainTiles.size() + newFloorTiles.size() ), output.numKept );
+    }
+
+    reportShrinkProgress( &progress, numRecordsInFile );
+    delete progress.memo;
+
+    if( output.writer != NULL && ASYNCIO_closeWriter( output.writer ) != 0 ) {
+        printf( "Failed to write records to shrink file\n" );
+        return;
+    }
+
+    if( sorter != NULL && MORTONSORT_finish( sorter ) != 0 ) {
+        printf( "Failed to write Morton-ordered records\n" );
     }
 
     fclose( originFile );
     fclose( shrinkFile );
-    LINEARDB3_close( db );
-    LINEARDB3_close( dbFloor );
+
+    if ( archiveOutput ) {
+        printf( "Writing archive of %s...\n", dbPathShrink );
+        if ( LINEARDB3_writeArchive( dbPathShrink, 16, 4, ARCHIVE_MEMORY ) != 0 ) {
+            printf( "Failed to write archive of %s\n", dbPathShrink );
+        }
+    }
+
+    finishShrinkWatermark( dbPathShrink, recordSizeBytes, numRecordsInFile, &run, originChecksum, &output );
 }
 
 /**
@@ -163,37 +526,19 @@ void map_db_shrink() {
  * overflowBuckets: 955855
  * cnt: 72012831 / 178956972 -> 106944141
  */
-void map_time_db_shrink() {
+void map_time_db_shrink( LINEARDB3 *dbFloor ) {
 
     printf( "Generating Shrinked database...\n" );
 
-    char *dbFloorPath = "floor.db";
-
     uint32_t recordSizeBytes = 24;
     uint32_t recordBuffer[6] = { 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000 };
-    uint32_t recordBufferGetFloor[3] = { 0x00000000, 0x00000000, 0x00000000 };
     unsigned char headerBuffer[ LINEARDB3_HEADER_SIZE ];
 
-    LINEARDB3 *dbFloor = new LINEARDB3();
-    LINEARDB3_open(
-        dbFloor,
-        dbFloorPath,
-        0,
-        8000,
-        8,
-        4
-    );
-    
-    FILE *originFile = fopen( "mapTime.db", "r+b" );
+    FILE *originFile = fopen( "mapTime.db", "rb" );
     if ( originFile == NULL ) {
         printf( "Error opening originFile\n" );
         return;
     }
-    FILE *shrinkFile = fopen( "mapTime_shrink.db", "w+b" );
-    if ( shrinkFile == NULL ) {
-        printf( "Error opening shrinkFile\n" );
-        return;
-    }
 
     if( fseeko( originFile, 0, SEEK_END ) ) return;
     uint64_t fileSize = ftello( originFile );
@@ -206,105 +551,928 @@ void map_time_db_shrink() {
         return;
     }
 
-    int numWritten = fwrite( headerBuffer, LINEARDB3_HEADER_SIZE, 1, shrinkFile );
-    if( numWritten != 1 ) {
-        printf( "Failed to write header to temp lineardb3 truncation file\n" );
+    // 断点续传, 增量收缩: 只处理水位线之后追加的记录
+    ShrinkCheckpoint run;
+    FILE *shrinkFile = openShrinkRun( "mapTime_shrink.db", "mapTime.db", headerBuffer, recordSizeBytes,
+                                      numRecordsInFile, dbFloor, true, &run );
+    if ( shrinkFile == NULL ) {
+        printf( "Error opening shrinkFile\n" );
+        return;
+    }
+    char incremental = run.base.numOriginRecords > 0;
+
+    MORTONSORT mortonSort;
+    MORTONSORT *sorter = NULL;
+    if ( mortonOrder ) {
+        if( MORTONSORT_open( &mortonSort, shrinkFile, "mapTime_shrink.db", recordSizeBytes, MORTON_SORT_MEMORY ) != 0 ) {
+            printf( "Failed to start Morton sort\n" );
+            return;
+        }
+        sorter = &mortonSort;
+    }
+
+    ShrinkInput input;
+    if( openShrinkInput( &input, originFile, run.numFilteredRecords, numRecordsInFile, recordSizeBytes ) != 0 ) {
+        printf( "Failed to start reading lineardb3 file\n" );
+        return;
+    }
+    ShrinkOutput output;
+    if ( openShrinkOutput( &output, shrinkFile, sorter, recordSizeBytes, &run ) != 0 ) {
+        printf( "Failed to start writing shrink file\n" );
         return;
     }
 
-    for( uint64_t i=0; i<numRecordsInFile; i++ ) {
-        numRead = fread( recordBuffer, recordSizeBytes, 1, originFile );
-        if( numRead != 1 ) {
+    const char *categoryNames[2] = { "timed", "untimed" };
+    ShrinkProgress progress;
+    initShrinkProgress( &progress, "mapTime_shrink.db", run.numFilteredRecords, numRecordsInFile, 2, categoryNames );
+
+    // untimed records of one tile (many s, b) look up the same floor
+    ShrinkMemo *floorMemo = newShrinkMemo();
+    progress.memo = floorMemo;
+    progress.memoName = "floor";
+
+    // of origin records [0, i) for next watermark
+    uint64_t originChecksum = run.originChecksum;
+
+    // cheap fields of a whole batch are checked at once, only records with
+    // no time go on to floor lookups
+    uint64_t i = run.numFilteredRecords;
+    while( i < numRecordsInFile ) {
+        const unsigned char *batch = NULL;
+        int numInBatch = readShrinkBatch( &input, &batch, recordSizeBytes );
+        if( numInBatch <= 0 ) {
             printf( "Failed to read record from lineardb3 file\n" );
             return;
         }
+        ShrinkBatchMasks masks;
+        filterShrinkBatch( batch, numInBatch, recordSizeBytes, false, &masks );
+
+        for( int r=0; r<numInBatch; r++, i++ ) {
+            const uint32_t *record = (const uint32_t *)&batch[ r * recordSizeBytes ];
+            char keepNow = ( masks.keepBits >> r ) & 1;
+            originChecksum = chainShrinkChecksum( originChecksum, record, recordSizeBytes );
+
+            char kept = keepNow || memoizedLookup( floorMemo, dbFloor, record, hasFloor );
+            if ( kept ) {
+                if( writeShrinkRecord( &output, record, recordSizeBytes ) != 1 ) {
+                    printf( "Failed to record to temp lineardb3 truncation file\n" );
+                    return;
+                }
+            }
+            int category = keepNow ? 0 : 1;
+            progress.numSeen[ category ]++;
+            progress.numKept[ category ] += kept;
+
+            if ( ( i + 1 ) % SHRINK_PROGRESS_CHECK == 0 && shrinkProgressDue( &progress ) ) {
+                reportShrinkProgress( &progress, i + 1 );
+                if( checkpointShrink( "mapTime_shrink.db", recordSizeBytes, &run, &output, i + 1, originChecksum ) != 0 ) {
+                    printf( "Failed to write records to shrink file\n" );
+                    return;
+                }
+            }
+        }
+    }
+
+    ASYNCIO_closeReader( input.reader );
+
+    if ( incremental ) {
+        // older records with no time were dropped while their tile had no
+        // floor, there's no index on mapTime.db, so look for them in one
+        // pass over the older records, without any lookups
+        // 新地板: 扫描旧记录中时间为0且在新地板上的
+        vector<uint64_t> newFloorTiles;
+        if( readNewFloorTiles( dbFloor, run.base.numFloorRecords, &newFloorTiles ) != 0 ) {
+            printf( "Failed to read new floor.db records\n" );
+            return;
+        }
+
+        if ( newFloorTiles.size() > 0 ) {
+            unordered_set<uint64_t> floorTiles( newFloorTiles.begin(), newFloorTiles.end() );
 
-        if (recordBuffer[4] != 0 || recordBuffer[5] != 0) {
-            numWritten = fwrite( recordBuffer, recordSizeBytes, 1, shrinkFile );
-            if( numWritten != 1 ) {
-                printf( "Failed to record to temp lineardb3 truncation file\n" );
+            if( openShrinkInput( &input, originFile, 0, run.base.numOriginRecords, recordSizeBytes ) != 0 ) {
+                printf( "Failed to start reading lineardb3 file\n" );
                 return;
             }
-        } else { // 有地板, 保留
-            recordBufferGetFloor[0] = recordBuffer[0];
-            recordBufferGetFloor[1] = recordBuffer[1];
-            int result = LINEARDB3_get( dbFloor, &recordBufferGetFloor[0], &recordBufferGetFloor[2] );
-            if (result == 0) {
-                numWritten = fwrite( recordBuffer, recordSizeBytes, 1, shrinkFile );
-                if( numWritten != 1 ) {
-                    printf( "Failed to record to temp lineardb3 truncation file\n" );
+            for( uint64_t i=0; i<run.base.numOriginRecords; i++ ) {
+                if( readShrinkRecord( &input, recordBuffer, recordSizeBytes ) != 1 ) {
+                    printf( "Failed to read record from lineardb3 file\n" );
                     return;
                 }
+                if ( recordBuffer[4] == 0 && recordBuffer[5] == 0 &&
+                     floorTiles.count( getTileOf( recordBuffer ) ) > 0 &&
+                     keepMapTimeRecord( dbFloor, recordBuffer ) ) {
+                    if( writeShrinkRecord( &output, recordBuffer, recordSizeBytes ) != 1 ) {
+                        printf( "Failed to record to temp lineardb3 truncation file\n" );
+                        return;
+                    }
+                }
             }
+            ASYNCIO_closeReader( input.reader );
         }
+        printf( "mapTime_shrink.db: %llu new records, %llu new floors, %llu records kept in all\n",
+                numRecordsInFile - run.base.numOriginRecords,
+                (uint64_t)newFloorTiles.size(), output.numKept );
+    }
+
+    reportShrinkProgress( &progress, numRecordsInFile );
+    delete progress.memo;
+
+    if( output.writer != NULL && ASYNCIO_closeWriter( output.writer ) != 0 ) {
+        printf( "Failed to write records to shrink file\n" );
+        return;
+    }
+
+    if( sorter != NULL && MORTONSORT_finish( sorter ) != 0 ) {
+        printf( "Failed to write Morton-ordered records\n" );
     }
 
     fclose( originFile );
     fclose( shrinkFile );
-    LINEARDB3_close( dbFloor );
+
+    if ( archiveOutput ) {
+        printf( "Writing archive of mapTime_shrink.db...\n" );
+        if ( LINEARDB3_writeArchive( "mapTime_shrink.db", 16, 8, ARCHIVE_MEMORY ) != 0 ) {
+            printf( "Failed to write archive of mapTime_shrink.db\n" );
+        }
+    }
+
+    finishShrinkWatermark( "mapTime_shrink.db", recordSizeBytes, numRecordsInFile, &run, originChecksum, &output );
 }
 
-void map_time_db_test() {
-    LINEARDB3 *db = new LINEARDB3();
+// 1 if map.db record survives shrink
+char keepMapRecord( LINEARDB3 *db, LINEARDB3 *dbFloor, const uint32_t *record ) {
+    if (record[2] == 0 && record[3] == 0) { // 主物品
+        if (record[4] != 0) { // 主物品非0
+            return true;
+        }
+        // 有地板, 保留
+        return hasFloor( dbFloor, record );
+    }
+    // 子物品, 其他属性
+    return hasMainObject( db, record );
+}
 
-    printf( "Opening database...\n" );
+// 1 if mapTime.db record survives shrink
+char keepMapTimeRecord( LINEARDB3 *dbFloor, const uint32_t *record ) {
+    if (record[4] != 0 || record[5] != 0) {
+        return true;
+    }
+    // 有地板, 保留
+    return hasFloor( dbFloor, record );
+}
 
-    Timer t0;
-    // 文件是小端序的, 但是输入和输出都是大端, 但是元素之间是小端的(反向)
-    LINEARDB3_open(
-        db,
-        "../fsdownload/mapTime.db", // totalRecords: 178956971
-        0,
-        8000,
-        16,
-        8
-    );
-    t0.elapsed();
+// 1 if record's tile has a floor
+char hasFloor( LINEARDB3 *dbFloor, const uint32_t *record ) {
+    uint32_t recordBufferGetFloor[3] = { record[0], record[1], 0x00000000 };
+    return LINEARDB3_get( dbFloor, &recordBufferGetFloor[0], &recordBufferGetFloor[2] ) == 0;
+}
 
-    printf("maxload is %f\n", db->maxLoad);
-    printf( "Database size: %u\n", db->hashTableSizeB);
-    printf( "numBuckets: %u\n", db->hashTable->numBuckets);
-    printf( "overflowBuckets: %u\n", db->overflowBuckets->numBuckets);
+// 1 if record's tile has a non-empty main object
+char hasMainObject( LINEARDB3 *db, const uint32_t *record ) {
+    uint32_t recordBufferGet[5] = { record[0], record[1], 0x00000000, 0x00000000, 0x00000000 };
+    // 获取主物品 -1 on I/O error, 0 on success, 1 on not found
+    int result = LINEARDB3_get( db, &recordBufferGet[0], &recordBufferGet[4] );
+    // 存在主物品记录且主物品非0
+    return result == 0 && recordBufferGet[4] != 0;
+}
 
-    // key = x, y, s, b
-    // val = time
-    // uint32_t key[4] = { 0x00000000, 0x00000001, 0xffffbc91, 0x0000277a };
-    uint32_t key[4] = { 0x0000284a, 0xffffbd6b, 0x00000001, 0x00000000 };
-    uint32_t val[2] = { 0x00000000, 0x00000000 };
+// empty memo, caller deletes
+ShrinkMemo *newShrinkMemo() {
+    ShrinkMemo *memo = new ShrinkMemo;
+    memset( memo, 0, sizeof( ShrinkMemo ) );
+    return memo;
+}
 
-    // LINEARDB3_put( db, key, val );
-    LINEARDB3_get( db, key, val );
-    printf( "Key %08x, %08x, %08x, %08x\n", key[0], key[1], key[2], key[3]);
-    printf( "Val %08x, %08x            \n", val[0], val[1]);
+// lookup( db, record ) for record's tile, remembered for the next record
+// on the same tile (databases are read-only while shrinking, so a result
+// never goes stale)
+char memoizedLookup( ShrinkMemo *memo, LINEARDB3 *db, const uint32_t *record,
+                     char (*lookup)( LINEARDB3 *, const uint32_t * ) ) {
+    uint64_t tile = getTileOf( record );
+    ShrinkMemoSlot *slot = &memo->slots[ ( tile * 0x9E3779B97F4A7C15ULL ) >> ( 64 - SHRINK_MEMO_BITS ) ];
+    memo->numLookups++;
+    if ( slot->used && slot->tile == tile ) {
+        memo->numHits++;
+        return slot->result;
+    }
+    slot->tile = tile;
+    slot->result = lookup( db, record );
+    slot->used = true;
+    return slot->result;
+}
 
+// bit r set if column[r] is 0, for a column padded to whole 4-word vectors
+uint64_t getZeroMask( const uint32_t *column, int numInColumn ) {
+    uint64_t bits = 0;
+#ifdef SHRINK_FILTER_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for( int r=0; r<numInColumn; r+=4 ) {
+        __m128i words = _mm_loadu_si128( (const __m128i *)&column[r] );
+        int lanes = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( words, zero ) ) );
+        bits |= (uint64_t)lanes << r;
+    }
+#else
+    for( int r=0; r<numInColumn; r++ ) {
+        bits |= (uint64_t)( column[r] == 0 ) << r;
+    }
+#endif
+    return bits;
 }
 
-void floor_db_test() {
-    LINEARDB3 *db = new LINEARDB3();
+// decides what it can about up to SHRINK_FILTER_BATCH records from their
+// own fields: s and b (main object or sub-record, map.db only) and value,
+// transposed into columns first so they're compared 4 at a time
+void filterShrinkBatch( const unsigned char *records, int numRecords, uint32_t recordSizeBytes,
+                        char hasSubRecords, ShrinkBatchMasks *masks ) {
+    uint32_t keyTail[ SHRINK_FILTER_BATCH ];
+    uint32_t value[ SHRINK_FILTER_BATCH ];
 
-    printf( "Opening database...\n" );
+    // values are 1 word in map.db, 2 (time) in mapTime.db
+    if ( recordSizeBytes == 20 ) {
+        for( int r=0; r<numRecords; r++ ) {
+            const uint32_t *record = (const uint32_t *)&records[ r * 20 ];
+            keyTail[r] = record[2] | record[3];
+            value[r] = record[4];
+        }
+    } else {
+        for( int r=0; r<numRecords; r++ ) {
+            const uint32_t *record = (const uint32_t *)&records[ r * recordSizeBytes ];
+            keyTail[r] = record[2] | record[3];
+            value[r] = record[4] | record[5];
+        }
+    }
+    int numInColumn = ( numRecords + 3 ) & ~3;
+    for( int r=numRecords; r<numInColumn; r++ ) {
+        keyTail[r] = 0;
+        value[r] = 0;
+    }
 
-    // 文件是小端序的, 但是输入和输出都是大端
-    LINEARDB3_open(
-        db,
-        "floor.db",
-        0,
-        8000,
-        8,
-        4
-    );
+    uint64_t valid = numRecords == 64 ? ~0ULL : ( 1ULL << numRecords ) - 1;
+    uint64_t keyTailZero = getZeroMask( keyTail, numInColumn );
+    uint64_t valueZero = getZeroMask( value, numInColumn );
 
-    printf("maxload is %f\n", db->maxLoad);
-    printf( "Database size: %u\n", db->hashTableSizeB);
-    printf( "numBuckets: %u\n", db->hashTable->numBuckets);
-    printf( "overflowBuckets: %u\n", db->overflowBuckets->numBuckets);
+    if ( hasSubRecords ) {
+        // non-empty main objects kept, empty ones need a floor
+        masks->keepBits = keyTailZero & ~valueZero & valid;
+        masks->floorBits = keyTailZero & valueZero & valid;
+    } else {
+        masks->keepBits = ~valueZero & valid;
+        masks->floorBits = valueZero & valid;
+    }
+}
 
+// x, y of a key packed into one value, for tile sets
+uint64_t getTileOf( const uint32_t *key ) {
+    return (uint64_t)key[0] | ( (uint64_t)key[1] << 32 );
+}
 
-    /////
-    Timer t;
+// map.db records on one tile, older than the watermark
+typedef struct {
+    uint64_t numOldRecords;
+    char mainOnly;
+    vector<uint32_t> records;
+} TileRecheck;
 
-    // key = x, y
-    // val = oid
+int collectTileRecord( const void *key, const void *value, LINEARDB3_RecordIndex fileIndex, void *context ) {
+    TileRecheck *recheck = (TileRecheck *)context;
+    uint32_t record[5];
+    memcpy( record, key, 16 );
+    memcpy( &record[4], value, 4 );
+
+    // only empty main objects depend on floor, others were kept already
+    char isMain = record[2] == 0 && record[3] == 0;
+    char mayChange = recheck->mainOnly ? ( isMain && record[4] == 0 ) : !isMain;
+    if ( fileIndex < recheck->numOldRecords && mayChange ) {
+        recheck->records.insert( recheck->records.end(), record, record + 5 );
+    }
+    return 0;
+}
+
+// re-filters records on tile that the last shrink saw, either its main
+// object (mainOnly) or its sub-records, and writes those that survive now
+// returns 0 on success, -1 on error
+int recheckMapTile( LINEARDB3 *db, LINEARDB3 *dbFloor, uint64_t tile, char mainOnly,
+                    uint64_t numOldRecords, ShrinkOutput *output ) {
+    TileRecheck recheck;
+    recheck.numOldRecords = numOldRecords;
+    recheck.mainOnly = mainOnly;
+
+    int32_t x = (int32_t)( tile & 0xFFFFFFFF );
+    int32_t y = (int32_t)( tile >> 32 );
+
+    // collect first, filtering does lookups on the same database
+    if( LINEARDB3_getRange( db, x, y, x, y, collectTileRecord, &recheck ) < 0 ) {
+        return -1;
+    }
+
+    for( size_t r=0; r<recheck.records.size(); r+=5 ) {
+        if ( keepMapRecord( db, dbFloor, &recheck.records[r] ) &&
+             writeShrinkRecord( output, &recheck.records[r], 20 ) != 1 ) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// tiles of floor.db records from record firstRecord on
+// returns 0 on success, -1 on error
+int readNewFloorTiles( LINEARDB3 *dbFloor, uint64_t firstRecord, vector<uint64_t> *outTiles ) {
+    if ( firstRecord >= dbFloor->numRecords ) {
+        return 0;
+    }
+    FILE *floorFile = fopen( "floor.db", "rb" );
+    if ( floorFile == NULL ) {
+        return -1;
+    }
+    ShrinkInput input;
+    if( openShrinkInput( &input, floorFile, firstRecord, dbFloor->numRecords, 12 ) != 0 ) {
+        fclose( floorFile );
+        return -1;
+    }
+    uint32_t floorRecord[3];
+    int result = 0;
+    for( uint64_t i=firstRecord; i<dbFloor->numRecords; i++ ) {
+        if( readShrinkRecord( &input, floorRecord, 12 ) != 1 ) {
+            result = -1;
+            break;
+        }
+        outTiles->push_back( getTileOf( floorRecord ) );
+    }
+    ASYNCIO_closeReader( input.reader );
+    fclose( floorFile );
+    return result;
+}
+
+// FNV-1a over record bytes, chained from one record to the next, so it
+// covers their order too
+uint64_t chainShrinkChecksum( uint64_t checksum, const void *record, uint32_t recordSizeBytes ) {
+    const unsigned char *bytes = (const unsigned char *)record;
+    for( uint32_t b=0; b<recordSizeBytes; b++ ) {
+        checksum ^= bytes[b];
+        checksum *= 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+// continues checksum over records [firstRecord, endRecord) of lineardb3
+// file at path, in one sequential read, no lookups
+// returns 0 on success, -1 on read error
+int checksumShrinkRecords( const char *path, uint32_t recordSizeBytes, uint64_t firstRecord, uint64_t endRecord,
+                           uint64_t *checksum ) {
+    if ( firstRecord >= endRecord ) {
+        return 0;
+    }
+    FILE *file = fopen( path, "rb" );
+    if ( file == NULL ) {
+        return -1;
+    }
+    ShrinkInput input;
+    if( openShrinkInput( &input, file, firstRecord, endRecord, recordSizeBytes ) != 0 ) {
+        fclose( file );
+        return -1;
+    }
+    int result = 0;
+    uint64_t i = firstRecord;
+    while( i < endRecord ) {
+        const unsigned char *batch = NULL;
+        int numInBatch = readShrinkBatch( &input, &batch, recordSizeBytes );
+        if( numInBatch <= 0 ) {
+            result = -1;
+            break;
+        }
+        for( int r=0; r<numInBatch; r++ ) {
+            *checksum = chainShrinkChecksum( *checksum, &batch[ r * recordSizeBytes ], recordSizeBytes );
+        }
+        i += numInBatch;
+    }
+    ASYNCIO_closeReader( input.reader );
+    fclose( file );
+    return result;
+}
+
+// <shrinkPath><suffix> path, caller deletes
+char *getShrinkStatePath( const char *shrinkPath, const char *suffix ) {
+    char *path = new char[ strlen( shrinkPath ) + strlen( suffix ) + 1 ];
+    sprintf( path, "%s%s", shrinkPath, suffix );
+    return path;
+}
+
+// shrink state files (watermark, checkpoint) are magic, record size, then
+// numFields uint64 fields, the structs being nothing but uint64 fields
+// returns 0 if shrinkPath has a state file for recordSizeBytes records
+int readShrinkState( const char *shrinkPath, const char *suffix, const char *stateMagic,
+                     uint32_t recordSizeBytes, uint64_t *fields, int numFields ) {
+    char *path = getShrinkStatePath( shrinkPath, suffix );
+    FILE *file = fopen( path, "rb" );
+    delete [] path;
+    if ( file == NULL ) {
+        return -1;
+    }
+    char magic[4] = { 0, 0, 0, 0 };
+    uint32_t stateRecordSize = 0;
+    int numRead = fread( magic, 3, 1, file );
+    numRead += fread( &stateRecordSize, sizeof( uint32_t ), 1, file );
+    numRead += fread( fields, sizeof( uint64_t ), numFields, file );
+    fclose( file );
+
+    if ( numRead != 2 + numFields || strcmp( magic, stateMagic ) != 0 || stateRecordSize != recordSizeBytes ) {
+        return -1;
+    }
+    return 0;
+}
+
+// replaces shrinkPath's state file in one step
+// returns 0 on success, -1 on error
+int writeShrinkState( const char *shrinkPath, const char *suffix, const char *stateMagic,
+                      uint32_t recordSizeBytes, uint64_t *fields, int numFields ) {
+    char *path = getShrinkStatePath( shrinkPath, suffix );
+    char *newPath = new char[ strlen( path ) + 5 ];
+    sprintf( newPath, "%s.new", path );
+    FILE *file = fopen( newPath, "wb" );
+    int result = -1;
+    if ( file != NULL ) {
+        int numWritten = fwrite( stateMagic, 3, 1, file );
+        numWritten += fwrite( &recordSizeBytes, sizeof( uint32_t ), 1, file );
+        numWritten += fwrite( fields, sizeof( uint64_t ), numFields, file );
+        if ( fclose( file ) == 0 && numWritten == 2 + numFields ) {
+#if defined( _MSC_VER ) || defined( __MINGW32__ )
+            // rename won't replace an existing file there
+            remove( path );
+#endif
+            if ( rename( newPath, path ) == 0 ) {
+                result = 0;
+            }
+        }
+    }
+    if ( result != 0 ) {
+        remove( newPath );
+    }
+    delete [] path;
+    delete [] newPath;
+    return result;
+}
+
+void removeShrinkState( const char *shrinkPath, const char *suffix ) {
+    char *path = getShrinkStatePath( shrinkPath, suffix );
+    remove( path );
+    delete [] path;
+}
+
+// returns 0 if shrinkPath has a watermark for recordSizeBytes records
+int readShrinkWatermark( const char *shrinkPath, uint32_t recordSizeBytes, ShrinkWatermark *mark ) {
+    return readShrinkState( shrinkPath, ".wm", SHRINK_WATERMARK_MAGIC, recordSizeBytes,
+                            (uint64_t *)mark, sizeof( ShrinkWatermark ) / sizeof( uint64_t ) );
+}
+
+// opens shrink output and works out where this run starts: where an
+// interrupted run stopped, where last finished shrink left off, or from
+// scratch
+// returns NULL on error
+FILE *openShrinkRun( const char *shrinkPath, const char *originPath, unsigned char *headerBuffer,
+                     uint32_t recordSizeBytes, uint64_t numRecordsInFile, LINEARDB3 *dbFloor, char canRecheck,
+                     ShrinkCheckpoint *run ) {
+    // output goes back to append order from here, so an archive index
+    // left by an earlier --archive run no longer matches it (--archive
+    // writes a fresh one when this run finishes)
+    removeShrinkState( shrinkPath, ".idx" );
+
+    FILE *shrinkFile = resumeShrink( shrinkPath, originPath, recordSizeBytes, numRecordsInFile, dbFloor,
+                                     canRecheck, run );
+    if ( shrinkFile != NULL ) {
+        return shrinkFile;
+    }
+    removeShrinkState( shrinkPath, ".ckpt" );
+
+    ShrinkWatermark mark;
+    shrinkFile = openIncrementalShrink( shrinkPath, originPath, recordSizeBytes, numRecordsInFile, dbFloor,
+                                        canRecheck, &mark );
+    if ( shrinkFile == NULL ) {
+        shrinkFile = startFullShrink( shrinkPath, headerBuffer, &mark );
+        if ( shrinkFile == NULL ) {
+            return NULL;
+        }
+    }
+    run->base = mark;
+    run->numOriginRecords = numRecordsInFile;
+    run->numFloorRecords = dbFloor->numRecords;
+    run->numFilteredRecords = mark.numOriginRecords;
+    run->numKeptRecords = mark.numKeptRecords;
+    run->keptChecksum = mark.keptChecksum;
+    run->originChecksum = mark.originChecksum;
+
+    // floor.db records appended since, for next watermark
+    run->floorChecksum = mark.floorChecksum;
+    if ( checksumShrinkRecords( "floor.db", 12, mark.numFloorRecords, dbFloor->numRecords,
+                                &run->floorChecksum ) != 0 ) {
+        printf( "Failed to read floor.db records\n" );
+        fclose( shrinkFile );
+        return NULL;
+    }
+    return shrinkFile;
+}
+
+// reopens output of an interrupted shrink, if its checkpoint still fits:
+// not Morton order (sorted runs aren't kept), origin and floor.db as they
+// were (same counts, and same records where checksums cover them), and
+// output matching checkpoint (whatever was written after it is cut off)
+// returns NULL, with run untouched, if it can't be resumed
+FILE *resumeShrink( const char *shrinkPath, const char *originPath, uint32_t recordSizeBytes,
+                    uint64_t numRecordsInFile, LINEARDB3 *dbFloor, char canRecheck, ShrinkCheckpoint *run ) {
+    ShrinkCheckpoint checkpoint;
+    if ( mortonOrder || readShrinkState( shrinkPath, ".ckpt", SHRINK_CHECKPOINT_MAGIC, recordSizeBytes,
+                                         (uint64_t *)&checkpoint,
+                                         sizeof( ShrinkCheckpoint ) / sizeof( uint64_t ) ) != 0 ) {
+        return NULL;
+    }
+    if ( checkpoint.numOriginRecords != numRecordsInFile || checkpoint.numFloorRecords != dbFloor->numRecords ||
+         ( checkpoint.base.numOriginRecords > 0 && !canRecheck ) ) {
+        printf( "%s: checkpoint doesn't fit, not resuming\n", shrinkPath );
+        return NULL;
+    }
+    // values rewritten in place since don't change counts
+    uint64_t originChecksum = SHRINK_CHECKSUM_START;
+    uint64_t floorChecksum = SHRINK_CHECKSUM_START;
+    if ( checksumShrinkRecords( originPath, recordSizeBytes, 0, checkpoint.numFilteredRecords,
+                                &originChecksum ) != 0 ||
+         checksumShrinkRecords( "floor.db", 12, 0, checkpoint.numFloorRecords, &floorChecksum ) != 0 ||
+         originChecksum != checkpoint.originChecksum || floorChecksum != checkpoint.floorChecksum ) {
+        printf( "%s: %s or floor.db changed since checkpoint, not resuming\n", shrinkPath, originPath );
+        return NULL;
+    }
+
+    FILE *shrinkFile = fopen( shrinkPath, "r+b" );
+    if ( shrinkFile == NULL ) {
+        return NULL;
+    }
+    if ( checkShrinkOutput( shrinkFile, recordSizeBytes, checkpoint.numKeptRecords, checkpoint.keptChecksum ) != 0 ) {
+        printf( "%s doesn't match its checkpoint, not resuming\n", shrinkPath );
+        fclose( shrinkFile );
+        return NULL;
+    }
+
+    *run = checkpoint;
+    printf( "%s: resuming from record %llu of %llu\n", shrinkPath, run->numFilteredRecords, numRecordsInFile );
+    return shrinkFile;
+}
+
+// opens last shrink output for appending, if its watermark says it's
+// still good: plain (not Morton or archive) output, origin and floor.db
+// only had records appended (records the last shrink saw read back with
+// same checksums, so no value was rewritten in place), and output starts
+// with what the watermark describes
+// canRecheck says whether older records can be found again by tile
+// returns NULL, with mark untouched, if a full shrink is needed
+FILE *openIncrementalShrink( const char *shrinkPath, const char *originPath, uint32_t recordSizeBytes,
+                             uint64_t numRecordsInFile, LINEARDB3 *dbFloor, char canRecheck,
+                             ShrinkWatermark *mark ) {
+    ShrinkWatermark lastMark;
+    if ( mortonOrder || archiveOutput || readShrinkWatermark( shrinkPath, recordSizeBytes, &lastMark ) != 0 ) {
+        return NULL;
+    }
+    if ( !canRecheck || lastMark.numOriginRecords > numRecordsInFile ||
+         lastMark.numFloorRecords > dbFloor->numRecords ) {
+        printf( "%s: watermark doesn't fit, doing a full shrink\n", shrinkPath );
+        return NULL;
+    }
+    uint64_t originChecksum = SHRINK_CHECKSUM_START;
+    uint64_t floorChecksum = SHRINK_CHECKSUM_START;
+    if ( checksumShrinkRecords( originPath, recordSizeBytes, 0, lastMark.numOriginRecords, &originChecksum ) != 0 ||
+         checksumShrinkRecords( "floor.db", 12, 0, lastMark.numFloorRecords, &floorChecksum ) != 0 ||
+         originChecksum != lastMark.originChecksum || floorChecksum != lastMark.floorChecksum ) {
+        printf( "%s: %s or floor.db records changed in place since last shrink, doing a full shrink\n",
+                shrinkPath, originPath );
+        return NULL;
+    }
+
+    FILE *shrinkFile = fopen( shrinkPath, "r+b" );
+    if ( shrinkFile == NULL ) {
+        return NULL;
+    }
+    if ( checkShrinkOutput( shrinkFile, recordSizeBytes, lastMark.numKeptRecords, lastMark.keptChecksum ) != 0 ) {
+        printf( "%s doesn't match its watermark, doing a full shrink\n", shrinkPath );
+        fclose( shrinkFile );
+        return NULL;
+    }
+
+    *mark = lastMark;
+    printf( "%s: continuing from record %llu\n", shrinkPath, mark->numOriginRecords );
+    return shrinkFile;
+}
+
+// checks that shrinkFile starts with numKeptRecords records matching
+// keptChecksum, and cuts off anything after them (left by a run that was
+// interrupted)
+// returns 0 if it does
+int checkShrinkOutput( FILE *shrinkFile, uint32_t recordSizeBytes, uint64_t numKeptRecords, uint64_t keptChecksum ) {
+    uint64_t keptBytes = LINEARDB3_HEADER_SIZE + numKeptRecords * recordSizeBytes;
+    if ( fseeko( shrinkFile, 0, SEEK_END ) != 0 || (uint64_t)ftello( shrinkFile ) < keptBytes ) {
+        return -1;
+    }
+
+    // read back what was kept, cheap next to filtering it again
+    uint64_t checksum = SHRINK_CHECKSUM_START;
+    char good = true;
+    ShrinkInput input;
+    if ( numKeptRecords > 0 ) {
+        good = openShrinkInput( &input, shrinkFile, 0, numKeptRecords, recordSizeBytes ) == 0;
+        unsigned char record[ 64 ];
+        for( uint64_t i=0; good && i<numKeptRecords; i++ ) {
+            good = readShrinkRecord( &input, record, recordSizeBytes ) == 1;
+            checksum = chainShrinkChecksum( checksum, record, recordSizeBytes );
+        }
+        if ( input.reader != NULL ) {
+            ASYNCIO_closeReader( input.reader );
+        }
+    }
+    if ( !good || checksum != keptChecksum ) {
+        return -1;
+    }
+
+    if ( (uint64_t)ftello( shrinkFile ) > keptBytes ) {
+#if defined( _MSC_VER )
+        good = _chsize_s( _fileno( shrinkFile ), keptBytes ) == 0;
+#else
+        good = ftruncate( fileno( shrinkFile ), keptBytes ) == 0;
+#endif
+    }
+    return good ? 0 : -1;
+}
+
+// truncates shrink output to just the header, and forgets old watermark
+// first, so an interrupted shrink can't be mistaken for a finished one
+FILE *startFullShrink( const char *shrinkPath, unsigned char *headerBuffer, ShrinkWatermark *mark ) {
+    removeShrinkState( shrinkPath, ".wm" );
+
+    mark->numOriginRecords = 0;
+    mark->numFloorRecords = 0;
+    mark->numKeptRecords = 0;
+    mark->keptChecksum = SHRINK_CHECKSUM_START;
+    mark->originChecksum = SHRINK_CHECKSUM_START;
+    mark->floorChecksum = SHRINK_CHECKSUM_START;
+
+    FILE *shrinkFile = fopen( shrinkPath, "w+b" );
+    if ( shrinkFile == NULL ) {
+        return NULL;
+    }
+    if( fwrite( headerBuffer, LINEARDB3_HEADER_SIZE, 1, shrinkFile ) != 1 ) {
+        printf( "Failed to write header to temp lineardb3 truncation file\n" );
+        fclose( shrinkFile );
+        return NULL;
+    }
+    return shrinkFile;
+}
+
+// saves how far run got, once everything kept so far is in the file
+// (not with Morton order, where kept records sit in the sorter)
+// returns 0 on success, -1 on write error in shrink output
+int checkpointShrink( const char *shrinkPath, uint32_t recordSizeBytes, ShrinkCheckpoint *run,
+                      ShrinkOutput *output, uint64_t numFilteredRecords, uint64_t originChecksum ) {
+    if ( output->sorter != NULL ) {
+        return 0;
+    }
+    if ( ASYNCIO_flushWriter( output->writer ) != 0 ) {
+        return -1;
+    }
+    run->numFilteredRecords = numFilteredRecords;
+    run->numKeptRecords = output->numKept;
+    run->keptChecksum = output->checksum;
+    run->originChecksum = originChecksum;
+    if ( writeShrinkState( shrinkPath, ".ckpt", SHRINK_CHECKPOINT_MAGIC, recordSizeBytes,
+                           (uint64_t *)run, sizeof( ShrinkCheckpoint ) / sizeof( uint64_t ) ) != 0 ) {
+        printf( "Failed to write checkpoint for %s\n", shrinkPath );
+    }
+    return 0;
+}
+
+// after a shrink that finished, remember how far it got, unless output
+// was reordered (Morton, archive), which appending would break
+// originChecksum covers all numRecordsInFile origin records
+void finishShrinkWatermark( const char *shrinkPath, uint32_t recordSizeBytes, uint64_t numRecordsInFile,
+                            ShrinkCheckpoint *run, uint64_t originChecksum, ShrinkOutput *output ) {
+    if ( mortonOrder || archiveOutput ) {
+        removeShrinkState( shrinkPath, ".wm" );
+    } else {
+        ShrinkWatermark mark;
+        mark.numOriginRecords = numRecordsInFile;
+        mark.numFloorRecords = run->numFloorRecords;
+        mark.numKeptRecords = output->numKept;
+        mark.keptChecksum = output->checksum;
+        mark.originChecksum = originChecksum;
+        mark.floorChecksum = run->floorChecksum;
+        if ( writeShrinkState( shrinkPath, ".wm", SHRINK_WATERMARK_MAGIC, recordSizeBytes,
+                               (uint64_t *)&mark, sizeof( ShrinkWatermark ) / sizeof( uint64_t ) ) != 0 ) {
+            printf( "Failed to write watermark for %s\n", shrinkPath );
+        }
+    }
+    removeShrinkState( shrinkPath, ".ckpt" );
+}
+
+void initShrinkProgress( ShrinkProgress *progress, const char *shrinkPath, uint64_t firstRecord, uint64_t endRecord,
+                         int numCategories, const char **categoryNames ) {
+    progress->shrinkPath = shrinkPath;
+    progress->timer.reset();
+    progress->lastReportMs = 0;
+    progress->firstRecord = firstRecord;
+    progress->endRecord = endRecord;
+    progress->numCategories = numCategories;
+    progress->memo = NULL;
+    progress->memoName = NULL;
+    for( int c=0; c<numCategories; c++ ) {
+        progress->categoryNames[c] = categoryNames[c];
+        progress->numSeen[c] = 0;
+        progress->numKept[c] = 0;
+    }
+}
+
+// 1 if SHRINK_PROGRESS_MS passed since last report
+char shrinkProgressDue( ShrinkProgress *progress ) {
+    return progress->timer.elapsedMs() - progress->lastReportMs >= SHRINK_PROGRESS_MS;
+}
+
+// prints records done, rate, kept ratio by category, memo hit rate, and
+// time left 进度: 速度, 各类保留率, 缓存命中率, 剩余时间
+void reportShrinkProgress( ShrinkProgress *progress, uint64_t numDone ) {
+    long long ms = progress->timer.elapsedMs();
+    progress->lastReportMs = ms;
+
+    uint64_t numTotal = progress->endRecord - progress->firstRecord;
+    uint64_t numDoneHere = numDone - progress->firstRecord;
+    double perSecond = ms > 0 ? numDoneHere * 1000.0 / ms : 0;
+
+    char kept[ 256 ];
+    int length = 0;
+    for( int c=0; c<progress->numCategories; c++ ) {
+        double ratio = progress->numSeen[c] > 0 ? 100.0 * progress->numKept[c] / progress->numSeen[c] : 0;
+        length += snprintf( &kept[ length ], sizeof( kept ) - length, "%s%s %.1f%%",
+                            c > 0 ? ", " : "", progress->categoryNames[c], ratio );
+    }
+    if ( progress->memo != NULL ) {
+        ShrinkMemo *memo = progress->memo;
+        double hitRate = memo->numLookups > 0 ? 100.0 * memo->numHits / memo->numLookups : 0;
+        snprintf( &kept[ length ], sizeof( kept ) - length, ", %s cache hits %.1f%% of %llu",
+                  progress->memoName, hitRate, memo->numLookups );
+    }
+
+    if ( numDone < progress->endRecord ) {
+        double secondsLeft = perSecond > 0 ? ( progress->endRecord - numDone ) / perSecond : 0;
+        printf( "%s: %.1f%% (%llu / %llu), %.0f records/s, kept %s, ETA %.0f s\n",
+                progress->shrinkPath, 100.0 * numDoneHere / numTotal, numDone, progress->endRecord,
+                perSecond, kept, secondsLeft );
+    } else {
+        printf( "%s: filtered %llu records in %lld ms, %.0f records/s, kept %s\n",
+                progress->shrinkPath, numDoneHere, ms, perSecond, kept );
+    }
+}
+
+int openShrinkInput( ShrinkInput *input, FILE *originFile, uint64_t firstRecord, uint64_t endRecord, uint32_t recordSizeBytes ) {
+    input->reader = ASYNCIO_openReader(
+        fileno( originFile ),
+        LINEARDB3_HEADER_SIZE + firstRecord * recordSizeBytes,
+        LINEARDB3_HEADER_SIZE + endRecord * recordSizeBytes,
+        recordSizeBytes,
+        ASYNCIO_DEFAULT_BLOCK_BYTES,
+        ASYNCIO_DEFAULT_IN_FLIGHT
+    );
+    input->block = NULL;
+    input->numInBlock = 0;
+    input->next = 0;
+    return input->reader == NULL ? -1 : 0;
+}
+
+// copies next origin record into recordBuffer
+// returns 1 on success, like fread
+int readShrinkRecord( ShrinkInput *input, void *recordBuffer, uint32_t recordSizeBytes ) {
+    if ( input->next == input->numInBlock ) {
+        input->numInBlock = ASYNCIO_nextBlock( input->reader, &input->block );
+        input->next = 0;
+        if ( input->numInBlock <= 0 ) {
+            input->numInBlock = 0;
+            return 0;
+        }
+    }
+    memcpy( recordBuffer, &input->block[ input->next * recordSizeBytes ], recordSizeBytes );
+    input->next++;
+    return 1;
+}
+
+// next run of up to SHRINK_FILTER_BATCH records, left in place in the
+// reader's block
+// returns number of records, 0 at end, -1 on read error
+int readShrinkBatch( ShrinkInput *input, const unsigned char **outRecords, uint32_t recordSizeBytes ) {
+    if ( input->next == input->numInBlock ) {
+        input->numInBlock = ASYNCIO_nextBlock( input->reader, &input->block );
+        input->next = 0;
+        if ( input->numInBlock <= 0 ) {
+            int result = (int)input->numInBlock;
+            input->numInBlock = 0;
+            return result;
+        }
+    }
+    long long numInBatch = input->numInBlock - input->next;
+    if ( numInBatch > SHRINK_FILTER_BATCH ) {
+        numInBatch = SHRINK_FILTER_BATCH;
+    }
+    *outRecords = &input->block[ input->next * recordSizeBytes ];
+    input->next += numInBatch;
+    return (int)numInBatch;
+}
+
+// records go to shrinkFile after the header and the run->numKeptRecords
+// records already there, with writes overlapping filtering, or to sorter
+// when output goes in Morton order
+// returns 0 on success, -1 on error
+int openShrinkOutput( ShrinkOutput *output, FILE *shrinkFile, MORTONSORT *sorter, uint32_t recordSizeBytes,
+                      ShrinkCheckpoint *run ) {
+    output->writer = NULL;
+    output->sorter = sorter;
+    output->numKept = run->numKeptRecords;
+    output->checksum = run->keptChecksum;
+    if ( sorter != NULL ) {
+        return 0;
+    }
+    // header went through FILE, records go around it
+    fflush( shrinkFile );
+    output->writer = ASYNCIO_openWriter(
+        fileno( shrinkFile ),
+        LINEARDB3_HEADER_SIZE + run->numKeptRecords * recordSizeBytes,
+        ASYNCIO_DEFAULT_BLOCK_BYTES,
+        ASYNCIO_DEFAULT_IN_FLIGHT
+    );
+    return output->writer == NULL ? -1 : 0;
+}
+
+// writes one surviving record
+// returns 1 on success, like fwrite
+int writeShrinkRecord( ShrinkOutput *output, const void *record, uint32_t recordSizeBytes ) {
+    output->numKept++;
+    output->checksum = chainShrinkChecksum( output->checksum, record, recordSizeBytes );
+    if ( output->sorter != NULL ) {
+        return MORTONSORT_add( output->sorter, record ) == 0;
+    }
+    return ASYNCIO_write( output->writer, record, recordSizeBytes ) == 0;
+}
+
+void map_time_db_test() {
+    LINEARDB3 *db = new LINEARDB3();
+
+    printf( "Opening database...\n" );
+
+    Timer t0;
+    // 文件是小端序的, 但是输入和输出都是大端, 但是元素之间是小端的(反向)
+    LINEARDB3_open(
+        db,
+        "../fsdownload/mapTime.db", // totalRecords: 178956971
+        0,
+        8000,
+        16,
+        8
+    );
+    t0.elapsed();
+
+    printf("maxload is %f\n", db->maxLoad);
+    printf( "Database size: %u\n", db->hashTableSizeB);
+    printf( "numBuckets: %u\n", db->hashTable->numBuckets);
+    printf( "overflowBuckets: %u\n", db->overflowBuckets->numBuckets);
+
+    // key = x, y, s, b
+    // val = time
+    // uint32_t key[4] = { 0x00000000, 0x00000001, 0xffffbc91, 0x0000277a };
+    uint32_t key[4] = { 0x0000284a, 0xffffbd6b, 0x00000001, 0x00000000 };
+    uint32_t val[2] = { 0x00000000, 0x00000000 };
+
+    // LINEARDB3_put( db, key, val );
+    LINEARDB3_get( db, key, val );
+    printf( "Key %08x, %08x, %08x, %08x\n", key[0], key[1], key[2], key[3]);
+    printf( "Val %08x, %08x            \n", val[0], val[1]);
+
+}
+
+void floor_db_test() {
+    LINEARDB3 *db = new LINEARDB3();
+
+    printf( "Opening database...\n" );
+
+    // 文件是小端序的, 但是输入和输出都是大端
+    LINEARDB3_open(
+        db,
+        "floor.db",
+        0,
+        8000,
+        8,
+        4
+    );
+
+    printf("maxload is %f\n", db->maxLoad);
+    printf( "Database size: %u\n", db->hashTableSizeB);
+    printf( "numBuckets: %u\n", db->hashTable->numBuckets);
+    printf( "overflowBuckets: %u\n", db->overflowBuckets->numBuckets);
+
+
+    /////
+    Timer t;
+
+    // key = x, y
+    // val = oid
     uint32_t key[2] = { 0x00083d6c, 0x00100003 };
     uint32_t val[1] = { 0x00002387 };
 
@@ -327,4 +1495,573 @@ void floor_db_test() {
     /////
     t.elapsed();
 
-}
\ No newline at end of file
+}
+
+
+
+// opens dbPath with both lineardb3 and tiledb, checks they give the same
+// answer for every key in it, and for as many keys that aren't, then
+// prints how much RAM each index takes 两种引擎对比
+// returns number of disagreements, or -1 if either can't open it
+long long compare_tile_db( const char *dbPath, unsigned int keySize, unsigned int valueSize ) {
+    printf( "Opening %s with lineardb3 and tiledb...\n", dbPath );
+
+    LINEARDB3 *db = openShrinkIndex( dbPath, keySize, valueSize, 0 );
+    if ( db == NULL ) {
+        return -1;
+    }
+    TILEDB tileDB;
+    if ( TILEDB_open( &tileDB, dbPath, TILEDB_OPEN_READ_ONLY, keySize, valueSize ) != 0 ) {
+        printf( "Error opening %s with tiledb\n", dbPath );
+        TILEDB_close( &tileDB );
+        LINEARDB3_close( db );
+        delete db;
+        return -1;
+    }
+
+    Timer t;
+
+    unsigned char key[16], value[8], linearValue[8], tileValue[8];
+    long long numChecked = 0;
+    long long numFound = 0;
+    long long numWrong = 0;
+
+    TILEDB_Iterator dbi;
+    TILEDB_Iterator_init( &tileDB, &dbi );
+    while ( TILEDB_Iterator_next( &dbi, key, value ) > 0 ) {
+        // key itself, then a missing one on the same cell (other s, b)
+        // for map.db, or on a far away cell for floor.db
+        for ( int missing = 0; missing < 2; missing++ ) {
+            if ( missing ) {
+                key[ keySize - 1 ] ^= 0x5a;
+            }
+            int linearResult = LINEARDB3_get( db, key, linearValue );
+            int tileResult = TILEDB_get( &tileDB, key, tileValue );
+
+            if ( linearResult != tileResult ||
+                 ( linearResult == 0 && memcmp( linearValue, tileValue, valueSize ) != 0 ) ) {
+                numWrong++;
+            }
+            if ( linearResult == 0 ) {
+                numFound++;
+            }
+            numChecked++;
+        }
+    }
+
+    printf( "%s: %u records, %lld gets, %lld found, %lld disagree\n", dbPath,
+            TILEDB_getNumRecords( &tileDB ), numChecked, numFound, numWrong );
+
+    uint64_t linearRAM = LINEARDB3_getRAMUsage( db );
+    uint64_t tileRAM = TILEDB_getRAMUsage( &tileDB );
+    printf( "  lineardb3 index RAM: %llu bytes\n", linearRAM );
+    printf( "  tiledb index RAM:    %llu bytes (%.0f%% of lineardb3)\n", tileRAM,
+            linearRAM > 0 ? 100.0 * tileRAM / linearRAM : 0.0 );
+    t.elapsed();
+
+    TILEDB_close( &tileDB );
+    LINEARDB3_close( db );
+    delete db;
+
+    return numWrong;
+}
+
+// floor.db and map.db through both engines
+// returns 0 if they agree on both
+int tile_db_test() {
+    long long floorWrong = compare_tile_db( "floor.db", 8, 4 );
+    long long mapWrong = compare_tile_db( "map.db", 16, 4 );
+
+    if ( floorWrong != 0 || mapWrong != 0 ) {
+        printf( "lineardb3 and tiledb disagree\n" );
+        return 1;
+    }
+    return 0;
+}
+
+#define UNIQUE_TEST_RECORDS 10000
+
+// writes a floor.db-shaped file (key x, y, value = record number) where
+// keys repeat, some right across the spots where verification splits the
+// file between its threads, some half a file apart, opens it with
+// LINEARDB3_OPEN_VERIFY_UNIQUE, and checks that only the last-written
+// record of each key is left, in file order 重复key修复测试
+// returns 0 if so
+int unique_db_test() {
+    const char *dbPath = "verify_unique_test.db";
+    uint32_t numRecords = UNIQUE_TEST_RECORDS;
+
+    vector<uint32_t> keyOf( numRecords );
+    for( uint32_t i=0; i<numRecords; i++ ) {
+        keyOf[i] = i;
+    }
+    // verification hashes records [numRecords * t / numThreads,
+    // numRecords * ( t + 1 ) / numThreads) on thread t, up to 8 threads
+    for( uint32_t numThreads=2; numThreads<=8; numThreads++ ) {
+        for( uint32_t t=1; t<numThreads; t++ ) {
+            uint32_t boundary = (uint32_t)( (uint64_t)numRecords * t / numThreads );
+            keyOf[ boundary ] = keyOf[ boundary - 1 ];
+        }
+    }
+    for( uint32_t i=numRecords/2; i<numRecords; i+=7 ) {
+        keyOf[i] = keyOf[ i - numRecords/2 ];
+    }
+
+    // what should be left: last record of each key
+    vector<long long> lastIndex( numRecords, -1 );
+    for( uint32_t i=0; i<numRecords; i++ ) {
+        lastIndex[ keyOf[i] ] = i;
+    }
+    vector<uint32_t> survivors;
+    for( uint32_t i=0; i<numRecords; i++ ) {
+        if ( lastIndex[ keyOf[i] ] == i ) {
+            survivors.push_back( i );
+        }
+    }
+
+    remove( dbPath );
+    removeShrinkState( dbPath, ".wal" );
+
+    FILE *file = fopen( dbPath, "wb" );
+    if ( file == NULL ) {
+        printf( "Error creating %s\n", dbPath );
+        return 1;
+    }
+    uint32_t sizes[2] = { 8, 4 };
+    int numWritten = fwrite( "Ld2", 3, 1, file );
+    numWritten += fwrite( sizes, sizeof( sizes ), 1, file );
+    for( uint32_t i=0; i<numRecords; i++ ) {
+        uint32_t record[3] = { keyOf[i], 0x7e57, i };
+        numWritten += fwrite( record, sizeof( record ), 1, file );
+    }
+    fclose( file );
+    if ( numWritten != (int)numRecords + 2 ) {
+        printf( "Error writing %s\n", dbPath );
+        return 1;
+    }
+    uint64_t writtenSize = LINEARDB3_HEADER_SIZE + (uint64_t)numRecords * 12;
+
+    long long numWrong = 0;
+
+    // read-only only reports them, file stays as it was
+    LINEARDB3 *db = new LINEARDB3();
+    if ( LINEARDB3_open( db, dbPath, LINEARDB3_OPEN_READ_ONLY | LINEARDB3_OPEN_VERIFY_UNIQUE,
+                         8000, 8, 4 ) != 0 ) {
+        printf( "Error opening %s read-only\n", dbPath );
+        delete db;
+        return 1;
+    }
+    LINEARDB3_close( db );
+
+    file = fopen( dbPath, "rb" );
+    if ( file == NULL || fseeko( file, 0, SEEK_END ) != 0 || (uint64_t)ftello( file ) != writtenSize ) {
+        printf( "%s changed by read-only open\n", dbPath );
+        numWrong++;
+    }
+    if ( file != NULL ) {
+        fclose( file );
+    }
+
+    Timer t;
+    if ( LINEARDB3_open( db, dbPath, LINEARDB3_OPEN_VERIFY_UNIQUE, 8000, 8, 4 ) != 0 ) {
+        printf( "Error opening %s\n", dbPath );
+        delete db;
+        return 1;
+    }
+    t.elapsed();
+
+    // every key gets its last value
+    uint64_t numLeft = db->numRecords;
+    for( uint32_t k=0; k<numRecords; k++ ) {
+        if ( lastIndex[k] < 0 ) {
+            continue;
+        }
+        uint32_t key[2] = { k, 0x7e57 };
+        uint32_t value = 0;
+        if ( LINEARDB3_get( db, key, &value ) != 0 || value != lastIndex[k] ) {
+            numWrong++;
+        }
+    }
+    LINEARDB3_close( db );
+    delete db;
+
+    // and the file holds just those, in order
+    file = fopen( dbPath, "rb" );
+    if ( file == NULL || fseeko( file, 0, SEEK_END ) != 0 ||
+         (uint64_t)ftello( file ) != LINEARDB3_HEADER_SIZE + (uint64_t)survivors.size() * 12 ||
+         fseeko( file, LINEARDB3_HEADER_SIZE, SEEK_SET ) != 0 ) {
+        numWrong++;
+    } else {
+        for( size_t s=0; s<survivors.size(); s++ ) {
+            uint32_t record[3];
+            if ( fread( record, sizeof( record ), 1, file ) != 1 ||
+                 record[0] != keyOf[ survivors[s] ] || record[2] != survivors[s] ) {
+                numWrong++;
+                break;
+            }
+        }
+    }
+    if ( file != NULL ) {
+        fclose( file );
+    }
+    remove( dbPath );
+    removeShrinkState( dbPath, ".wal" );
+
+    printf( "%s: %u records written, %llu keys, %llu left, %lld wrong\n", dbPath, numRecords,
+            (uint64_t)survivors.size(), numLeft, numWrong );
+
+    if ( numLeft != survivors.size() || numWrong != 0 ) {
+        printf( "duplicate keys not removed as expected\n" );
+        return 1;
+    }
+    return 0;
+}
+
+#define CONTRACT_TEST_RECORDS 200000
+#define CONTRACT_TEST_START_SIZE ( 1 << 18 )
+
+// puts keys [firstKey, endKey) (key x, y = k, 0xc0c0, value k * 3)
+// returns number that failed
+uint32_t putContractTestKeys( LINEARDB3 *db, uint32_t firstKey, uint32_t endKey ) {
+    uint32_t numFailed = 0;
+    for( uint32_t k=firstKey; k<endKey; k++ ) {
+        uint32_t key[2] = { k, 0xc0c0 };
+        uint32_t value = k * 3;
+        if ( LINEARDB3_put( db, key, &value ) != 0 ) {
+            numFailed++;
+        }
+    }
+    return numFailed;
+}
+
+// number of keys in [firstKey, endKey) whose get doesn't give k * 3,
+// and of keys after them up to endMissing that are found anyway
+uint32_t countWrongContractValues( LINEARDB3 *db, uint32_t firstKey, uint32_t endKey, uint32_t endMissing ) {
+    uint32_t numWrong = 0;
+    for( uint32_t k=firstKey; k<endMissing; k++ ) {
+        uint32_t key[2] = { k, 0xc0c0 };
+        uint32_t value = 0;
+        int result = LINEARDB3_get( db, key, &value );
+        if ( k < endKey ? ( result != 0 || value != k * 3 ) : result != 1 ) {
+            numWrong++;
+        }
+    }
+    return numWrong;
+}
+
+// hash table and overflow pages held right now
+uint64_t getContractTestPages( LINEARDB3 *db ) {
+    return (uint64_t)db->hashTable->numPages + db->overflowBuckets->numPages;
+}
+
+// contracts db, prints what went, and checks every key so far resolves
+// returns buckets removed, -1 on error
+int64_t contractTestTable( LINEARDB3 *db, uint32_t numKeys, uint32_t *numWrong ) {
+    uint32_t sizeBefore = db->hashTableSizeB;
+    uint32_t overflowPagesBefore = db->overflowBuckets->numPages;
+    uint64_t pagesBefore = getContractTestPages( db );
+    uint64_t releasedBefore = db->numPagesReleased;
+    uint64_t ramBefore = LINEARDB3_getRAMUsage( db );
+
+    int64_t numRemoved = LINEARDB3_contract( db );
+
+    LINEARDB3_Stats stats;
+    LINEARDB3_getStats( db, &stats );
+    printf( "  maxLoad %.2f, %u records: %u buckets -> %u, pages %llu -> %llu (overflow %u -> %u), "
+            "%llu released, %llu page allocs, RAM %llu -> %llu bytes\n",
+            db->maxLoad, numKeys, sizeBefore, db->hashTableSizeB, pagesBefore, getContractTestPages( db ),
+            overflowPagesBefore, db->overflowBuckets->numPages, db->numPagesReleased - releasedBefore,
+            (uint64_t)stats.numPageAllocs, ramBefore, (uint64_t)LINEARDB3_getRAMUsage( db ) );
+
+    // released pages stay counted in page allocs (merges may have added
+    // overflow pages too)
+    if ( numRemoved != (int64_t)sizeBefore - db->hashTableSizeB ||
+         stats.numPageAllocs != db->numPagesReleased + getContractTestPages( db ) ) {
+        ( *numWrong )++;
+    }
+    *numWrong += countWrongContractValues( db, 0, numKeys, numKeys + numKeys / 8 );
+    return numRemoved;
+}
+
+// opens a table far too big for its records, contracts it, and checks
+// that every key still resolves and buckets and pages were given back,
+// then that puts still work and grow the table again, and that overflow
+// buckets left past the ones in use after that get moved down and
+// relinked 收缩测试
+// returns 0 if so
+int contract_db_test() {
+    const char *dbPath = "contract_test.db";
+    remove( dbPath );
+    removeShrinkState( dbPath, ".wal" );
+
+    LINEARDB3 *db = new LINEARDB3();
+    if ( LINEARDB3_open( db, dbPath, 0, CONTRACT_TEST_START_SIZE, 8, 4 ) != 0 ) {
+        printf( "Error opening %s\n", dbPath );
+        delete db;
+        return 1;
+    }
+    Timer t;
+    uint32_t n = CONTRACT_TEST_RECORDS;
+    uint32_t numWrong = putContractTestKeys( db, 0, n );
+    char good = true;
+
+    printf( "%s: contracting table opened with %u buckets\n", dbPath, CONTRACT_TEST_START_SIZE );
+    uint64_t releasedBefore = db->numPagesReleased;
+    good = good && contractTestTable( db, n, &numWrong ) > 0 && db->numPagesReleased > releasedBefore;
+
+    // puts still expand it
+    uint32_t contractedSize = db->hashTableSizeB;
+    numWrong += putContractTestKeys( db, n, 2 * n );
+    good = good && db->hashTableSizeB > contractedSize;
+
+    // raised maxLoad like the adaptive tuner does over its RAM budget,
+    // merged chains run into overflow buckets
+    printf( "%s: contracting after raising maxLoad\n", dbPath );
+    db->maxLoad = LINEARDB3_ADAPTIVE_LOAD_MAX;
+    good = good && contractTestTable( db, 2 * n, &numWrong ) > 0;
+
+    // lowered maxLoad, puts split those chains again, leaving overflow
+    // buckets in use past emptied ones, contract moves them down
+    printf( "%s: contracting after expanding at lowered maxLoad\n", dbPath );
+    db->maxLoad = LINEARDB3_ADAPTIVE_LOAD_MIN;
+    numWrong += putContractTestKeys( db, 2 * n, 3 * n );
+    uint32_t overflowPages = db->overflowBuckets->numPages;
+    good = good && contractTestTable( db, 3 * n, &numWrong ) == 0 &&
+        db->overflowBuckets->numPages < overflowPages;
+
+    printf( "%s: %u wrong\n", dbPath, numWrong );
+    t.elapsed();
+
+    LINEARDB3_close( db );
+    delete db;
+    remove( dbPath );
+    removeShrinkState( dbPath, ".wal" );
+
+    if ( !good || numWrong != 0 ) {
+        printf( "contract didn't work as expected\n" );
+        return 1;
+    }
+    return 0;
+}
+
+
+
+// copies srcPath to destPath, returns 0 on success
+int copy_file( const char *srcPath, const char *destPath ) {
+    FILE *src = fopen( srcPath, "rb" );
+    if ( src == NULL ) {
+        return -1;
+    }
+    FILE *dest = fopen( destPath, "wb" );
+    if ( dest == NULL ) {
+        fclose( src );
+        return -1;
+    }
+
+    int result = 0;
+    const size_t chunkSize = 16 * 1024 * 1024;
+    char *buffer = new char[ chunkSize ];
+
+    size_t numRead;
+    while ( ( numRead = fread( buffer, 1, chunkSize, src ) ) > 0 ) {
+        if ( fwrite( buffer, 1, numRead, dest ) != numRead ) {
+            result = -1;
+            break;
+        }
+    }
+    if ( ferror( src ) ) {
+        result = -1;
+    }
+
+    delete [] buffer;
+    fclose( src );
+    if ( fclose( dest ) != 0 ) {
+        result = -1;
+    }
+    return result;
+}
+
+// call latencies, bucket b counts calls taking [2^b, 2^(b+1)) ns
+// 延迟直方图 (log2分桶)
+typedef struct {
+    const char *name;
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t buckets[64];
+} LatencyHistogram;
+
+void addLatency( LatencyHistogram *hist, uint64_t nanos ) {
+    int b = 0;
+    while ( b < 63 && ( nanos >> ( b + 1 ) ) != 0 ) {
+        b++;
+    }
+    hist->buckets[b]++;
+    hist->count++;
+    hist->totalNanos += nanos;
+}
+
+// upper bound of bucket where fraction of calls is reached
+uint64_t getLatencyPercentile( LatencyHistogram *hist, double fraction ) {
+    uint64_t target = (uint64_t)( fraction * hist->count );
+    uint64_t seen = 0;
+    for ( int b = 0; b < 64; b++ ) {
+        seen += hist->buckets[b];
+        if ( seen > target ) {
+            return 2ULL << b;
+        }
+    }
+    return 0;
+}
+
+void printLatencyHistogram( LatencyHistogram *hist ) {
+    if ( hist->count == 0 ) {
+        return;
+    }
+    printf( "%s: %llu calls, mean %.0f ns, p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns\n",
+            hist->name, hist->count, (double)hist->totalNanos / hist->count,
+            getLatencyPercentile( hist, 0.5 ),
+            getLatencyPercentile( hist, 0.99 ),
+            getLatencyPercentile( hist, 0.999 ) );
+
+    for ( int b = 0; b < 64; b++ ) {
+        if ( hist->buckets[b] == 0 ) {
+            continue;
+        }
+        printf( "  [%12llu, %12llu) ns %12llu %6.2f%%\n",
+                1ULL << b, 2ULL << b, hist->buckets[b],
+                100.0 * hist->buckets[b] / hist->count );
+    }
+}
+
+/**
+ * Runs a trace captured with LINEARDB3_setTraceFile against a copy of
+ * dbPath, as fast as it will go, and reports throughput and latency.
+ * 轨迹回放: 在数据库副本上重放, 统计吞吐量和延迟
+ * The copy is removed afterwards, so dbPath itself is never changed.
+ */
+int trace_replay( const char *tracePath, const char *dbPath ) {
+    FILE *traceFile = fopen( tracePath, "rb" );
+    if ( traceFile == NULL ) {
+        printf( "Error opening %s\n", tracePath );
+        return 1;
+    }
+
+    char magic[3];
+    uint32_t sizes[2];
+    if ( fread( magic, 3, 1, traceFile ) != 1 ||
+         fread( sizes, sizeof( sizes ), 1, traceFile ) != 1 ||
+         memcmp( magic, "Lt1", 3 ) != 0 ) {
+        printf( "%s is not a lineardb3 trace\n", tracePath );
+        fclose( traceFile );
+        return 1;
+    }
+    uint32_t keySize = sizes[0];
+    uint32_t valueSize = sizes[1];
+
+    // puts would change the real database, work on a copy
+    char *copyPath = new char[ strlen( dbPath ) + 20 ];
+    sprintf( copyPath, "%s.replay", dbPath );
+
+    printf( "Copying %s to %s...\n", dbPath, copyPath );
+    if ( copy_file( dbPath, copyPath ) != 0 ) {
+        printf( "Error copying %s\n", dbPath );
+        fclose( traceFile );
+        delete [] copyPath;
+        return 1;
+    }
+
+    LINEARDB3 *db = new LINEARDB3();
+    if ( LINEARDB3_open( db, copyPath, 0, 8000, keySize, valueSize ) != 0 ) {
+        printf( "Error opening %s\n", copyPath );
+        remove( copyPath );
+        fclose( traceFile );
+        delete [] copyPath;
+        delete db;
+        return 1;
+    }
+
+    LatencyHistogram hists[4];
+    const char *names[4] = { "get", "put", "iterator init", "iterator next" };
+    for ( int i = 0; i < 4; i++ ) {
+        memset( &hists[i], 0, sizeof( LatencyHistogram ) );
+        hists[i].name = names[i];
+    }
+
+    unsigned char *key = new unsigned char[ keySize ];
+    unsigned char *value = new unsigned char[ valueSize ];
+    memset( value, 0, valueSize );
+
+    LINEARDB3_Iterator dbi;
+    LINEARDB3_Iterator_init( db, &dbi );
+
+    uint64_t traceNanos = 0;
+    uint64_t numOps = 0;
+    int result = 0;
+
+    printf( "Replaying %s...\n", tracePath );
+    chrono::steady_clock::time_point replayStart = chrono::steady_clock::now();
+
+    unsigned char op;
+    while ( fread( &op, 1, 1, traceFile ) == 1 ) {
+        if ( fread( &traceNanos, sizeof( traceNanos ), 1, traceFile ) != 1 ||
+             op < traceGet || op > traceIteratorNext ||
+             ( ( op == traceGet || op == tracePut ) &&
+               fread( key, keySize, 1, traceFile ) != 1 ) ) {
+            printf( "Trace %s is cut short or damaged after %llu calls\n",
+                    tracePath, numOps );
+            break;
+        }
+
+        chrono::steady_clock::time_point callStart = chrono::steady_clock::now();
+        int callResult = 0;
+
+        switch ( op ) {
+            case traceGet:
+                callResult = LINEARDB3_get( db, key, value );
+                break;
+            case tracePut:
+                callResult = LINEARDB3_put( db, key, value );
+                break;
+            case traceIteratorInit:
+                LINEARDB3_Iterator_init( db, &dbi );
+                break;
+            case traceIteratorNext:
+                callResult = LINEARDB3_Iterator_next( &dbi, key, value );
+                break;
+        }
+
+        uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - callStart ).count();
+
+        if ( callResult < 0 ) {
+            printf( "Call %llu failed during replay\n", numOps );
+            result = 1;
+            break;
+        }
+
+        addLatency( &hists[ op - traceGet ], nanos );
+        numOps++;
+    }
+
+    uint64_t replayNanos = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - replayStart ).count();
+
+    printf( "%llu calls in %.3f s, %.0f calls/s (trace took %.3f s to capture)\n",
+            numOps, replayNanos / 1e9,
+            replayNanos > 0 ? numOps / ( replayNanos / 1e9 ) : 0.0,
+            traceNanos / 1e9 );
+    for ( int i = 0; i < 4; i++ ) {
+        printLatencyHistogram( &hists[i] );
+    }
+
+    LINEARDB3_close( db );
+    delete db;
+    remove( copyPath );
+
+    delete [] key;
+    delete [] value;
+    delete [] copyPath;
+    fclose( traceFile );
+
+    return result;
+}
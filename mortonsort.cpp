@@ -0,0 +1,342 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "mortonsort.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+
+
+typedef struct {
+        uint64_t code;
+        // position in buffer, also keeps same-tile records in add order
+        uint64_t index;
+    } SortKey;
+
+
+
+static bool operator<( const SortKey &inA, const SortKey &inB ) {
+    if( inA.code != inB.code ) {
+        return inA.code < inB.code;
+        }
+    return inA.index < inB.index;
+    }
+
+
+
+// spreads low 32 bits of inV out to even bit positions
+static uint64_t spreadBits( uint64_t inV ) {
+    inV &= 0xFFFFFFFFULL;
+    inV = ( inV | ( inV << 16 ) ) & 0x0000FFFF0000FFFFULL;
+    inV = ( inV | ( inV << 8 ) )  & 0x00FF00FF00FF00FFULL;
+    inV = ( inV | ( inV << 4 ) )  & 0x0F0F0F0F0F0F0F0FULL;
+    inV = ( inV | ( inV << 2 ) )  & 0x3333333333333333ULL;
+    inV = ( inV | ( inV << 1 ) )  & 0x5555555555555555ULL;
+    return inV;
+    }
+
+
+
+uint64_t MORTONSORT_getCode( int32_t inX, int32_t inY ) {
+    // flip sign bit, so -1 sorts just below 0
+    uint32_t x = (uint32_t)inX ^ 0x80000000U;
+    uint32_t y = (uint32_t)inY ^ 0x80000000U;
+
+    return spreadBits( x ) | ( spreadBits( y ) << 1 );
+    }
+
+
+
+static uint64_t getRecordCode( const uint8_t *inRecord ) {
+    int32_t xy[2];
+    memcpy( xy, inRecord, sizeof( xy ) );
+    return MORTONSORT_getCode( xy[0], xy[1] );
+    }
+
+
+
+static void getRunPath( MORTONSORT *inSort, unsigned int inRun,
+                        char *outPath ) {
+    sprintf( outPath, "%s.run%u", inSort->runPathPrefix, inRun );
+    }
+
+
+
+// sorts buffered records and writes them to inFile
+// returns 0 on success, -1 on error
+static int writeSortedBuffer( MORTONSORT *inSort, FILE *inFile ) {
+    SortKey *keys = (SortKey *)inSort->sortKeys;
+
+    for( uint64_t i=0; i<inSort->numBuffered; i++ ) {
+        keys[i].code =
+            getRecordCode( &( inSort->buffer[ i * inSort->recordSize ] ) );
+        keys[i].index = i;
+        }
+
+    std::sort( keys, keys + inSort->numBuffered );
+
+    for( uint64_t i=0; i<inSort->numBuffered; i++ ) {
+        int numWritten =
+            fwrite( &( inSort->buffer[ keys[i].index * inSort->recordSize ] ),
+                    inSort->recordSize, 1, inFile );
+        if( numWritten != 1 ) {
+            return -1;
+            }
+        }
+
+    inSort->numBuffered = 0;
+    return 0;
+    }
+
+
+
+// spills buffered records to a new run file
+// returns 0 on success, -1 on error
+static int spillRun( MORTONSORT *inSort ) {
+    char *path = new char[ strlen( inSort->runPathPrefix ) + 20 ];
+    getRunPath( inSort, inSort->numRuns, path );
+
+    FILE *runFile = fopen( path, "wb" );
+    delete [] path;
+
+    if( runFile == NULL ) {
+        return -1;
+        }
+
+    inSort->numRuns++;
+
+    int result = writeSortedBuffer( inSort, runFile );
+
+    if( fclose( runFile ) != 0 ) {
+        result = -1;
+        }
+    return result;
+    }
+
+
+
+int MORTONSORT_open( MORTONSORT *inSort, FILE *inOutFile,
+                     const char *inRunPathPrefix,
+                     unsigned int inRecordSize, uint64_t inMemoryBytes ) {
+
+    inSort->outFile = inOutFile;
+    inSort->recordSize = inRecordSize;
+    inSort->numBuffered = 0;
+    inSort->numRuns = 0;
+    inSort->numRecords = 0;
+
+    inSort->runPathPrefix = new char[ strlen( inRunPathPrefix ) + 1 ];
+    strcpy( inSort->runPathPrefix, inRunPathPrefix );
+
+    // record plus its sort key
+    inSort->bufferCapacity =
+        inMemoryBytes / ( inRecordSize + sizeof( SortKey ) );
+
+    if( inSort->bufferCapacity < 2 ) {
+        inSort->bufferCapacity = 2;
+        }
+
+    inSort->buffer =
+        (uint8_t *)malloc( inSort->bufferCapacity * inRecordSize );
+    inSort->sortKeys = malloc( inSort->bufferCapacity * sizeof( SortKey ) );
+
+    if( inSort->buffer == NULL || inSort->sortKeys == NULL ) {
+        free( inSort->buffer );
+        free( inSort->sortKeys );
+        delete [] inSort->runPathPrefix;
+        return -1;
+        }
+
+    return 0;
+    }
+
+
+
+int MORTONSORT_add( MORTONSORT *inSort, const void *inRecord ) {
+    if( inSort->numBuffered == inSort->bufferCapacity ) {
+        if( spillRun( inSort ) != 0 ) {
+            return -1;
+            }
+        }
+
+    memcpy( &( inSort->buffer[ inSort->numBuffered * inSort->recordSize ] ),
+            inRecord, inSort->recordSize );
+    inSort->numBuffered++;
+    inSort->numRecords++;
+
+    return 0;
+    }
+
+
+
+// one run being merged, reads through its own slice of buffer
+typedef struct {
+        FILE *file;
+        uint8_t *buffer;
+        uint64_t capacity;
+        uint64_t numInBuffer;
+        uint64_t next;
+    } RunReader;
+
+
+
+// returns pointer to run's next record, or NULL when run is used up
+// sets *outError on read error
+static const uint8_t *peekRun( RunReader *inRun, unsigned int inRecordSize,
+                               char *outError ) {
+    if( inRun->next == inRun->numInBuffer ) {
+        inRun->numInBuffer = fread( inRun->buffer, inRecordSize,
+                                    inRun->capacity, inRun->file );
+        inRun->next = 0;
+
+        if( inRun->numInBuffer == 0 ) {
+            if( ferror( inRun->file ) ) {
+                *outError = true;
+                }
+            return NULL;
+            }
+        }
+    return &( inRun->buffer[ inRun->next * inRecordSize ] );
+    }
+
+
+
+// k-way merge of all runs into output file
+// 多路归并
+static int mergeRuns( MORTONSORT *inSort ) {
+    unsigned int numRuns = inSort->numRuns;
+
+    // whole record buffer is free now, split it between runs
+    uint64_t perRun = inSort->bufferCapacity / numRuns;
+
+    if( perRun == 0 ) {
+        // tiny budget, more runs than buffered records, 
+        // give each run room for one
+        perRun = 1;
+        
+        free( inSort->buffer );
+        inSort->buffer =
+            (uint8_t *)malloc( perRun * numRuns * inSort->recordSize );
+
+        if( inSort->buffer == NULL ) {
+            return -1;
+            }
+        inSort->bufferCapacity = perRun * numRuns;
+        }
+
+    std::vector<RunReader> runs( numRuns );
+
+    char *path = new char[ strlen( inSort->runPathPrefix ) + 20 ];
+    int result = 0;
+
+    for( unsigned int r=0; r<numRuns; r++ ) {
+        getRunPath( inSort, r, path );
+
+        runs[r].file = fopen( path, "rb" );
+        runs[r].buffer = &( inSort->buffer[ r * perRun * inSort->recordSize ] );
+        runs[r].capacity = perRun;
+        runs[r].numInBuffer = 0;
+        runs[r].next = 0;
+
+        if( runs[r].file == NULL ) {
+            result = -1;
+            }
+        }
+    delete [] path;
+
+
+    // min-heap of ( code, run ), ties go to earlier run, so
+    // same-tile records stay in add order
+    typedef std::pair<uint64_t, unsigned int> HeapEntry;
+
+    std::priority_queue< HeapEntry, std::vector<HeapEntry>,
+                         std::greater<HeapEntry> > heap;
+
+    char readError = false;
+
+    for( unsigned int r=0; r<numRuns && result == 0; r++ ) {
+        const uint8_t *record =
+            peekRun( &( runs[r] ), inSort->recordSize, &readError );
+
+        if( record != NULL ) {
+            heap.push( HeapEntry( getRecordCode( record ), r ) );
+            }
+        }
+
+    while( ! heap.empty() && result == 0 ) {
+        unsigned int r = heap.top().second;
+        heap.pop();
+
+        RunReader *run = &( runs[r] );
+
+        int numWritten =
+            fwrite( &( run->buffer[ run->next * inSort->recordSize ] ),
+                    inSort->recordSize, 1, inSort->outFile );
+        if( numWritten != 1 ) {
+            result = -1;
+            break;
+            }
+        run->next++;
+
+        const uint8_t *record =
+            peekRun( run, inSort->recordSize, &readError );
+
+        if( record != NULL ) {
+            heap.push( HeapEntry( getRecordCode( record ), r ) );
+            }
+        }
+
+    if( readError ) {
+        result = -1;
+        }
+
+    for( unsigned int r=0; r<numRuns; r++ ) {
+        if( runs[r].file != NULL ) {
+            fclose( runs[r].file );
+            }
+        }
+
+    return result;
+    }
+
+
+
+int MORTONSORT_finish( MORTONSORT *inSort ) {
+    int result = 0;
+
+    if( inSort->numRuns == 0 ) {
+        // everything fit in RAM, no runs needed
+        result = writeSortedBuffer( inSort, inSort->outFile );
+        }
+    else {
+        if( inSort->numBuffered > 0 ) {
+            result = spillRun( inSort );
+            }
+
+        if( result == 0 ) {
+            result = mergeRuns( inSort );
+            }
+
+        char *path = new char[ strlen( inSort->runPathPrefix ) + 20 ];
+
+        for( unsigned int r=0; r<inSort->numRuns; r++ ) {
+            getRunPath( inSort, r, path );
+            remove( path );
+            }
+        delete [] path;
+        }
+
+    free( inSort->buffer );
+    free( inSort->sortKeys );
+    delete [] inSort->runPathPrefix;
+
+    inSort->buffer = NULL;
+    inSort->sortKeys = NULL;
+    inSort->runPathPrefix = NULL;
+
+    return result;
+    }
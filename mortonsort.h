@@ -0,0 +1,84 @@
+#ifndef MORTONSORT_H_INCLUDED
+#define MORTONSORT_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+// External sort of fixed-size lineardb3 records into Z-order (Morton order)
+// of their tile coordinates, the first two int32s of each key.
+// Records on neighboring tiles end up near each other in the output file.
+// Records on the same tile keep the order they were added in.
+// 按(x,y)的Z序(Morton序)对记录做外部排序
+//
+// Memory use is bounded: records are collected in RAM, and whenever the
+// budget fills they are sorted and spilled to a run file next to the
+// output.  At the end, runs are merged into the output file.
+
+
+
+// Z-order position of tile (x, y), bits of x and y interleaved
+// x and y are offset so that negative coordinates sort below positive ones
+uint64_t MORTONSORT_getCode( int32_t inX, int32_t inY );
+
+
+
+typedef struct {
+        FILE *outFile;
+
+        // run files are named inRunPathPrefix.run0, .run1, ...
+        char *runPathPrefix;
+
+        unsigned int recordSize;
+
+        // records held in RAM before spilling a run
+        uint8_t *buffer;
+        uint64_t bufferCapacity;
+        uint64_t numBuffered;
+
+        // (code, position in buffer) per buffered record, sorted before spill
+        void *sortKeys;
+
+        unsigned int numRuns;
+
+        uint64_t numRecords;
+    } MORTONSORT;
+
+
+
+/**
+ * Start a sort.
+ *
+ * @param inOutFile output, records are written at its current position
+ *   by MORTONSORT_finish
+ * @param inRunPathPrefix path prefix for temporary run files
+ * @param inRecordSize key + value bytes, key at least 8 bytes
+ * @param inMemoryBytes RAM budget for buffered records
+ * @return 0 on success, -1 on error
+ */
+int MORTONSORT_open( MORTONSORT *inSort, FILE *inOutFile,
+                     const char *inRunPathPrefix,
+                     unsigned int inRecordSize, uint64_t inMemoryBytes );
+
+
+
+/**
+ * Add one record (inRecordSize bytes).
+ *
+ * @return 0 on success, -1 on error writing a run file
+ */
+int MORTONSORT_add( MORTONSORT *inSort, const void *inRecord );
+
+
+
+/**
+ * Write every added record to the output file in Z-order, remove run
+ * files, and free the sort.
+ *
+ * @return 0 on success, -1 on I/O error
+ */
+int MORTONSORT_finish( MORTONSORT *inSort );
+
+
+
+#endif
@@ -0,0 +1,818 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "tiledb.h"
+#include "asyncio.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define fseeko fseeko64
+#define ftello ftello64
+#endif
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#include <sys/mman.h>
+#define TILEDB_HAS_MMAP
+#endif
+
+
+
+// same file format as lineardb3: "Ld2", uint32 key size, uint32 value size
+#define TILEDB_HEADER_SIZE 11
+
+static const char *magicString = "Ld2";
+
+#define NO_RECORD ( (TILEDB_RecordIndex)-1 )
+
+#define BITS_PER_WORD 64
+
+
+#include "murmurhash2_64.cpp"
+
+
+// 8-bit tag of key past x, y, long keys only
+static inline uint8_t getRestTag( TILEDB *inDB, const void *inKey ) {
+    return (uint8_t)( MurmurHash64( (const uint8_t *)inKey + 8,
+                                    inDB->keySize - 8, 0x5d8e6c1b ) >> 56 );
+    }
+
+
+
+static inline unsigned int countBits( uint64_t inV ) {
+#if defined( __GNUC__ )
+    return __builtin_popcountll( inV );
+#else
+    inV = inV - ( ( inV >> 1 ) & 0x5555555555555555ULL );
+    inV = ( inV & 0x3333333333333333ULL ) +
+        ( ( inV >> 2 ) & 0x3333333333333333ULL );
+    inV = ( inV + ( inV >> 4 ) ) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned int)( ( inV * 0x0101010101010101ULL ) >> 56 );
+#endif
+    }
+
+
+
+// tile coordinate of x or y, rounded down for negative ones too
+static inline int32_t getTileCoord( int32_t inC ) {
+    if( inC >= 0 ) {
+        return inC >> TILEDB_TILE_BITS;
+        }
+    return -(int32_t)( ( ( -(int64_t)inC - 1 ) >> TILEDB_TILE_BITS ) + 1 );
+    }
+
+
+
+static inline void getKeyCoords( const void *inKey,
+                                  int32_t *outX, int32_t *outY ) {
+    int32_t xy[2];
+    memcpy( xy, inKey, sizeof( xy ) );
+    *outX = xy[0];
+    *outY = xy[1];
+    }
+
+
+
+// cell number of x, y within its tile
+static inline unsigned int getCell( int32_t inX, int32_t inY ) {
+    unsigned int cx = (uint32_t)inX & ( TILEDB_TILE_SIZE - 1 );
+    unsigned int cy = (uint32_t)inY & ( TILEDB_TILE_SIZE - 1 );
+    return cx + TILEDB_TILE_SIZE * cy;
+    }
+
+
+
+static inline char isCellOccupied( TILEDB_Tile *inTile, unsigned int inCell ) {
+    return ( inTile->occupied[ inCell / BITS_PER_WORD ] >>
+             ( inCell % BITS_PER_WORD ) ) & 1;
+    }
+
+
+
+// position of inCell in tile's cells array: number of occupied cells
+// before it 秩: 该格之前被占用的格数
+static inline unsigned int getCellRank( TILEDB_Tile *inTile,
+                                        unsigned int inCell ) {
+    unsigned int word = inCell / BITS_PER_WORD;
+    unsigned int bit = inCell % BITS_PER_WORD;
+
+    unsigned int rank = 0;
+
+    for( unsigned int w=0; w<word; w++ ) {
+        rank += countBits( inTile->occupied[w] );
+        }
+
+    uint64_t below = ( (uint64_t)1 << bit ) - 1;
+
+    return rank + countBits( inTile->occupied[ word ] & below );
+    }
+
+
+
+static inline uint64_t getTileTableStart( TILEDB *inDB,
+                                          int32_t inTileX, int32_t inTileY ) {
+    // mix x and y bits together, neighboring tiles differ in few bits
+    uint64_t h = ( (uint64_t)(uint32_t)inTileX << 32 ) | (uint32_t)inTileY;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & ( inDB->tableSize - 1 );
+    }
+
+
+
+// table slot holding tile, or empty slot where it would go
+static TILEDB_Tile *findTile( TILEDB *inDB, int32_t inTileX, int32_t inTileY ) {
+    uint64_t pos = getTileTableStart( inDB, inTileX, inTileY );
+
+    while( true ) {
+        TILEDB_Tile *tile = &( inDB->tiles[ pos ] );
+
+        if( tile->cells == NULL ||
+            ( tile->tileX == inTileX && tile->tileY == inTileY ) ) {
+            return tile;
+            }
+        pos = ( pos + 1 ) & ( inDB->tableSize - 1 );
+        }
+    }
+
+
+
+// returns 0 on success, -1 if out of memory
+static int allocTileTable( TILEDB *inDB, uint64_t inTableSize ) {
+    inDB->tiles =
+        (TILEDB_Tile *)calloc( inTableSize, sizeof( TILEDB_Tile ) );
+
+    if( inDB->tiles == NULL ) {
+        return -1;
+        }
+    inDB->tableSize = inTableSize;
+    return 0;
+    }
+
+
+
+// doubles tile table, returns 0 on success, -1 if out of memory
+static int growTileTable( TILEDB *inDB ) {
+    TILEDB_Tile *oldTiles = inDB->tiles;
+    uint64_t oldSize = inDB->tableSize;
+
+    if( allocTileTable( inDB, 2 * oldSize ) != 0 ) {
+        inDB->tiles = oldTiles;
+        return -1;
+        }
+
+    for( uint64_t i=0; i<oldSize; i++ ) {
+        if( oldTiles[i].cells != NULL ) {
+            *findTile( inDB, oldTiles[i].tileX, oldTiles[i].tileY ) =
+                oldTiles[i];
+            }
+        }
+
+    free( oldTiles );
+    return 0;
+    }
+
+
+
+// tile for x, y, added if it isn't there yet
+// returns NULL if out of memory
+static TILEDB_Tile *getOrAddTile( TILEDB *inDB, int32_t inX, int32_t inY ) {
+    int32_t tileX = getTileCoord( inX );
+    int32_t tileY = getTileCoord( inY );
+
+    TILEDB_Tile *tile = findTile( inDB, tileX, tileY );
+
+    if( tile->cells != NULL ) {
+        return tile;
+        }
+
+    // keep table at most half full
+    if( 2 * ( inDB->numTiles + 1 ) > inDB->tableSize ) {
+        if( growTileTable( inDB ) != 0 ) {
+            return NULL;
+            }
+        tile = findTile( inDB, tileX, tileY );
+        }
+
+    tile->cells =
+        (TILEDB_RecordIndex *)malloc( 4 * sizeof( TILEDB_RecordIndex ) );
+
+    if( tile->cells == NULL ) {
+        return NULL;
+        }
+
+    tile->tileX = tileX;
+    tile->tileY = tileY;
+    memset( tile->occupied, 0, sizeof( tile->occupied ) );
+    tile->numCells = 0;
+    tile->cellsCapacity = 4;
+
+    inDB->numTiles++;
+
+    return tile;
+    }
+
+
+
+// marks inCell occupied, holding record inIndex
+// returns 0 on success, -1 if out of memory
+static int addCell( TILEDB_Tile *inTile, unsigned int inCell,
+                    TILEDB_RecordIndex inIndex ) {
+    if( inTile->numCells == inTile->cellsCapacity ) {
+        unsigned int newCapacity = 2 * inTile->cellsCapacity;
+
+        if( newCapacity > TILEDB_CELLS_PER_TILE ) {
+            newCapacity = TILEDB_CELLS_PER_TILE;
+            }
+
+        TILEDB_RecordIndex *newCells = (TILEDB_RecordIndex *)
+            realloc( inTile->cells, newCapacity * sizeof( TILEDB_RecordIndex ) );
+
+        if( newCells == NULL ) {
+            return -1;
+            }
+        inTile->cells = newCells;
+        inTile->cellsCapacity = (uint16_t)newCapacity;
+        }
+
+    unsigned int rank = getCellRank( inTile, inCell );
+
+    // keep cells in cell order
+    memmove( &( inTile->cells[ rank + 1 ] ), &( inTile->cells[ rank ] ),
+             ( inTile->numCells - rank ) * sizeof( TILEDB_RecordIndex ) );
+
+    inTile->cells[ rank ] = inIndex;
+    inTile->numCells++;
+
+    inTile->occupied[ inCell / BITS_PER_WORD ] |=
+        (uint64_t)1 << ( inCell % BITS_PER_WORD );
+
+    return 0;
+    }
+
+
+
+// sets next-older record of inIndex on its cell, and tag of rest of its
+// key, long keys only
+// returns 0 on success, -1 if out of memory
+static int setChainEntry( TILEDB *inDB, TILEDB_RecordIndex inIndex,
+                          TILEDB_RecordIndex inNext, uint8_t inTag ) {
+    if( inIndex >= inDB->nextCapacity ) {
+        uint64_t newCapacity = 2 * inDB->nextCapacity;
+
+        if( newCapacity <= inIndex ) {
+            newCapacity = (uint64_t)inIndex + 1;
+            }
+
+        TILEDB_RecordIndex *newNext = (TILEDB_RecordIndex *)
+            realloc( inDB->next, newCapacity * sizeof( TILEDB_RecordIndex ) );
+
+        if( newNext == NULL ) {
+            return -1;
+            }
+        inDB->next = newNext;
+
+        uint8_t *newTags = (uint8_t *)realloc( inDB->restTags, newCapacity );
+
+        if( newTags == NULL ) {
+            return -1;
+            }
+        inDB->restTags = newTags;
+        inDB->nextCapacity = newCapacity;
+        }
+
+    inDB->next[ inIndex ] = inNext;
+    inDB->restTags[ inIndex ] = inTag;
+    return 0;
+    }
+
+
+
+// adds new record inIndex with key inKey to index, in front of any
+// other records on its cell
+// returns 0 on success, -1 if out of memory
+static int indexRecord( TILEDB *inDB, TILEDB_RecordIndex inIndex,
+                        const void *inKey ) {
+    int32_t x, y;
+    getKeyCoords( inKey, &x, &y );
+
+    TILEDB_Tile *tile = getOrAddTile( inDB, x, y );
+
+    if( tile == NULL ) {
+        return -1;
+        }
+
+    unsigned int cell = getCell( x, y );
+
+    uint8_t tag = 0;
+
+    if( inDB->next != NULL ) {
+        tag = getRestTag( inDB, inKey );
+        }
+
+    if( ! isCellOccupied( tile, cell ) ) {
+        if( inDB->next != NULL && 
+            setChainEntry( inDB, inIndex, NO_RECORD, tag ) != 0 ) {
+            return -1;
+            }
+        return addCell( tile, cell, inIndex );
+        }
+
+    TILEDB_RecordIndex *head = &( tile->cells[ getCellRank( tile, cell ) ] );
+
+    if( inDB->next != NULL ) {
+        // chain newest first
+        if( setChainEntry( inDB, inIndex, *head, tag ) != 0 ) {
+            return -1;
+            }
+        }
+    // else same 8-byte key again, newer record wins
+
+    *head = inIndex;
+    return 0;
+    }
+
+
+
+static inline uint64_t getRecordPos( TILEDB *inDB,
+                                     TILEDB_RecordIndex inIndex ) {
+    return TILEDB_HEADER_SIZE + (uint64_t)inIndex * inDB->recordSizeBytes;
+    }
+
+
+
+// moves data file to inPos, unless it's there already
+// returns 0 on success, -1 on error
+static int seekTo( TILEDB *inDB, uint64_t inPos, char inForWrite ) {
+    // still need to seek when switching between reads and writes
+    if( inDB->lastWasWrite == inForWrite &&
+        ftello( inDB->file ) == (off_t)inPos ) {
+        return 0;
+        }
+    if( fseeko( inDB->file, inPos, SEEK_SET ) ) {
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+// reads inNumBytes starting inOffset bytes into record inIndex
+// returns 0 on success, -1 on error
+static int readRecordPart( TILEDB *inDB, TILEDB_RecordIndex inIndex,
+                           unsigned int inOffset, unsigned int inNumBytes,
+                           void *outBuffer ) {
+    uint64_t pos = getRecordPos( inDB, inIndex ) + inOffset;
+
+    if( inDB->mappedFile != NULL ) {
+        memcpy( outBuffer, &( inDB->mappedFile[ pos ] ), inNumBytes );
+        return 0;
+        }
+
+    if( seekTo( inDB, pos, false ) != 0 ) {
+        return -1;
+        }
+
+    int numRead = fread( outBuffer, inNumBytes, 1, inDB->file );
+    inDB->lastWasWrite = false;
+
+    if( numRead != 1 ) {
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+// writes inNumBytes starting inOffset bytes into record inIndex
+// returns 0 on success, -1 on error
+static int writeRecordPart( TILEDB *inDB, TILEDB_RecordIndex inIndex,
+                            unsigned int inOffset, unsigned int inNumBytes,
+                            const void *inData ) {
+    if( seekTo( inDB, getRecordPos( inDB, inIndex ) + inOffset,
+                true ) != 0 ) {
+        return -1;
+        }
+
+    int numWritten = fwrite( inData, inNumBytes, 1, inDB->file );
+    inDB->lastWasWrite = true;
+
+    if( numWritten != 1 ) {
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+// finds record holding inKey
+// returns 0 and sets *outIndex if found, 1 if not, -1 on read error
+static int findRecord( TILEDB *inDB, const void *inKey,
+                       TILEDB_RecordIndex *outIndex ) {
+    int32_t x, y;
+    getKeyCoords( inKey, &x, &y );
+
+    TILEDB_Tile *tile = findTile( inDB, getTileCoord( x ), getTileCoord( y ) );
+
+    if( tile->cells == NULL ) {
+        return 1;
+        }
+
+    unsigned int cell = getCell( x, y );
+
+    if( ! isCellOccupied( tile, cell ) ) {
+        return 1;
+        }
+
+    TILEDB_RecordIndex r = tile->cells[ getCellRank( tile, cell ) ];
+
+    if( inDB->next == NULL ) {
+        // x, y is whole key, no need to look at data file
+        *outIndex = r;
+        return 0;
+        }
+
+    // rest of key
+    unsigned int restSize = inDB->keySize - 8;
+    const uint8_t *rest = (const uint8_t *)inKey + 8;
+    uint8_t tag = getRestTag( inDB, inKey );
+
+    for( ; r != NO_RECORD; r = inDB->next[ r ] ) {
+
+        if( inDB->restTags[ r ] != tag ) {
+            // can't be this one, skip data file read
+            continue;
+            }
+
+        if( inDB->mappedFile != NULL ) {
+            // no shared buffer, so concurrent read-only gets are safe
+            if( memcmp( &( inDB->mappedFile[ getRecordPos( inDB, r ) + 8 ] ),
+                        rest, restSize ) == 0 ) {
+                *outIndex = r;
+                return 0;
+                }
+            continue;
+            }
+
+        if( readRecordPart( inDB, r, 8, restSize, inDB->recordBuffer ) != 0 ) {
+            return -1;
+            }
+        if( memcmp( inDB->recordBuffer, rest, restSize ) == 0 ) {
+            *outIndex = r;
+            return 0;
+            }
+        }
+    return 1;
+    }
+
+
+
+// maps whole data file for read-only mode, or reads it into RAM where
+// mmap isn't available
+// returns 0 on success, -1 on error
+static int mapFile( TILEDB *inDB, uint64_t inSize ) {
+#ifdef TILEDB_HAS_MMAP
+    void *mapped = mmap( NULL, inSize, PROT_READ, MAP_SHARED,
+                         fileno( inDB->file ), 0 );
+
+    if( mapped == MAP_FAILED ) {
+        return -1;
+        }
+#else
+    uint8_t *mapped = new uint8_t[ inSize ];
+
+    if( fseeko( inDB->file, 0, SEEK_SET ) ||
+        fread( mapped, inSize, 1, inDB->file ) != 1 ) {
+        delete [] mapped;
+        return -1;
+        }
+#endif
+
+    inDB->mappedFile = (uint8_t *)mapped;
+    inDB->mappedFileSize = inSize;
+    return 0;
+    }
+
+
+
+// indexes every record in file, streaming it in big blocks unless mapped
+// returns 0 on success, -1 on error
+static int indexFile( TILEDB *inDB, TILEDB_RecordIndex inNumRecords ) {
+    if( inDB->mappedFile != NULL ) {
+        for( TILEDB_RecordIndex i=0; i<inNumRecords; i++ ) {
+            if( indexRecord( inDB, i,
+                             &( inDB->mappedFile[ getRecordPos( inDB, i ) ] ) )
+                != 0 ) {
+                return -1;
+                }
+            }
+        return 0;
+        }
+
+    ASYNCIO_Reader *reader = ASYNCIO_openReader(
+        fileno( inDB->file ), TILEDB_HEADER_SIZE,
+        getRecordPos( inDB, inNumRecords ), inDB->recordSizeBytes,
+        ASYNCIO_DEFAULT_BLOCK_BYTES, ASYNCIO_DEFAULT_IN_FLIGHT );
+
+    if( reader == NULL ) {
+        return -1;
+        }
+
+    TILEDB_RecordIndex i = 0;
+    const uint8_t *block;
+    int64_t numInBlock;
+    int result = 0;
+
+    while( result == 0 &&
+           ( numInBlock = ASYNCIO_nextBlock( reader, &block ) ) > 0 ) {
+
+        for( int64_t b=0; b<numInBlock && result == 0; b++ ) {
+            result = indexRecord( inDB, i,
+                                  &( block[ b * inDB->recordSizeBytes ] ) );
+            i++;
+            }
+        }
+
+    ASYNCIO_closeReader( reader );
+
+    if( result != 0 || i != inNumRecords ) {
+        return -1;
+        }
+    return 0;
+    }
+
+
+
+int TILEDB_open( TILEDB *inDB, const char *inPath, int inMode,
+                 unsigned int inKeySize, unsigned int inValueSize ) {
+
+    inDB->keySize = inKeySize;
+    inDB->valueSize = inValueSize;
+    inDB->recordSizeBytes = inKeySize + inValueSize;
+    inDB->numRecords = 0;
+    inDB->file = NULL;
+    inDB->lastWasWrite = false;
+    inDB->recordBuffer = NULL;
+    inDB->tiles = NULL;
+    inDB->tableSize = 0;
+    inDB->numTiles = 0;
+    inDB->next = NULL;
+    inDB->restTags = NULL;
+    inDB->nextCapacity = 0;
+    inDB->readOnly = ( inMode & TILEDB_OPEN_READ_ONLY ) != 0;
+    inDB->mappedFile = NULL;
+    inDB->mappedFileSize = 0;
+
+    if( inKeySize < 8 ) {
+        printf( "Tiledb keys must start with int32 x and y\n" );
+        return 1;
+        }
+
+    if( inDB->readOnly ) {
+        inDB->file = fopen( inPath, "rb" );
+        }
+    else {
+        inDB->file = fopen( inPath, "r+b" );
+
+        if( inDB->file == NULL ) {
+            // doesn't exist yet
+            inDB->file = fopen( inPath, "w+b" );
+            }
+        }
+
+    if( inDB->file == NULL ) {
+        return 1;
+        }
+
+    inDB->recordBuffer = new uint8_t[ inDB->recordSizeBytes ];
+
+    if( allocTileTable( inDB, 1024 ) != 0 ) {
+        return 1;
+        }
+
+    if( inKeySize > 8 ) {
+        inDB->nextCapacity = 1024;
+        inDB->next = (TILEDB_RecordIndex *)
+            malloc( inDB->nextCapacity * sizeof( TILEDB_RecordIndex ) );
+        inDB->restTags = (uint8_t *)malloc( inDB->nextCapacity );
+
+        if( inDB->next == NULL || inDB->restTags == NULL ) {
+            return 1;
+            }
+        }
+
+    if( fseeko( inDB->file, 0, SEEK_END ) ) {
+        return 1;
+        }
+
+    uint64_t fileSize = ftello( inDB->file );
+
+    uint32_t sizes[2] = { inKeySize, inValueSize };
+
+    if( fileSize < TILEDB_HEADER_SIZE ) {
+        if( inDB->readOnly ) {
+            printf( "Tiledb file %s has no header, can't open it "
+                    "read-only\n", inPath );
+            return 1;
+            }
+
+        if( fseeko( inDB->file, 0, SEEK_SET ) ||
+            fwrite( magicString, 3, 1, inDB->file ) != 1 ||
+            fwrite( sizes, sizeof( sizes ), 1, inDB->file ) != 1 ) {
+            return 1;
+            }
+        inDB->lastWasWrite = true;
+        return 0;
+        }
+
+    char magic[3];
+    uint32_t fileSizes[2];
+
+    if( fseeko( inDB->file, 0, SEEK_SET ) ||
+        fread( magic, 3, 1, inDB->file ) != 1 ||
+        fread( fileSizes, sizeof( fileSizes ), 1, inDB->file ) != 1 ) {
+        return 1;
+        }
+
+    if( memcmp( magic, magicString, 3 ) != 0 ||
+        fileSizes[0] != inKeySize || fileSizes[1] != inValueSize ) {
+        printf( "Tiledb file %s is not a lineardb3 file with %u-byte keys "
+                "and %u-byte values\n", inPath, inKeySize, inValueSize );
+        return 1;
+        }
+
+    uint64_t numRecordsInFile =
+        ( fileSize - TILEDB_HEADER_SIZE ) / inDB->recordSizeBytes;
+
+    if( numRecordsInFile >= NO_RECORD ) {
+        printf( "Tiledb file %s has too many records\n", inPath );
+        return 1;
+        }
+
+    uint64_t wholeSize = getRecordPos( inDB, numRecordsInFile );
+
+    if( wholeSize != fileSize && ! inDB->readOnly ) {
+        // appending after it would misalign every new record
+        printf( "Tiledb file %s has a partial record at the end, open it "
+                "with lineardb3 once to repair it\n", inPath );
+        return 1;
+        }
+
+    if( inDB->readOnly && mapFile( inDB, wholeSize ) != 0 ) {
+        printf( "Failed to map tiledb file %s\n", inPath );
+        return 1;
+        }
+
+    if( indexFile( inDB, (TILEDB_RecordIndex)numRecordsInFile ) != 0 ) {
+        printf( "Failed to index tiledb file %s\n", inPath );
+        return 1;
+        }
+
+    inDB->numRecords = (TILEDB_RecordIndex)numRecordsInFile;
+
+    return 0;
+    }
+
+
+
+void TILEDB_close( TILEDB *inDB ) {
+    if( inDB->tiles != NULL ) {
+        for( uint64_t i=0; i<inDB->tableSize; i++ ) {
+            free( inDB->tiles[i].cells );
+            }
+        free( inDB->tiles );
+        inDB->tiles = NULL;
+        }
+
+    free( inDB->next );
+    inDB->next = NULL;
+
+    free( inDB->restTags );
+    inDB->restTags = NULL;
+
+    if( inDB->recordBuffer != NULL ) {
+        delete [] inDB->recordBuffer;
+        inDB->recordBuffer = NULL;
+        }
+
+    if( inDB->mappedFile != NULL ) {
+#ifdef TILEDB_HAS_MMAP
+        munmap( inDB->mappedFile, inDB->mappedFileSize );
+#else
+        delete [] inDB->mappedFile;
+#endif
+        inDB->mappedFile = NULL;
+        }
+
+    if( inDB->file != NULL ) {
+        fclose( inDB->file );
+        inDB->file = NULL;
+        }
+    }
+
+
+
+int TILEDB_get( TILEDB *inDB, const void *inKey, void *outValue ) {
+    TILEDB_RecordIndex index;
+
+    int result = findRecord( inDB, inKey, &index );
+
+    if( result != 0 ) {
+        return result;
+        }
+
+    return readRecordPart( inDB, index, inDB->keySize, inDB->valueSize,
+                           outValue );
+    }
+
+
+
+int TILEDB_put( TILEDB *inDB, const void *inKey, const void *inValue ) {
+    if( inDB->readOnly ) {
+        return -1;
+        }
+
+    TILEDB_RecordIndex index;
+
+    int result = findRecord( inDB, inKey, &index );
+
+    if( result == -1 ) {
+        return -1;
+        }
+
+    if( result == 0 ) {
+        // replace value in place
+        return writeRecordPart( inDB, index, inDB->keySize, inDB->valueSize,
+                                inValue );
+        }
+
+    if( inDB->numRecords + (uint64_t)1 >= NO_RECORD ) {
+        return -1;
+        }
+
+    // new record at end of file
+    index = inDB->numRecords;
+
+    memcpy( inDB->recordBuffer, inKey, inDB->keySize );
+    memcpy( &( inDB->recordBuffer[ inDB->keySize ] ), inValue,
+            inDB->valueSize );
+
+    if( writeRecordPart( inDB, index, 0, inDB->recordSizeBytes,
+                         inDB->recordBuffer ) != 0 ||
+        indexRecord( inDB, index, inKey ) != 0 ) {
+        return -1;
+        }
+
+    inDB->numRecords++;
+    return 0;
+    }
+
+
+
+TILEDB_RecordIndex TILEDB_getNumRecords( TILEDB *inDB ) {
+    return inDB->numRecords;
+    }
+
+
+
+uint64_t TILEDB_getRAMUsage( TILEDB *inDB ) {
+    uint64_t total = inDB->tableSize * sizeof( TILEDB_Tile );
+
+    for( uint64_t i=0; i<inDB->tableSize; i++ ) {
+        total += inDB->tiles[i].cellsCapacity * sizeof( TILEDB_RecordIndex );
+        }
+
+    total += inDB->nextCapacity * 
+        ( sizeof( TILEDB_RecordIndex ) + sizeof( uint8_t ) );
+
+    return total;
+    }
+
+
+
+void TILEDB_Iterator_init( TILEDB *inDB, TILEDB_Iterator *inDBi ) {
+    inDBi->db = inDB;
+    inDBi->nextRecordIndex = 0;
+    }
+
+
+
+int TILEDB_Iterator_next( TILEDB_Iterator *inDBi,
+                          void *outKey, void *outValue ) {
+    TILEDB *db = inDBi->db;
+
+    if( inDBi->nextRecordIndex >= db->numRecords ) {
+        return 0;
+        }
+
+    if( readRecordPart( db, inDBi->nextRecordIndex, 0, db->keySize,
+                        outKey ) != 0 ||
+        readRecordPart( db, inDBi->nextRecordIndex, db->keySize,
+                        db->valueSize, outValue ) != 0 ) {
+        return -1;
+        }
+
+    inDBi->nextRecordIndex++;
+    return 1;
+    }
@@ -0,0 +1,168 @@
+#ifndef TILEDB_H_INCLUDED
+#define TILEDB_H_INCLUDED
+
+// some compilers require this to access UINT32_MAX
+#define __STDC_LIMIT_MACROS
+#include <stdint.h>
+
+#include <stdio.h>
+
+
+// Key-value store for keys that start with two int32 tile coordinates
+// (x, y), like floor.db (x, y) and map.db (x, y, s, b).
+// 面向(x,y)坐标key的稀疏瓦片存储
+//
+// Uses the lineardb3 data file format, so the same files open with either
+// engine.  Instead of hashing whole keys, records are indexed by
+// coordinate: a hash table of 16x16 tiles, and inside each tile a 256-bit
+// map of occupied cells plus one record number per occupied cell, found
+// by counting set bits below the cell (popcount rank).  A lookup is one
+// tile probe, and the index costs about 4 bytes per occupied cell plus
+// a small fixed cost per tile, instead of a fingerprint and record number
+// per record at half load.
+//
+// Keys longer than 8 bytes may have many records per cell (many s, b on
+// one x, y).  Those records are chained, newest first, each with an 8-bit
+// tag of the rest of the key kept in RAM, and only records whose tag
+// matches have the rest of the key compared against the data file.  So a
+// map.db lookup walks the cell's chain in RAM and reads about one record,
+// plus 1 in 256 of the others on that cell; unless the file is mapped
+// (read-only), each of those reads is an fseeko + fread.
+//
+// No write-ahead log: puts go straight to the data file.
+
+
+#define TILEDB_TILE_BITS 4
+#define TILEDB_TILE_SIZE ( 1 << TILEDB_TILE_BITS )
+#define TILEDB_CELLS_PER_TILE ( TILEDB_TILE_SIZE * TILEDB_TILE_SIZE )
+
+
+typedef uint32_t TILEDB_RecordIndex;
+
+
+
+typedef struct {
+        // tile coordinates, x / 16 and y / 16 rounded down
+        int32_t tileX;
+        int32_t tileY;
+
+        // bit c set if cell c (x % 16 + 16 * (y % 16)) has records
+        uint64_t occupied[ TILEDB_CELLS_PER_TILE / 64 ];
+
+        // record number (head of chain for long keys) of each
+        // occupied cell, in cell order, NULL for empty table slot
+        TILEDB_RecordIndex *cells;
+        uint16_t numCells;
+        uint16_t cellsCapacity;
+    } TILEDB_Tile;
+
+
+
+typedef struct {
+        unsigned int keySize;
+        unsigned int valueSize;
+        unsigned int recordSizeBytes;
+
+        TILEDB_RecordIndex numRecords;
+
+        FILE *file;
+
+        // for deciding when fseek is needed between reads and writes
+        char lastWasWrite;
+
+        uint8_t *recordBuffer;
+
+        // tile hash table, power of 2 size, at most half full 瓦片哈希表
+        TILEDB_Tile *tiles;
+        uint64_t tableSize;
+        uint64_t numTiles;
+
+        // keys longer than 8 bytes only, NULL otherwise:
+        // next older record on same cell, by record number
+        TILEDB_RecordIndex *next;
+        // tag of rest of each record's key, same size as next 标签
+        uint8_t *restTags;
+        uint64_t nextCapacity;
+
+        // opened with TILEDB_OPEN_READ_ONLY
+        char readOnly;
+
+        // read-only only: whole data file mapped into memory, NULL otherwise
+        uint8_t *mappedFile;
+        uint64_t mappedFileSize;
+    } TILEDB;
+
+
+
+// flags for inMode in TILEDB_open
+
+// Open existing file for lookups only, with data file mapped into memory,
+// so TILEDB_get may be used from many threads at once.  TILEDB_put fails.
+#define TILEDB_OPEN_READ_ONLY   0x01
+
+
+
+/**
+ * Open database, creating it if needed (unless read-only), and index
+ * every record already in the file.
+ * 打开数据库
+ *
+ * @param inKeySize at least 8, key starts with int32 x and y
+ * @return 0 on success, 1 on failure
+ */
+int TILEDB_open( TILEDB *inDB, const char *inPath, int inMode,
+                 unsigned int inKeySize, unsigned int inValueSize );
+
+
+void TILEDB_close( TILEDB *inDB );
+
+
+
+/**
+ * @return 0 on success, 1 on not found, -1 on error
+ */
+int TILEDB_get( TILEDB *inDB, const void *inKey, void *outValue );
+
+
+
+/**
+ * Insert or replace.
+ *
+ * @return 0 on success, -1 on error
+ */
+int TILEDB_put( TILEDB *inDB, const void *inKey, const void *inValue );
+
+
+
+TILEDB_RecordIndex TILEDB_getNumRecords( TILEDB *inDB );
+
+
+
+/**
+ * Bytes of RAM used by the tile index.
+ * 索引占用的内存字节数
+ */
+uint64_t TILEDB_getRAMUsage( TILEDB *inDB );
+
+
+
+// iterates over every record in data file order
+typedef struct {
+        TILEDB *db;
+        TILEDB_RecordIndex nextRecordIndex;
+    } TILEDB_Iterator;
+
+
+void TILEDB_Iterator_init( TILEDB *inDB, TILEDB_Iterator *inDBi );
+
+
+/**
+ * @return 0 if there are no more entries, negative on error,
+ *         positive if outKey and outValue have been filled
+ */
+int TILEDB_Iterator_next( TILEDB_Iterator *inDBi,
+                          void *outKey, void *outValue );
+
+
+
+#endif
@@ -10,6 +10,10 @@ public:
         start_ = clock::now();
     }
 
+    long long elapsedMs() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start_).count();
+    }
+
     void elapsed() const {
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start_).count();
         printf("Time taken: %lld ms\n", duration);